@@ -26,6 +26,7 @@
 # include <string>
 #endif
 
+#include "XmlRpcBinding.h"
 #include "XmlRpcClient.h"
 #include "XmlRpcException.h"
 #include "XmlRpcServer.h"
@@ -0,0 +1,580 @@
+
+#ifndef _XMLRPCBINDING_H_
+#define _XMLRPCBINDING_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+// XmlRpc++ Copyright (c) 2016 by Philip Meulengracht
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+#ifndef MAKEDEPEND
+# include <functional>
+# include <string>
+# include <tuple>
+# include <type_traits>
+# include <vector>
+# include <stdio.h>
+# include <string.h>
+# include <time.h>
+#endif
+
+#include "XmlRpcException.h"
+#include "XmlRpcServer.h"
+#include "XmlRpcServerMethod.h"
+#include "XmlRpcUtil.h"
+#include "XmlRpcValue.h"
+
+namespace XmlRpc {
+
+  //! Conversions between a native C++ type and xml-rpc values. Specializations
+  //! exist for bool, int, double, std::string, struct tm, XmlRpcValue::BinaryData,
+  //! XmlRpcValue and std::vector of any of these. Each one provides
+  //!
+  //!   static bool fromValue(XmlRpcValue& v, T& out);      false on a type mismatch
+  //!   static void toValue(T const& in, XmlRpcValue& v);
+  //!   static bool fromXml(std::string const& xml, int* offset, T& out);
+  //!   static void toXml(T const& in, std::string& xml);
+  //!
+  //! fromXml decodes the <value> at *offset and updates offset to the char after
+  //! it, or leaves offset alone and returns false. toXml appends a <value>.
+  //! Any other type is treated as a struct described by an XmlRpcSchema.
+  template<typename T> struct XmlRpcTraits;
+
+
+  //! The list of fields of a C++ struct marshalled as an xml-rpc struct.
+  //! Specializations are declared with the XMLRPC_STRUCT macros below, and provide
+  //!   template<typename V> static void fields(V& v);
+  //! calling v(name, nameLength, memberTag, pointer to member) for each field.
+  template<typename T> struct XmlRpcSchema;
+
+//! Declare the fields of a struct for marshalling, at global scope, eg
+//!   XMLRPC_STRUCT_BEGIN(Point)
+//!     XMLRPC_STRUCT_FIELD(x)
+//!     XMLRPC_STRUCT_FIELD(y)
+//!   XMLRPC_STRUCT_END()
+//! The <member><name>..</name> tags are string literals built at compile time.
+#define XMLRPC_STRUCT_BEGIN(type) \
+  namespace XmlRpc { \
+    template<> struct XmlRpcSchema< type > { \
+      typedef type Type; \
+      template<typename V> static void fields(V& v) {
+#define XMLRPC_STRUCT_FIELD(field) \
+        v(#field, int(sizeof(#field)) - 1, "<member><name>" #field "</name>", &Type::field);
+#define XMLRPC_STRUCT_END() \
+      } \
+    }; \
+  }
+
+
+  // Types held directly by an XmlRpcValue. Decoding from xml goes through
+  // a value on the stack, which does not allocate for the numeric types.
+  template<typename T, XmlRpcValue::Type VT>
+  struct XmlRpcScalarTraits {
+    static bool fromValue(XmlRpcValue& v, T& out)
+    {
+      if (v.getType() != VT) return false;
+      out = static_cast<T&>(v);
+      return true;
+    }
+
+    static void toValue(T const& in, XmlRpcValue& v) { v = XmlRpcValue(in); }
+
+    static bool fromXml(std::string const& xml, int* offset, T& out)
+    {
+      int savedOffset = *offset;
+      XmlRpcValue v;
+      if ( ! v.fromXml(xml, offset) || ! XmlRpcTraits<T>::fromValue(v, out)) {
+        *offset = savedOffset;
+        return false;
+      }
+      return true;
+    }
+
+    static void toXml(T const& in, std::string& xml)
+    {
+      XmlRpcValue v;
+      XmlRpcTraits<T>::toValue(in, v);
+      xml += v.toXml();
+    }
+  };
+
+  template<> struct XmlRpcTraits<bool> : XmlRpcScalarTraits<bool, XmlRpcValue::TypeBoolean> {};
+  template<> struct XmlRpcTraits<int> : XmlRpcScalarTraits<int, XmlRpcValue::TypeInt> {};
+
+  // Integer values are accepted where a double is expected
+  template<> struct XmlRpcTraits<double> : XmlRpcScalarTraits<double, XmlRpcValue::TypeDouble> {
+    static bool fromValue(XmlRpcValue& v, double& out)
+    {
+      if (v.getType() == XmlRpcValue::TypeInt)
+        out = int(v);
+      else if (v.getType() == XmlRpcValue::TypeDouble)
+        out = double(v);
+      else
+        return false;
+      return true;
+    }
+  };
+
+  template<> struct XmlRpcTraits<std::string> : XmlRpcScalarTraits<std::string, XmlRpcValue::TypeString> {
+    // The decoded string is swapped out of the temporary value rather than copied
+    static bool fromXml(std::string const& xml, int* offset, std::string& out)
+    {
+      int savedOffset = *offset;
+      XmlRpcValue v;
+      if ( ! v.fromXml(xml, offset) || v.getType() != XmlRpcValue::TypeString) {
+        *offset = savedOffset;
+        return false;
+      }
+      out.swap(static_cast<std::string&>(v));
+      return true;
+    }
+  };
+
+  template<> struct XmlRpcTraits<struct tm> : XmlRpcScalarTraits<struct tm, XmlRpcValue::TypeDateTime> {
+    static void toValue(struct tm const& in, XmlRpcValue& v)
+    {
+      struct tm t = in;
+      v = XmlRpcValue(&t);
+    }
+  };
+
+  template<> struct XmlRpcTraits<XmlRpcValue::BinaryData> : XmlRpcScalarTraits<XmlRpcValue::BinaryData, XmlRpcValue::TypeBase64> {
+    static void toValue(XmlRpcValue::BinaryData const& in, XmlRpcValue& v)
+    {
+      XmlRpcValue::BinaryData data(in);
+      v = XmlRpcValue(data.empty() ? 0 : &data[0], int(data.size()));
+    }
+  };
+
+  // Untyped values are passed through as they are
+  template<> struct XmlRpcTraits<XmlRpcValue> {
+    static bool fromValue(XmlRpcValue& v, XmlRpcValue& out) { out = v; return true; }
+    static void toValue(XmlRpcValue const& in, XmlRpcValue& v) { v = in; }
+    static bool fromXml(std::string const& xml, int* offset, XmlRpcValue& out) { return out.fromXml(xml, offset); }
+    static void toXml(XmlRpcValue const& in, std::string& xml) { xml += in.toXml(); }
+  };
+
+  // Arrays. Elements are decoded straight into the vector.
+  template<typename T>
+  struct XmlRpcTraits< std::vector<T> > {
+    static bool fromValue(XmlRpcValue& v, std::vector<T>& out)
+    {
+      if (v.getType() != XmlRpcValue::TypeArray) return false;
+      int n = v.size();
+      out.resize(n);
+      for (int i=0; i<n; ++i)
+        if ( ! XmlRpcTraits<T>::fromValue(v[i], out[i]))
+          return false;
+      return true;
+    }
+
+    static void toValue(std::vector<T> const& in, XmlRpcValue& v)
+    {
+      v.clear();
+      v.setSize(int(in.size()));
+      for (size_t i=0; i<in.size(); ++i)
+        XmlRpcTraits<T>::toValue(in[i], v[int(i)]);
+    }
+
+    static bool fromXml(std::string const& xml, int* offset, std::vector<T>& out)
+    {
+      int savedOffset = *offset;
+      if ( ! XmlRpcUtil::nextTagIs("<value>", xml, offset) ||
+           ! XmlRpcUtil::nextTagIs("<array>", xml, offset) ||
+           ! XmlRpcUtil::nextTagIs("<data>", xml, offset)) {
+        *offset = savedOffset;
+        return false;
+      }
+
+      out.clear();
+      while ( ! XmlRpcUtil::nextTagIs("</data>", xml, offset)) {
+        out.push_back(T());
+        if ( ! XmlRpcTraits<T>::fromXml(xml, offset, out.back())) {
+          *offset = savedOffset;
+          return false;
+        }
+      }
+
+      // Skip over the </value> tag
+      XmlRpcUtil::findTag("</value>", xml, offset);
+      return true;
+    }
+
+    static void toXml(std::vector<T> const& in, std::string& xml)
+    {
+      xml += "<value><array><data>";
+      for (size_t i=0; i<in.size(); ++i)
+        XmlRpcTraits<T>::toXml(in[i], xml);
+      xml += "</data></array></value>";
+    }
+  };
+
+
+  // Structs with an XmlRpcSchema. They are encoded straight from the fields and
+  // decoded straight into them, without building a tree of values. Members are
+  // matched by name and may arrive in any order; every field must be present
+  // exactly once, members that are not fields are skipped.
+  template<typename T>
+  struct XmlRpcTraits {
+    static bool fromValue(XmlRpcValue& v, T& out)
+    {
+      if (v.getType() != XmlRpcValue::TypeStruct) return false;
+      ValueReader reader(v, out);
+      XmlRpcSchema<T>::fields(reader);
+      return reader._ok;
+    }
+
+    static void toValue(T const& in, XmlRpcValue& v)
+    {
+      v.clear();
+      ValueWriter writer(v, in);
+      XmlRpcSchema<T>::fields(writer);
+    }
+
+    static bool fromXml(std::string const& xml, int* offset, T& out)
+    {
+      int savedOffset = *offset;
+      if ( ! XmlRpcUtil::nextTagIs("<value>", xml, offset) ||
+           ! XmlRpcUtil::nextTagIs("<struct>", xml, offset)) {
+        *offset = savedOffset;
+        return false;
+      }
+
+      FieldCounter counter;
+      XmlRpcSchema<T>::fields(counter);
+      std::vector<bool> seen(counter._n, false);
+      int nFound = 0;
+
+      while (XmlRpcUtil::nextTagIs("<member>", xml, offset)) {
+        // Locate the name in place
+        if ( ! XmlRpcUtil::nextTagIs("<name>", xml, offset)) {
+          *offset = savedOffset;
+          return false;
+        }
+        size_t nameEnd = xml.find("</name>", *offset);
+        if (nameEnd == std::string::npos) {
+          *offset = savedOffset;
+          return false;
+        }
+        XmlReader reader(xml, offset, out, xml.c_str() + *offset, int(nameEnd - *offset));
+        *offset = int(nameEnd) + 7;
+
+        XmlRpcSchema<T>::fields(reader);
+        if (reader._matched && reader._ok && ! seen[reader._field]) {
+          seen[reader._field] = true;
+          ++nFound;
+        }
+        else if (reader._matched || ! XmlRpcValue().fromXml(xml, offset)) {
+          *offset = savedOffset;    // Bad or repeated field, or bad value of an unknown member
+          return false;
+        }
+
+        (void) XmlRpcUtil::nextTagIs("</member>", xml, offset);
+      }
+
+      // Skip over the </struct></value> tags
+      XmlRpcUtil::findTag("</value>", xml, offset);
+
+      if (nFound < counter._n) {
+        *offset = savedOffset;
+        return false;
+      }
+      return true;
+    }
+
+    static void toXml(T const& in, std::string& xml)
+    {
+      XmlWriter writer(xml, in);
+      xml += "<value><struct>";
+      XmlRpcSchema<T>::fields(writer);
+      xml += "</struct></value>";
+    }
+
+  private:
+    struct FieldCounter {
+      FieldCounter() : _n(0) {}
+      template<typename F>
+      void operator()(const char*, int, const char*, F T::*) { ++_n; }
+      int _n;
+    };
+
+    struct ValueReader {
+      ValueReader(XmlRpcValue& v, T& out) : _v(v), _out(out), _ok(true) {}
+      template<typename F>
+      void operator()(const char* name, int, const char*, F T::* field)
+      {
+        if (_ok)
+          _ok = _v.hasMember(name) && XmlRpcTraits<F>::fromValue(_v[name], _out.*field);
+      }
+      XmlRpcValue& _v;
+      T& _out;
+      bool _ok;
+    };
+
+    struct ValueWriter {
+      ValueWriter(XmlRpcValue& v, T const& in) : _v(v), _in(in) {}
+      template<typename F>
+      void operator()(const char* name, int, const char*, F T::* field)
+      { XmlRpcTraits<F>::toValue(_in.*field, _v[name]); }
+      XmlRpcValue& _v;
+      T const& _in;
+    };
+
+    // Decodes the member value into the field with a matching name
+    struct XmlReader {
+      XmlReader(std::string const& xml, int* offset, T& out, const char* name, int nameLength) :
+        _xml(xml), _offset(offset), _out(out), _name(name), _nameLength(nameLength),
+        _index(0), _field(-1), _matched(false), _ok(false) {}
+      template<typename F>
+      void operator()(const char* name, int nameLength, const char*, F T::* field)
+      {
+        if ( ! _matched && nameLength == _nameLength && strncmp(name, _name, nameLength) == 0) {
+          _matched = true;
+          _field = _index;
+          _ok = XmlRpcTraits<F>::fromXml(_xml, _offset, _out.*field);
+        }
+        ++_index;
+      }
+      std::string const& _xml;
+      int* _offset;
+      T& _out;
+      const char* _name;
+      int _nameLength;
+      int _index;     // Position of the next field in the schema
+      int _field;     // Position of the matched field
+      bool _matched;
+      bool _ok;
+    };
+
+    struct XmlWriter {
+      XmlWriter(std::string& xml, T const& in) : _xml(xml), _in(in) {}
+      template<typename F>
+      void operator()(const char*, int, const char* memberTag, F T::* field)
+      {
+        _xml += memberTag;
+        XmlRpcTraits<F>::toXml(_in.*field, _xml);
+        _xml += "</member>";
+      }
+      std::string& _xml;
+      T const& _in;
+    };
+  };
+
+
+  //! Encode a native value as an xml-rpc <value>.
+  template<typename T>
+  std::string toXml(T const& in)
+  {
+    std::string xml;
+    XmlRpcTraits<T>::toXml(in, xml);
+    return xml;
+  }
+
+  //! Decode the xml-rpc <value> at *offset into a native value. Updates offset
+  //! to the char after the value, returns false if it does not match the type.
+  template<typename T>
+  bool fromXml(std::string const& xml, int* offset, T& out)
+  {
+    return XmlRpcTraits<T>::fromXml(xml, offset, out);
+  }
+
+  //! Convert a native value to an XmlRpcValue, eg to pass it to XmlRpcClient::execute.
+  template<typename T>
+  XmlRpcValue toValue(T const& in)
+  {
+    XmlRpcValue v;
+    XmlRpcTraits<T>::toValue(in, v);
+    return v;
+  }
+
+  //! Convert an XmlRpcValue to a native value, returns false if it does not match the type.
+  template<typename T>
+  bool fromValue(XmlRpcValue& v, T& out)
+  {
+    return XmlRpcTraits<T>::fromValue(v, out);
+  }
+
+
+  // Compile time list of argument positions, used to expand the argument tuple
+  template<int... I> struct XmlRpcIndices {};
+
+  template<int N, int... I>
+  struct XmlRpcMakeIndices : XmlRpcMakeIndices<N-1, N-1, I...> {};
+
+  template<int... I>
+  struct XmlRpcMakeIndices<0, I...> { typedef XmlRpcIndices<I...> type; };
+
+
+  // Calls the function and stores its result. void results become an empty string,
+  // as the server does for methods that leave the result unset.
+  template<typename R>
+  struct XmlRpcInvoker {
+    template<typename F, typename Tuple, int... I>
+    static void toValue(F& fn, Tuple& args, XmlRpcIndices<I...>, XmlRpcValue& result)
+    { XmlRpcTraits<R>::toValue(fn(std::get<I>(args)...), result); }
+
+    template<typename F, typename Tuple, int... I>
+    static void toXml(F& fn, Tuple& args, XmlRpcIndices<I...>, std::string& xml)
+    { XmlRpcTraits<R>::toXml(fn(std::get<I>(args)...), xml); }
+  };
+
+  template<>
+  struct XmlRpcInvoker<void> {
+    template<typename F, typename Tuple, int... I>
+    static void toValue(F& fn, Tuple& args, XmlRpcIndices<I...>, XmlRpcValue& result)
+    { fn(std::get<I>(args)...); result = std::string(); }
+
+    template<typename F, typename Tuple, int... I>
+    static void toXml(F& fn, Tuple& args, XmlRpcIndices<I...>, std::string& xml)
+    { fn(std::get<I>(args)...); xml += XmlRpcValue(std::string()).toXml(); }
+  };
+
+
+  //! A method calling a C++ function with its parameters converted to native
+  //! types. The arity and types of the parameters are checked before the call,
+  //! and a fault is returned to the client if they do not match.
+  //! Requests are decoded straight from the xml into the argument types,
+  //! without building an array of parameter values first.
+  template<typename R, typename... Args>
+  class XmlRpcBoundMethod : public XmlRpcServerMethod {
+  public:
+    typedef std::function<R(Args...)> Function;
+    typedef std::tuple<typename std::decay<Args>::type...> ArgumentTuple;
+    typedef typename XmlRpcMakeIndices<sizeof...(Args)>::type Indices;
+
+    //! Constructor
+    XmlRpcBoundMethod(std::string const& name, XmlRpcServer* server,
+                      Function const& fn, std::string const& help = std::string()) :
+      XmlRpcServerMethod(name, server), _fn(fn), _help(help) {}
+
+    //! Execute the method with already decoded parameters (eg within a multicall)
+    virtual void execute(XmlRpcValue& params, XmlRpcValue& result)
+    {
+      int nArgs = params.valid() ? params.size() : 0;
+      if (nArgs != int(sizeof...(Args)))
+        throwArityError(nArgs);
+
+      ArgumentTuple args;
+      unpack(params, args, Indices());
+      XmlRpcInvoker<R>::toValue(_fn, args, Indices(), result);
+    }
+
+    //! Execute the method with its parameters still encoded in the request
+    virtual std::string executeXml(std::string const& request, int* offset)
+    {
+      ArgumentTuple args;
+      int nArgs = 0;
+      if (XmlRpcUtil::findTag("<params>", request, offset))
+        nArgs = decode(request, offset, args, Indices());
+
+      if (nArgs != int(sizeof...(Args)))
+        throwArityError(nArgs);
+
+      std::string resultXml;
+      XmlRpcInvoker<R>::toXml(_fn, args, Indices(), resultXml);
+      return resultXml;
+    }
+
+    virtual std::string help() { return _help; }
+
+  protected:
+    template<int... I>
+    void unpack(XmlRpcValue& params, ArgumentTuple& args, XmlRpcIndices<I...>)
+    {
+      int ok[] = { 0, unpackOne(params[I], std::get<I>(args), I)... };
+      (void) ok;
+    }
+
+    template<typename T>
+    int unpackOne(XmlRpcValue& param, T& arg, int i)
+    {
+      if ( ! XmlRpcTraits<T>::fromValue(param, arg))
+        throwTypeError(i);
+      return 0;
+    }
+
+    // Decode the <param>s in order, returns the number found
+    template<int... I>
+    int decode(std::string const& request, int* offset, ArgumentTuple& args, XmlRpcIndices<I...>)
+    {
+      int nArgs = 0;
+      int ok[] = { 0, decodeOne(request, offset, std::get<I>(args), I, &nArgs)... };
+      (void) ok;
+
+      // Count any extra parameters for the error message
+      if (nArgs == int(sizeof...(Args))) {
+        XmlRpcValue extra;
+        while (XmlRpcUtil::nextTagIs("<param>", request, offset) && extra.fromXml(request, offset)) {
+          (void) XmlRpcUtil::nextTagIs("</param>", request, offset);
+          ++nArgs;
+        }
+      }
+      return nArgs;
+    }
+
+    template<typename T>
+    int decodeOne(std::string const& request, int* offset, T& arg, int i, int* nArgs)
+    {
+      if (*nArgs < i || ! XmlRpcUtil::nextTagIs("<param>", request, offset))
+        return 0;     // Too few parameters, reported by the caller
+
+      if ( ! XmlRpcTraits<T>::fromXml(request, offset, arg))
+        throwTypeError(i);
+
+      (void) XmlRpcUtil::nextTagIs("</param>", request, offset);
+      ++*nArgs;
+      return 0;
+    }
+
+    void throwArityError(int nArgs)
+    {
+      char buf[80];
+      snprintf(buf, sizeof(buf), ": Invalid argument count (expected %d, got %d)", int(sizeof...(Args)), nArgs);
+      throw XmlRpcException(_name + buf);
+    }
+
+    void throwTypeError(int i)
+    {
+      char buf[80];
+      snprintf(buf, sizeof(buf), ": Invalid argument type for parameter %d", i + 1);
+      throw XmlRpcException(_name + buf);
+    }
+
+    Function _fn;
+    std::string _help;
+  };
+
+
+  // Deduce the signature of a function pointer or of a lambda's call operator
+  template<typename F>
+  struct XmlRpcFunctionTraits : XmlRpcFunctionTraits<decltype(&F::operator())> {};
+
+  template<typename R, typename... Args>
+  struct XmlRpcFunctionTraits<R (*)(Args...)> { typedef XmlRpcBoundMethod<R, Args...> Method; };
+
+  template<typename R, typename... Args>
+  struct XmlRpcFunctionTraits< std::function<R(Args...)> > { typedef XmlRpcBoundMethod<R, Args...> Method; };
+
+  template<typename C, typename R, typename... Args>
+  struct XmlRpcFunctionTraits<R (C::*)(Args...) const> { typedef XmlRpcBoundMethod<R, Args...> Method; };
+
+  template<typename C, typename R, typename... Args>
+  struct XmlRpcFunctionTraits<R (C::*)(Args...)> { typedef XmlRpcBoundMethod<R, Args...> Method; };
+
+
+  // Create a method calling fn and add it to the server, which owns it
+  template<typename F>
+  XmlRpcServerMethod*
+  XmlRpcServer::bind(std::string const& name, F fn, std::string const& help)
+  {
+    typedef typename XmlRpcFunctionTraits<typename std::decay<F>::type>::Method Method;
+    XmlRpcServerMethod* method = new Method(name, 0, fn, help);
+    adoptMethod(method);
+    return method;
+  }
+
+} // namespace XmlRpc
+
+#endif // _XMLRPCBINDING_H_
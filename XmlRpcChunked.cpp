@@ -0,0 +1,129 @@
+
+#include "XmlRpcChunked.h"
+#include "XmlRpcUtil.h"
+
+#ifndef MAKEDEPEND
+# include <ctype.h>
+# include <stdio.h>
+# include <string.h>
+#endif
+
+namespace XmlRpc {
+
+
+  // Longest chunk size or trailer line accepted
+  static const int MAX_LINE = 1024;
+
+  // Largest chunk accepted
+  static const long MAX_CHUNK = 0x7fffffffL;
+
+
+  void
+  XmlRpcChunked::reset()
+  {
+    _state = SIZE;
+    _line.clear();
+    _remaining = 0;
+  }
+
+
+  // Parse a chunk size line, ignoring any chunk extensions
+  static bool
+  parseChunkSize(std::string const& line, int* size)
+  {
+    long n = 0;
+    size_t i = 0;
+    for (; i < line.length(); ++i) {
+      char c = line[i];
+      int digit;
+      if (c >= '0' && c <= '9') digit = c - '0';
+      else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+      else break;
+
+      n = n * 16 + digit;
+      if (n > MAX_CHUNK)
+        return false;
+    }
+    if (i == 0 || (i < line.length() && line[i] != ';' && line[i] != ' ' && line[i] != '\t'))
+      return false;
+
+    *size = int(n);
+    return true;
+  }
+
+
+  bool
+  XmlRpcChunked::decode(const char* data, int length, std::string& out)
+  {
+    const char* cp = data;
+    const char* ep = data + length;
+
+    while (cp < ep && _state != DONE) {
+      if (_state == DATA) {
+        int n = int(ep - cp);
+        if (n > _remaining) n = _remaining;
+        out.append(cp, n);
+        cp += n;
+        _remaining -= n;
+        if (_remaining == 0)
+          _state = DATA_END;
+        continue;
+      }
+
+      // The other states consume lines
+      char c = *cp++;
+      if (c != '\n') {
+        if (c != '\r')
+          _line += c;
+        if (int(_line.length()) > MAX_LINE) {
+          XmlRpcUtil::error("XmlRpcChunked::decode: line too long.");
+          return false;
+        }
+        continue;
+      }
+
+      if (_state == SIZE) {
+        if ( ! parseChunkSize(_line, &_remaining)) {
+          XmlRpcUtil::error("XmlRpcChunked::decode: invalid chunk size.");
+          return false;
+        }
+        _state = (_remaining > 0) ? DATA : TRAILER;
+      } else if (_state == DATA_END) {
+        if ( ! _line.empty()) {
+          XmlRpcUtil::error("XmlRpcChunked::decode: missing end of chunk.");
+          return false;
+        }
+        _state = SIZE;
+      } else if (_state == TRAILER) {
+        // Trailer fields are not used, the body ends with an empty line
+        if (_line.empty())
+          _state = DONE;
+      }
+      _line.clear();
+    }
+
+    return true;
+  }
+
+
+  bool
+  XmlRpcChunked::isChunked(const char* value, int length)
+  {
+    while (length > 0 && isspace(value[length-1]))
+      --length;
+    return length >= 7 && strncasecmp(value + length - 7, "chunked", 7) == 0;
+  }
+
+
+  void
+  XmlRpcChunked::appendChunk(std::string& out, const char* data, int length)
+  {
+    char size[20];
+    sprintf(size, "%x\r\n", (unsigned) length);
+    out += size;
+    out.append(data, length);
+    out += "\r\n";    // The last chunk is followed by the empty trailer
+  }
+
+} // namespace XmlRpc
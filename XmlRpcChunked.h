@@ -0,0 +1,55 @@
+
+#ifndef _XMLRPCCHUNKED_H_
+#define _XMLRPCCHUNKED_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+// XmlRpc++ Copyright (c) 2016 by Philip Meulengracht
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+#ifndef MAKEDEPEND
+# include <string>
+#endif
+
+namespace XmlRpc {
+
+  //! HTTP/1.1 chunked transfer coding. An instance decodes one chunked body
+  //! incrementally, as it arrives from the socket.
+  class XmlRpcChunked {
+  public:
+    //! Constructor
+    XmlRpcChunked() { reset(); }
+
+    //! Prepare to decode a new body.
+    void reset();
+
+    //! Decode the next part of a chunked body, appending the data to out.
+    //! Bytes following the end of the body are ignored.
+    //!  @return false if the body is malformed
+    bool decode(const char* data, int length, std::string& out);
+
+    //! Returns true once the last chunk and the trailer have been decoded.
+    bool isComplete() const { return _state == DONE; }
+
+    //! Returns true if a Transfer-Encoding header value ends with the chunked coding.
+    static bool isChunked(const char* value, int length);
+
+    //! Append data to out as a single chunk. A length of 0 appends the last
+    //! chunk, which ends the body.
+    static void appendChunk(std::string& out, const char* data, int length);
+
+  private:
+    enum State { SIZE, DATA, DATA_END, TRAILER, DONE };
+    State _state;
+
+    // The line being read (chunk size or trailer field)
+    std::string _line;
+
+    // Bytes of data left in the current chunk
+    int _remaining;
+  };
+} // namespace XmlRpc
+
+#endif // _XMLRPCCHUNKED_H_
@@ -31,7 +31,8 @@ const char XmlRpcClient::FAULT_TAG[] = "<fault>";
 
 
 
-XmlRpcClient::XmlRpcClient(const char* host, int port, const char* uri/*=0*/)
+XmlRpcClient::XmlRpcClient(const char* host, int port, const char* uri/*=0*/) :
+  _connectTimer(this)
 {
   XmlRpcUtil::log(1, "XmlRpcClient new client: host %s, port %d.", host, port);
 
@@ -44,10 +45,21 @@ XmlRpcClient::XmlRpcClient(const char* host, int port, const char* uri/*=0*/)
   _connectionState = NO_CONNECTION;
   _executing = false;
   _eof = false;
+  _headerLength = 0;
+  _connectPosted = false;
+  _cacheEnabled = false;
+  _cacheHits = 0;
+  _cacheMisses = 0;
+  _responseEncoding = XmlRpcCompression::Identity;
+  _chunked = false;
+  _compressionThreshold = -1;
+  _timeout = 0.0;
 
 #ifdef _OPENSSL_ENABLED
   _cleanupSSL = false;
   _sslHandle = NULL;
+  _sslConnected = false;
+  _verifyPeer = true;
 #endif
 
   // Default to keeping the connection open until an explicit close is done
@@ -61,8 +73,23 @@ XmlRpcClient::XmlRpcClient(const char* host, int port, const char* uri/*=0*/)
 }
 
 
+#if !defined(_WIN32)
+XmlRpcClient::XmlRpcClient(const char* path, const char* uri/*=0*/) :
+  XmlRpcClient("localhost", 0, uri)
+{
+  XmlRpcUtil::log(1, "XmlRpcClient: using unix socket %s.", path);
+  _path = path;
+}
+#endif
+
+
 XmlRpcClient::~XmlRpcClient()
 {
+  removeAttempts();
+#ifdef _OPENSSL_ENABLED
+  if (_sslHandle)
+    XmlRpcSocket::freeSSL(_sslHandle);
+#endif
 }
 
 // Close the owned fd
@@ -73,16 +100,29 @@ XmlRpcClient::close()
   _connectionState = NO_CONNECTION;
   _disp.exit();
   _disp.removeSource(this);
+  removeAttempts();
+  _race.cancel();
+  _disp.cancelTimer(&_connectTimer);
+#ifdef _OPENSSL_ENABLED
+  closeSSL();
+#endif
   XmlRpcSource::close();
+}
+
 
 #ifdef _OPENSSL_ENABLED
-  if (_cleanupSSL) {
-      SSL_shutdown((SSL*)_sslHandle);
-      SSL_free((SSL*)_sslHandle);
-      ERR_free_strings();
+// End TLS on the connection, before its socket is closed
+void
+XmlRpcClient::closeSSL()
+{
+  if (_sslHandle) {
+    XmlRpcSocket::shutdownSSL(_sslHandle);
+    XmlRpcSocket::freeSSL(_sslHandle);
+    _sslHandle = NULL;
   }
-#endif
+  _sslConnected = false;
 }
+#endif
 
 
 // Clear the referenced flag even if exceptions or errors occur.
@@ -113,24 +153,79 @@ XmlRpcClient::execute(const char* method, XmlRpcValue const& params, XmlRpcValue
   _sendAttempts = 0;
   _isFault = false;
 
-  if ( ! setupConnection())
+  if ( ! generateRequest(method, params))
     return false;
 
-  if ( ! generateRequest(method, params))
+  // Look for the result of an identical earlier call, keyed by the request body
+  const char* body = 0;
+  int bodyLength = 0;
+  unsigned long long key = 0;
+  if (_cacheEnabled) {
+    body = _request.c_str() + _headerLength;
+    bodyLength = int(_request.length()) - _headerLength;
+    key = XmlRpcUtil::hash(body, bodyLength);
+
+    CachedResult* cached = _cache.find(key);
+    if (cached && cached->_method == method && int(cached->_body.length()) == bodyLength &&
+        memcmp(cached->_body.data(), body, bodyLength) == 0) {
+      XmlRpcUtil::log(1, "XmlRpcClient::execute: method %s answered from cache.", method);
+      ++_cacheHits;
+      result = cached->_result;
+      return true;
+    }
+    ++_cacheMisses;
+  }
+
+  if ( ! setupConnection())
     return false;
 
   result.clear();
+  if (_timeout > 0.0)
+    _disp.armTimer(this, _timeout);
   double msTime = -1.0;   // Process until exit is called
   _disp.work(msTime);
+  _disp.cancelTimer(this);
 
   if (_connectionState != IDLE || ! parseResponse(result))
     return false;
 
+  if (body && ! _isFault) {
+    CachedResult cached;
+    cached._method = method;
+    cached._body.assign(body, bodyLength);
+    cached._result = result;
+    _cache.insert(key, cached);
+  }
+
   XmlRpcUtil::log(1, "XmlRpcClient::execute: method %s completed.", method);
   _response = "";
   return true;
 }
 
+// Cache the results of calls
+void
+XmlRpcClient::enableCache(double ttl, int maxEntries /*= 100*/)
+{
+  _cacheEnabled = (ttl > 0.0 && maxEntries > 0);
+  _cache.setLimits(_cacheEnabled ? maxEntries : 0, ttl);
+}
+
+// Discard all cached results
+void
+XmlRpcClient::invalidateCache()
+{
+  _cache.clear();
+}
+
+// Discard the cached results of calls to a method
+void
+XmlRpcClient::invalidateCache(const char* method)
+{
+  _cache.eraseIf([method](unsigned long long, CachedResult const& cached) {
+    return cached._method == method;
+  });
+}
+
 // XmlRpcSource interface implementation
 // Handle server responses. Called by the event dispatcher during execute.
 unsigned
@@ -147,20 +242,46 @@ XmlRpcClient::handleEvent(unsigned eventType)
     return 0;
   }
 
-  if (_connectionState == WRITE_REQUEST)
+#ifdef _OPENSSL_ENABLED
+  // The TLS handshake completes before the request is written
+  if (_sslHandle && ! _sslConnected) {
+    int status = XmlRpcSocket::handshakeSSL(_sslHandle);
+    if (status < 0) {
+      XmlRpcUtil::error("Error in XmlRpcClient::handleEvent: TLS handshake with %s failed.", _host.c_str());
+      return 0;
+    }
+    if (status == 0)
+      return XmlRpcSocket::getSSLEvents(_sslHandle);
+    _sslConnected = true;
+  }
+#endif
+
+  if (_connectionState == WRITE_REQUEST) {
     if ( ! writeRequest()) return 0;
 
+    // The response is not there yet, wait for it rather than trying to read
+    if (_connectionState == READ_HEADER)
+      return XmlRpcDispatch::ReadableEvent;
+  }
+
   if (_connectionState == READ_HEADER)
     if ( ! readHeader()) return 0;
 
   if (_connectionState == READ_RESPONSE)
     if ( ! readResponse()) return 0;
 
+#ifdef _OPENSSL_ENABLED
+  // A TLS read may need to write, or a write to read
+  if (_sslHandle && XmlRpcSocket::getSSLEvents(_sslHandle))
+    return XmlRpcSocket::getSSLEvents(_sslHandle);
+#endif
+
   // This should probably always ask for Exception events too
   return (_connectionState == WRITE_REQUEST) 
         ? XmlRpcDispatch::WritableEvent : XmlRpcDispatch::ReadableEvent;
 }
 
+#ifdef _OPENSSL_ENABLED
 // Initializes the SSL library, so we can use secure sockets
 // this means all connections made by this instance is HTTPS
 void
@@ -175,6 +296,7 @@ XmlRpcClient::enableSSL()
     OpenSSL_add_all_algorithms();
     _cleanupSSL = true;
 }
+#endif
 
 // Create the socket connection to the server if necessary
 bool 
@@ -190,55 +312,244 @@ XmlRpcClient::setupConnection()
       return false;
 
   // Prepare to write the request
-  _connectionState = WRITE_REQUEST;
   _bytesWritten = 0;
+  _disp.removeSource(this);       // Make sure nothing is left over
+
+  // The dispatcher races the host's addresses until one connects
+  if (_connectionState == CONNECTING) {
+    watchAttempts();
+    return true;
+  }
 
   // Notify the dispatcher to listen on this source (calls handleEvent when the socket is writable)
-  _disp.removeSource(this);       // Make sure nothing is left over
+  _connectionState = WRITE_REQUEST;
   _disp.addSource(this, XmlRpcDispatch::WritableEvent | XmlRpcDispatch::Exception);
 
   return true;
 }
 
 
+// Watch the connection attempts in progress, and the time the next one is due.
+// While the host is resolved in the background, its descriptor is watched.
+void
+XmlRpcClient::watchAttempts()
+{
+  int resolverFd = _race.getResolverFd();
+  if (resolverFd >= 0) {
+    ConnectAttempt* lookup = new ConnectAttempt(resolverFd, this);
+    _attempts.push_back(lookup);
+    _disp.addSource(lookup, XmlRpcDispatch::ReadableEvent);
+  }
+
+  std::vector<int> const& pending = _race.getPending();
+  for (size_t i = 0; i < pending.size(); ++i) {
+    ConnectAttempt* attempt = new ConnectAttempt(pending[i], this);
+    _attempts.push_back(attempt);
+    _disp.addSource(attempt, XmlRpcDispatch::WritableEvent | XmlRpcDispatch::Exception);
+  }
+
+  double delay = _race.getDelay();
+  if (delay >= 0.0)
+    _disp.armTimer(&_connectTimer, delay);
+}
+
+
+// Stop watching the connection attempts
+void
+XmlRpcClient::removeAttempts()
+{
+  for (size_t i = 0; i < _attempts.size(); ++i) {
+    _disp.removeSource(_attempts[i]);
+    delete _attempts[i];
+  }
+  _attempts.clear();
+}
+
+
+// An attempt or the lookup completed, the race is checked once the events have
+// been handled, when sources can be removed safely
+unsigned
+XmlRpcClient::ConnectAttempt::handleEvent(unsigned /*eventType*/)
+{
+  if ( ! _client->_connectPosted) {
+    _client->_connectPosted = true;
+    XmlRpcClient* client = _client;
+    client->_disp.post([client]() { client->_connectPosted = false; client->continueConnect(); });
+  }
+  return 0;
+}
+
+
+// Check the connection attempts, and start the call once one has connected
+void
+XmlRpcClient::continueConnect()
+{
+  if (_connectionState != CONNECTING)
+    return;
+
+  removeAttempts();
+  _disp.cancelTimer(&_connectTimer);
+
+  int fd = _race.check();
+  if (fd < 0 && _race.isFailed()) {
+    XmlRpcUtil::error("Error in XmlRpcClient::continueConnect: Could not connect to server (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    close();
+    return;
+  }
+  if (fd < 0) {
+    watchAttempts();
+    return;
+  }
+
+  if ( ! attachSocket(fd))
+    return;
+  _connectionState = WRITE_REQUEST;
+  _disp.addSource(this, XmlRpcDispatch::WritableEvent | XmlRpcDispatch::Exception);
+}
+
+
+// Start a call, the dispatcher completes it
+bool
+XmlRpcClient::executeNonBlock(const char* method, XmlRpcValue const& params)
+{
+  XmlRpcUtil::log(1, "XmlRpcClient::executeNonBlock: method %s (_connectionState %d).", method, _connectionState);
+
+  // This is not a thread-safe operation, see execute.
+  if (_executing)
+    return false;
+
+  _executing = true;
+  ClearFlagOnExit cf(_executing);
+
+  _sendAttempts = 0;
+  _isFault = false;
+
+  if ( ! generateRequest(method, params) || ! setupConnection())
+    return false;
+
+  if (_timeout > 0.0)
+    _disp.armTimer(this, _timeout);
+  return true;
+}
+
+
+// Collect the result of a call started by executeNonBlock
+bool
+XmlRpcClient::executeCheckDone(XmlRpcValue& result)
+{
+  result.clear();
+
+  // The dispatcher stops monitoring the connection once the response is read
+  // (the connection is idle) or the call fails
+  if (_connectionState != IDLE && _connectionState != NO_CONNECTION &&
+      (_connectionState == CONNECTING || _disp.hasSource(this)))
+    return false;
+
+  _disp.cancelTimer(this);
+  if (_connectionState != IDLE || ! parseResponse(result))
+    result.clear();
+
+  _response = "";
+  return true;
+}
+
+
+// The call has taken too long, give up on it
+void
+XmlRpcClient::handleTimeout()
+{
+  XmlRpcUtil::error("Error in XmlRpcClient::handleTimeout: no response within %g seconds (state %d).", _timeout, _connectionState);
+  close();
+}
+
+
 // Connect to the xmlrpc server
 bool 
 XmlRpcClient::doConnect()
 {
-  int fd = XmlRpcSocket::socket();
-  if (fd < 0)
+  // Don't block on connect/reads/writes
+  bool nonBlocking = true;
+
+  int fd;
+#if !defined(_WIN32)
+  if ( ! _path.empty())
   {
-    XmlRpcUtil::error("Error in XmlRpcClient::doConnect: Could not create socket (%s).", XmlRpcSocket::getErrorMsg().c_str());
-    return false;
-  }
+    fd = XmlRpcSocket::socketUnix();
+    if (fd < 0)
+    {
+      XmlRpcUtil::error("Error in XmlRpcClient::doConnect: Could not create socket (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      return false;
+    }
 
-  XmlRpcUtil::log(3, "XmlRpcClient::doConnect: fd %d.", fd);
-  this->setfd(fd);
+    XmlRpcUtil::log(3, "XmlRpcClient::doConnect: fd %d.", fd);
+    this->setfd(fd);
 
-  // Don't block on connect/reads/writes
-  // If its secure, do block..
-#ifdef _OPENSSL_ENABLED
-  if (!_cleanupSSL && !XmlRpcSocket::setNonBlocking(fd))
-#else
-  if (!XmlRpcSocket::setNonBlocking(fd))
+    if (nonBlocking && !XmlRpcSocket::setNonBlocking(fd))
+    {
+      this->close();
+      XmlRpcUtil::error("Error in XmlRpcClient::doConnect: Could not set socket to non-blocking IO mode (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      return false;
+    }
+
+    if ( ! XmlRpcSocket::setOptions(fd, _socketOptions))
+    {
+      this->close();
+      XmlRpcUtil::error("Error in XmlRpcClient::doConnect: Could not set socket options (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      return false;
+    }
+
+    if ( ! XmlRpcSocket::connectUnix(fd, _path))
+    {
+      this->close();
+      XmlRpcUtil::error("Error in XmlRpcClient::doConnect: Could not connect to server (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      return false;
+    }
+  }
+  else
 #endif
   {
-    this->close();
-    XmlRpcUtil::error("Error in XmlRpcClient::doConnect: Could not set socket to non-blocking IO mode (%s).", XmlRpcSocket::getErrorMsg().c_str());
-    return false;
+    // The socket is created for the first of the host's addresses to accept.
+    // Until then the host is resolved on a worker and the dispatcher races
+    // the attempts (@see continueConnect).
+    fd = _race.start(_host, _port, _socketOptions, true) ? _race.check() : -1;
+    if (fd < 0 && ! _race.isFailed()) {
+      _connectionState = CONNECTING;
+      return true;
+    }
+    if (fd < 0)
+    {
+      XmlRpcUtil::error("Error in XmlRpcClient::doConnect: Could not connect to server (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      return false;
+    }
   }
 
-  if ( ! XmlRpcSocket::connect(fd, _host, _port))
-  {
-    this->close();
-    XmlRpcUtil::error("Error in XmlRpcClient::doConnect: Could not connect to server (%s).", XmlRpcSocket::getErrorMsg().c_str());
-    return false;
-  }
+  return attachSocket(fd);
+}
+
+
+// Use a connected socket for the calls, starting TLS on it if enabled
+bool
+XmlRpcClient::attachSocket(int fd)
+{
+  XmlRpcUtil::log(3, "XmlRpcClient::attachSocket: fd %d.", fd);
+  this->setfd(fd);
 
 #ifdef _OPENSSL_ENABLED
-  // Secure?
+  // Secure? The handshake starts once the socket is connected.
   if (_cleanupSSL) {
-      XmlRpcSocket::enableSSL(fd, &_sslHandle);
+    if (_sslHandle)     // Left by a connection closed elsewhere
+      XmlRpcSocket::freeSSL(_sslHandle);
+    _sslHandle = NULL;
+    _sslConnected = false;
+    // Reconnections resume the last session with the server
+    void* context = XmlRpcSocket::getClientSSLContext(_caFile.empty() ? 0 : _caFile.c_str(), _verifyPeer);
+    if (context)
+      _sslHandle = XmlRpcSocket::createSSL(context, fd, false, _host.c_str(), _port);
+    if ( ! _sslHandle) {
+      this->close();
+      XmlRpcUtil::error("Error in XmlRpcClient::attachSocket: Could not start TLS.");
+      return false;
+    }
   }
 #endif
 
@@ -279,31 +590,63 @@ XmlRpcClient::generateRequest(const char* methodName, XmlRpcValue const& params)
   }
   body += REQUEST_END;
 
+  if (_compressionThreshold >= 0 && int(body.length()) >= _compressionThreshold &&
+      XmlRpcCompression::isSupported()) {
+    std::string compressed;
+    if (XmlRpcCompression::compress(XmlRpcCompression::Gzip, body.data(), int(body.length()), compressed)) {
+      std::string header = generateHeader(compressed, XmlRpcCompression::Gzip);
+      XmlRpcUtil::log(4, "XmlRpcClient::generateRequest: header is %d bytes, content-length is %d (compressed from %d).", 
+                      header.length(), compressed.length(), body.length());
+      _request = header + compressed;
+      _headerLength = int(header.length());
+      return true;
+    }
+  }
+
   std::string header = generateHeader(body);
   XmlRpcUtil::log(4, "XmlRpcClient::generateRequest: header is %d bytes, content-length is %d.", 
                   header.length(), body.length());
 
   _request = header + body;
+  _headerLength = int(header.length());
   return true;
 }
 
 // Prepend http headers
 std::string
-XmlRpcClient::generateHeader(std::string const& body)
+XmlRpcClient::generateHeader(std::string const& body,
+                             XmlRpcCompression::Encoding encoding /*= Identity*/)
 {
   std::string header = 
     "POST " + _uri + " HTTP/1.1\r\n"
     "User-Agent: ";
   header += XMLRPC_VERSION;
   header += "\r\nHost: ";
-  header += _host;
+  // IPv6 address literals are bracketed
+  if (_host.find(':') != std::string::npos && _host[0] != '[')
+    header += "[" + _host + "]";
+  else
+    header += _host;
 
   char buff[40];
   memset(buff, 0, sizeof(buff));
-  sprintf(buff,":%d\r\n", _port);
+  if (_path.empty())
+    sprintf(buff,":%d\r\n", _port);
+  else
+    strcpy(buff, "\r\n");
 
   header += buff;
-  header += "Accept: */*\r\nAccept-Encoding: gzip, deflate\r\nContent-Type: text/xml\r\nContent-length: ";
+  header += "Accept: */*\r\n";
+
+  // Only ask for compressed responses if we can decompress them
+  if (XmlRpcCompression::isSupported())
+    header += "Accept-Encoding: gzip, deflate\r\n";
+  if (encoding != XmlRpcCompression::Identity) {
+    header += "Content-Encoding: ";
+    header += XmlRpcCompression::getName(encoding);
+    header += "\r\n";
+  }
+  header += "Content-Type: text/xml\r\nContent-length: ";
 
   sprintf(buff,"%u\r\n\r\n", (unsigned int)body.size());
 
@@ -316,6 +659,10 @@ XmlRpcClient::writeRequest()
   if (_bytesWritten == 0)
     XmlRpcUtil::log(5, "XmlRpcClient::writeRequest (attempt %d):\n%s\n", _sendAttempts+1, _request.c_str());
 
+  // Hold partial frames until the whole request is written
+  if (_socketOptions.cork && _bytesWritten == 0)
+    XmlRpcSocket::setCork(this->getfd(), true);
+
   // Try to write the request
 #ifdef _OPENSSL_ENABLED
   if ( ! XmlRpcSocket::nbWrite(this->getfd(), _request, &_bytesWritten, _sslHandle)) {
@@ -330,7 +677,10 @@ XmlRpcClient::writeRequest()
 
   // Wait for the result
   if (_bytesWritten == int(_request.length())) {
+    if (_socketOptions.cork)
+      XmlRpcSocket::setCork(this->getfd(), false);
     _header = "";
+    _httpHeader.reset();
     _response = "";
     _connectionState = READ_HEADER;
   }
@@ -354,6 +704,9 @@ XmlRpcClient::readHeader()
     // have timed out, so we try one more time.
     if (getKeepOpen() && _header.length() == 0 && _sendAttempts++ == 0) {
       XmlRpcUtil::log(4, "XmlRpcClient::readHeader: re-trying connection");
+#ifdef _OPENSSL_ENABLED
+      closeSSL();
+#endif
       XmlRpcSource::close();
       _connectionState = NO_CONNECTION;
       _eof = false;
@@ -367,27 +720,24 @@ XmlRpcClient::readHeader()
 
   XmlRpcUtil::log(4, "XmlRpcClient::readHeader: client has read %d bytes", _header.length());
 
-  char *hp = (char*)_header.c_str();  // Start of header
-  char *ep = hp + _header.length();   // End of string
-  char *bp = 0;                       // Start of body
-  char *lp = 0;                       // Start of content-length value
+  // Parse the lines that arrived since the last read
+  XmlRpcHttpHeader::Status status = _httpHeader.parse(_header.data(), int(_header.length()));
 
-  if ((ep - hp > 23) && (strncasecmp(hp, "HTTP/1.1 100 Continue\n\n", 23) == 0))
-    hp += 23;
-  else if ((ep - hp > 25) && (strncasecmp(hp, "HTTP/1.1 100 Continue\r\n\r\n", 25) == 0))
-    hp += 25;
+  // Skip interim responses (100 Continue), the final response follows them
+  while (status == XmlRpcHttpHeader::Complete && _httpHeader.getStatusCode() / 100 == 1) {
+    _header.erase(0, _httpHeader.getBodyOffset());
+    _httpHeader.reset();
+    status = _httpHeader.parse(_header.data(), int(_header.length()));
+  }
 
-  for (char *cp = hp; (bp == 0) && (cp < ep); ++cp) {
-    if ((ep - cp > 16) && (strncasecmp(cp, "Content-length: ", 16) == 0))
-      lp = cp + 16;
-    else if ((ep - cp > 4) && (strncmp(cp, "\r\n\r\n", 4) == 0))
-      bp = cp + 4;
-    else if ((ep - cp > 2) && (strncmp(cp, "\n\n", 2) == 0))
-      bp = cp + 2;
+  if (status == XmlRpcHttpHeader::Invalid || 
+      (status == XmlRpcHttpHeader::Complete && _httpHeader.isRequest())) {
+    XmlRpcUtil::error("Error in XmlRpcClient::readHeader: Invalid header");
+    return false;
   }
 
   // If we haven't gotten the entire header yet, return (keep reading)
-  if (bp == 0) {
+  if (status == XmlRpcHttpHeader::Incomplete) {
     if (_eof)          // EOF in the middle of a response is an error
     {
       XmlRpcUtil::error("Error in XmlRpcClient::readHeader: EOF while reading header");
@@ -397,23 +747,54 @@ XmlRpcClient::readHeader()
     return true;  // Keep reading
   }
 
-  // Decode content length
-  if (lp == 0) {
-    XmlRpcUtil::error("Error XmlRpcClient::readHeader: No Content-length specified %s", _header.c_str());
-    return false;   // We could try to figure it out by parsing as we read, but for now...
-  }
-
-  _contentLength = atoi(lp);
-  if (_contentLength <= 0) {
-    XmlRpcUtil::error("Error in XmlRpcClient::readHeader: Invalid Content-length specified (%d).", _contentLength);
+  // The server is at its connection limit
+  if (_httpHeader.getStatusCode() == 503) {
+    XmlRpcUtil::error("Error in XmlRpcClient::readHeader: Server unavailable (503)");
     return false;
   }
+
+  const char *bp = _header.data() + _httpHeader.getBodyOffset();   // Start of body
+  const char *ep = _header.data() + _header.length();              // End of data
+
+  // A chunked body ends with its last chunk, otherwise decode content length
+  _chunked = _httpHeader.isChunked();
+  if (_chunked) {
+    XmlRpcUtil::log(4, "client read chunked response");
+  } else {
+    _contentLength = _httpHeader.getContentLength();
+    if (_contentLength < 0) {
+      XmlRpcUtil::error("Error XmlRpcClient::readHeader: No Content-length specified %s", _header.c_str());
+      return false;
+    }
+    if (_contentLength == 0) {
+      XmlRpcUtil::error("Error in XmlRpcClient::readHeader: Invalid Content-length specified (%d).", _contentLength);
+      return false;
+    }
   	
-  XmlRpcUtil::log(4, "client read content length: %d", _contentLength);
+    XmlRpcUtil::log(4, "client read content length: %d", _contentLength);
+  }
+
+  const std::string* value = _httpHeader.getField("Content-Encoding");
+  _responseEncoding = XmlRpcCompression::Identity;
+  if (value) {
+    _responseEncoding = XmlRpcCompression::parseEncoding(value->c_str(), int(value->length()));
+    if (_responseEncoding == XmlRpcCompression::Unknown) {
+      XmlRpcUtil::error("Error in XmlRpcClient::readHeader: Unsupported Content-Encoding specified.");
+      return false;
+    }
+  }
 
   // Otherwise copy non-header data to response buffer and set state to read response.
-  _response = bp;
-  _header = "";   // should parse out any interesting bits from the header (connection, etc)...
+  // The body may be compressed, so it is copied by length rather than as a C string.
+  if (_chunked) {
+    _response.clear();
+    _chunkDecoder.reset();
+    if ( ! _chunkDecoder.decode(bp, int(ep - bp), _response))
+      return false;
+  } else
+    _response.assign(bp, ep - bp);
+  _header = "";
+  _httpHeader.reset();
   _connectionState = READ_RESPONSE;
   return true;    // Continue monitoring this source
 }
@@ -422,12 +803,38 @@ XmlRpcClient::readHeader()
 bool 
 XmlRpcClient::readResponse()
 {
+  // Chunked responses are decoded as they are read, until the last chunk
+  if (_chunked && ! _chunkDecoder.isComplete()) {
+    std::string data;
+#ifdef _OPENSSL_ENABLED
+    if ( ! XmlRpcSocket::nbRead(this->getfd(), data, &_eof, _sslHandle)) {
+#else
+    if ( ! XmlRpcSocket::nbRead(this->getfd(), data, &_eof)) {
+#endif
+      XmlRpcUtil::error("Error in XmlRpcClient::readResponse: read error (%s).",XmlRpcSocket::getErrorMsg().c_str());
+      return false;
+    }
+
+    if ( ! _chunkDecoder.decode(data.data(), int(data.length()), _response))
+      return false;
+
+    if ( ! _chunkDecoder.isComplete()) {
+      if (_eof) {
+        XmlRpcUtil::error("Error in XmlRpcClient::readResponse: EOF while reading response");
+        return false;
+      }
+      return true;
+    }
+  }
+  if (_chunked)
+    _contentLength = int(_response.length());
+
   // If we dont have the entire response yet, read available data
   if (int(_response.length()) < _contentLength) {
 #ifdef _OPENSSL_ENABLED
-    if ( ! XmlRpcSocket::nbRead(this->getfd(), _response, &_eof, _sslHandle)) {
+    if ( ! XmlRpcSocket::nbRead(this->getfd(), _response, &_eof, _sslHandle, _contentLength)) {
 #else
-    if ( ! XmlRpcSocket::nbRead(this->getfd(), _response, &_eof)) {
+    if ( ! XmlRpcSocket::nbRead(this->getfd(), _response, &_eof, _contentLength)) {
 #endif
       XmlRpcUtil::error("Error in XmlRpcClient::readResponse: read error (%s).",XmlRpcSocket::getErrorMsg().c_str());
       return false;
@@ -445,6 +852,16 @@ XmlRpcClient::readResponse()
 
   // Otherwise, parse and return the result
   XmlRpcUtil::log(3, "XmlRpcClient::readResponse (read %d bytes)", _response.length());
+
+  if (_responseEncoding != XmlRpcCompression::Identity) {
+    std::string response;
+    if ( ! XmlRpcCompression::decompress(_responseEncoding, _response.data(), _contentLength, response)) {
+      XmlRpcUtil::error("Error in XmlRpcClient::readResponse: could not decompress %s response.",
+                        XmlRpcCompression::getName(_responseEncoding));
+      return false;
+    }
+    _response.swap(response);
+  }
   XmlRpcUtil::log(5, "response:\n%s", _response.c_str());
 
   _connectionState = IDLE;
@@ -12,18 +12,22 @@
 
 #ifndef MAKEDEPEND
 # include <string>
+# include <vector>
 #endif
 
+#include "XmlRpcChunked.h"
+#include "XmlRpcCompression.h"
 #include "XmlRpcDispatch.h"
+#include "XmlRpcHttpHeader.h"
+#include "XmlRpcLruCache.h"
+#include "XmlRpcSocket.h"
 #include "XmlRpcSource.h"
+#include "XmlRpcValue.h"
 
 namespace XmlRpc {
 
-  // Arguments and results are represented by XmlRpcValues
-  class XmlRpcValue;
-
   //! A class to send XML RPC requests to a server and return the results.
-  class XmlRpcClient : public XmlRpcSource {
+  class XmlRpcClient : public XmlRpcSource, public XmlRpcTimer {
   public:
     // Static data
     static const char REQUEST_BEGIN[];
@@ -43,6 +47,13 @@ namespace XmlRpc {
     //!  @param uri  An optional string to be sent as the URI in the HTTP GET header
     XmlRpcClient(const char* host, int port, const char* uri=0);
 
+#if !defined(_WIN32)
+    //! Construct a client to connect to a server on this machine listening on a Unix domain socket
+    //!  @param path The path of the server's socket
+    //!  @param uri  An optional string to be sent as the URI in the HTTP GET header
+    XmlRpcClient(const char* path, const char* uri=0);
+#endif
+
     //! Destructor
     virtual ~XmlRpcClient();
 
@@ -58,14 +69,85 @@ namespace XmlRpc {
     //! to determine whether the result is a fault response.
     bool execute(const char* method, XmlRpcValue const& params, XmlRpcValue& result);
 
+    //! Start executing the named procedure on the remote server, without
+    //! waiting for the result. The call progresses as the client's dispatcher
+    //! handles events (@see getDispatch), and executeCheckDone() returns the
+    //! result once it has arrived. Results are not cached.
+    //!  @param method The name of the remote procedure to execute
+    //!  @param params An array of the arguments for the method
+    //!  @return true if the request is being sent
+    bool executeNonBlock(const char* method, XmlRpcValue const& params);
+
+    //! Check whether a call started by executeNonBlock() has completed.
+    //!  @param result The result of the call. It is invalid if the call failed.
+    //!  @return true if the call has completed, false if it is still in progress
+    bool executeCheckDone(XmlRpcValue& result);
+
     //! Returns true if the result of the last execute() was a fault response.
     bool isFault() const { return _isFault; }
 
+    //! Return the dispatcher handling the client's connection, for another
+    //! event loop to drive it (@see XmlRpcDispatch::setWatcher).
+    XmlRpcDispatch* getDispatch() { return &_disp; }
+
+    //! Cache the results of calls, so a call repeating the method and parameters
+    //! of an earlier one returns the stored result without contacting the server.
+    //! Only suitable for read-only methods. Fault responses are not cached.
+    //!  @param ttl Seconds a result stays valid, 0 to disable the cache
+    //!  @param maxEntries The maximum number of results kept
+    void enableCache(double ttl, int maxEntries = 100);
+
+    //! Discard all cached results.
+    void invalidateCache();
+
+    //! Discard the cached results of calls to the named method.
+    void invalidateCache(const char* method);
+
+    //! Returns the number of calls answered from the cache.
+    unsigned getCacheHits() const { return _cacheHits; }
+
+    //! Returns the number of cacheable calls that were sent to the server.
+    unsigned getCacheMisses() const { return _cacheMisses; }
+
+    //! Specify the minimum size in bytes of a request body that is sent gzip
+    //! compressed. Only use this with servers known to accept compressed
+    //! requests. A negative size disables compression, which is the default.
+    //! Has no effect unless built with _ZLIB_ENABLED.
+    void setCompressionThreshold(int bytes) { _compressionThreshold = bytes; }
+
+    //! Return the minimum size of a compressed request body.
+    int getCompressionThreshold() const { return _compressionThreshold; }
+
+    //! Specify the options for the sockets of subsequent connections.
+    void setSocketOptions(XmlRpcSocketOptions const& options) { _socketOptions = options; }
+
+    //! Return the options for the sockets of connections.
+    XmlRpcSocketOptions const& getSocketOptions() const { return _socketOptions; }
+
+    //! Specify the seconds execute() waits for a call to complete, including
+    //! resolving the host and connecting to the server. A call that takes
+    //! longer fails and the connection is closed. 0 waits indefinitely, which
+    //! is the default.
+    void setTimeout(double seconds) { _timeout = seconds; }
+
+    //! Return the seconds execute() waits for a call to complete.
+    double getTimeout() const { return _timeout; }
+
 #ifdef _OPENSSL_ENABLED
     //! Initializes the SSL library, so we can use secure sockets
     //! this means all connections made by this instance is HTTPS
-    //! This is automatically called if the port is 443
+    //! This is automatically called if the port is 443. The TLS handshake
+    //! is performed by the dispatcher, like the rest of the call.
     void enableSSL();
+
+    //! Specify whether the server's certificate is verified, against the
+    //! certificate authorities and for the host name. Default is true.
+    void setVerifyPeer(bool verify) { _verifyPeer = verify; }
+
+    //! Specify the certificate authorities the server's certificate is
+    //! verified against, in a PEM file, instead of those of the system.
+    //! A self-signed server certificate can be given here.
+    void setCAFile(const char* path) { _caFile = path ? path : ""; }
 #endif
 
     //! Can be used to test the connection, returns true if
@@ -81,13 +163,25 @@ namespace XmlRpc {
     //!  @see XmlRpcDispatch::EventType
     virtual unsigned handleEvent(unsigned eventType);
 
+    // XmlRpcTimer interface implementation
+    //! Abandon a call that has taken too long.
+    virtual void handleTimeout();
+
   protected:
     // Execution processing helpers
     virtual bool doConnect();
     virtual bool setupConnection();
+    bool attachSocket(int fd);
+    void continueConnect();
+    void watchAttempts();
+    void removeAttempts();
+#ifdef _OPENSSL_ENABLED
+    void closeSSL();
+#endif
 
     virtual bool generateRequest(const char* method, XmlRpcValue const& params);
-    virtual std::string generateHeader(std::string const& body);
+    virtual std::string generateHeader(std::string const& body,
+                                       XmlRpcCompression::Encoding encoding = XmlRpcCompression::Identity);
     virtual bool writeRequest();
     virtual bool readHeader();
     virtual bool readResponse();
@@ -102,11 +196,20 @@ namespace XmlRpc {
     std::string _uri;
     int _port;
 
+    // Path of the server's Unix domain socket, empty for TCP
+    std::string _path;
+
     // The xml-encoded request, http header of response, and response xml
     std::string _request;
     std::string _header;
     std::string _response;
 
+    // Length of the http header at the start of _request, 0 if it has none
+    int _headerLength;
+
+    // Parser the response header is fed to as it is read
+    XmlRpcHttpHeader _httpHeader;
+
     // Number of times the client has attempted to send the request
     int _sendAttempts;
 
@@ -126,17 +229,79 @@ namespace XmlRpc {
     // Number of bytes expected in the response body (parsed from response header)
     int _contentLength;
 
+    // Encoding of the response body (parsed from response header)
+    XmlRpcCompression::Encoding _responseEncoding;
+
+    // Chunked response bodies are decoded as they are read
+    bool _chunked;
+    XmlRpcChunked _chunkDecoder;
+
+    // Minimum size of a request body to compress, negative to disable
+    int _compressionThreshold;
+
+    // Options for the sockets of connections
+    XmlRpcSocketOptions _socketOptions;
+
+    // Seconds to wait for a call to complete, 0 for no limit
+    double _timeout;
+
+    // A cached result along with the request body it was returned for,
+    // keyed by the hash of the request body
+    struct CachedResult {
+      std::string _method;
+      std::string _body;
+      XmlRpcValue _result;
+    };
+    typedef XmlRpcLruCache< unsigned long long, CachedResult > ResultCache;
+    ResultCache _cache;
+    bool _cacheEnabled;
+    unsigned _cacheHits;
+    unsigned _cacheMisses;
+
 #ifdef _OPENSSL_ENABLED
-    // The SSL context handle
+    // The SSL connection handle
     void *_sslHandle;
 
+    // Whether the TLS handshake has completed on the connection
+    bool _sslConnected;
+
     // Whether or not to cleanup the SSL library
     bool _cleanupSSL;
+
+    // How the server's certificate is verified
+    bool _verifyPeer;
+    std::string _caFile;
 #endif
 
     // Event dispatcher
     XmlRpcDispatch _disp;
 
+    // While CONNECTING, the attempts racing the host's addresses. Each pending
+    // attempt, and the host's lookup until it completes, is watched by the
+    // dispatcher through a ConnectAttempt, and the timer starts the next
+    // attempt when it is due.
+    class ConnectAttempt : public XmlRpcSource {
+    public:
+      ConnectAttempt(int fd, XmlRpcClient* client) : XmlRpcSource(fd), _client(client) {}
+      virtual unsigned handleEvent(unsigned eventType);
+      virtual void close() {}     // The socket belongs to the race
+    private:
+      XmlRpcClient* _client;
+    };
+
+    class ConnectTimer : public XmlRpcTimer {
+    public:
+      ConnectTimer(XmlRpcClient* client) : _client(client) {}
+      virtual void handleTimeout() { _client->continueConnect(); }
+    private:
+      XmlRpcClient* _client;
+    };
+
+    XmlRpcConnectRace _race;
+    std::vector<ConnectAttempt*> _attempts;
+    ConnectTimer _connectTimer;
+    bool _connectPosted;
+
   };	// class XmlRpcClient
 
 }	// namespace XmlRpc
@@ -0,0 +1,254 @@
+
+#include "XmlRpcCompression.h"
+#include "XmlRpcUtil.h"
+
+#ifndef MAKEDEPEND
+# include <ctype.h>
+# include <stdlib.h>
+# include <string.h>
+#endif
+
+#ifdef _ZLIB_ENABLED
+#include <zlib.h>
+#endif
+
+namespace XmlRpc {
+
+
+  static const char* encodingNames[] = { "identity", "gzip", "deflate", "" };
+
+
+  bool
+  XmlRpcCompression::isSupported()
+  {
+#ifdef _ZLIB_ENABLED
+    return true;
+#else
+    return false;
+#endif
+  }
+
+
+  const char*
+  XmlRpcCompression::getName(Encoding encoding)
+  {
+    return encodingNames[encoding];
+  }
+
+
+  // Compare a token with a name, ignoring case
+  static bool
+  tokenIs(const char* token, int length, const char* name)
+  {
+    return int(strlen(name)) == length && strncasecmp(token, name, length) == 0;
+  }
+
+
+  // Returns the encoding named by a Content-Encoding header value
+  XmlRpcCompression::Encoding
+  XmlRpcCompression::parseEncoding(const char* value, int length)
+  {
+    while (length > 0 && isspace(*value)) {
+      ++value;
+      --length;
+    }
+    while (length > 0 && isspace(value[length-1]))
+      --length;
+
+    if (length == 0 || tokenIs(value, length, "identity"))
+      return Identity;
+    if (tokenIs(value, length, "gzip") || tokenIs(value, length, "x-gzip"))
+      return Gzip;
+    if (tokenIs(value, length, "deflate"))
+      return Deflate;
+    return Unknown;
+  }
+
+
+  // Returns the preferred supported encoding listed in an Accept-Encoding
+  // header value. gzip is preferred over deflate; codings with q=0 are refused.
+  XmlRpcCompression::Encoding
+  XmlRpcCompression::parseAcceptEncoding(const char* value, int length)
+  {
+    if ( ! isSupported())
+      return Identity;
+
+    bool gzip = false, deflate = false;
+    const char* end = value + length;
+    const char* cp = value;
+    while (cp < end) {
+      const char* tokenEnd = cp;
+      while (tokenEnd < end && *tokenEnd != ',')
+        ++tokenEnd;
+
+      // Split the coding from its parameters
+      const char* nameEnd = cp;
+      while (nameEnd < tokenEnd && *nameEnd != ';')
+        ++nameEnd;
+      while (cp < nameEnd && isspace(*cp))
+        ++cp;
+      const char* ne = nameEnd;
+      while (ne > cp && isspace(ne[-1]))
+        --ne;
+
+      bool refused = false;
+      for (const char* pp = nameEnd; pp + 1 < tokenEnd; ++pp)
+        if ((*pp == 'q' || *pp == 'Q') && pp[1] == '=') {
+          refused = (atof(std::string(pp + 2, tokenEnd).c_str()) <= 0.0);
+          break;
+        }
+
+      if ( ! refused) {
+        int n = int(ne - cp);
+        if (tokenIs(cp, n, "gzip") || tokenIs(cp, n, "x-gzip") || tokenIs(cp, n, "*"))
+          gzip = true;
+        else if (tokenIs(cp, n, "deflate"))
+          deflate = true;
+      }
+
+      cp = tokenEnd + 1;
+    }
+
+    return gzip ? Gzip : (deflate ? Deflate : Identity);
+  }
+
+
+#ifdef _ZLIB_ENABLED
+
+  // Compress straight into the output buffer, which is grown to the bound
+  // zlib guarantees for the compressed size, then trimmed.
+  bool
+  XmlRpcCompression::compress(Encoding encoding, const char* data, int length, std::string& out)
+  {
+    if (encoding == Identity) {
+      out.append(data, length);
+      return true;
+    }
+    if (encoding != Gzip && encoding != Deflate)
+      return false;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int windowBits = (encoding == Gzip) ? 15 + 16 : 15;
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      XmlRpcUtil::error("XmlRpcCompression::compress: could not initialize zlib.");
+      return false;
+    }
+
+    size_t start = out.length();
+    uLong bound = deflateBound(&zs, uLong(length));
+    out.resize(start + bound);
+
+    zs.next_in = (Bytef*) data;
+    zs.avail_in = uInt(length);
+    zs.next_out = (Bytef*) &out[start];
+    zs.avail_out = uInt(bound);
+
+    int rc = deflate(&zs, Z_FINISH);
+    out.resize(start + zs.total_out);
+    deflateEnd(&zs);
+
+    if (rc != Z_STREAM_END) {
+      XmlRpcUtil::error("XmlRpcCompression::compress: deflate failed (%d).", rc);
+      out.resize(start);
+      return false;
+    }
+
+    XmlRpcUtil::log(4, "XmlRpcCompression::compress: %d bytes compressed to %d (%s).",
+                    length, int(zs.total_out), getName(encoding));
+    return true;
+  }
+
+
+  // Decompress into the output buffer, growing it as needed
+  bool
+  XmlRpcCompression::decompress(Encoding encoding, const char* data, int length, std::string& out,
+                                int maxLength /*= 0*/)
+  {
+    if (encoding == Identity) {
+      if (maxLength > 0 && length > maxLength)
+        return false;
+      out.append(data, length);
+      return true;
+    }
+    if (encoding != Gzip && encoding != Deflate)
+      return false;
+
+    // Some servers send raw deflate data rather than the zlib format,
+    // so that is tried if the zlib header is not recognized.
+    int windowBits = (encoding == Gzip) ? 15 + 16 : 15;
+    size_t start = out.length();
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      z_stream zs;
+      memset(&zs, 0, sizeof(zs));
+      if (inflateInit2(&zs, windowBits) != Z_OK) {
+        XmlRpcUtil::error("XmlRpcCompression::decompress: could not initialize zlib.");
+        return false;
+      }
+
+      zs.next_in = (Bytef*) data;
+      zs.avail_in = uInt(length);
+
+      // The output is allowed one byte beyond the limit, to tell when it is exceeded
+      int rc = Z_OK;
+      while (rc == Z_OK) {
+        size_t used = start + zs.total_out;
+        size_t grow = (length < 4096) ? 16384 : size_t(length) * 4;
+        if (maxLength > 0) {
+          if (zs.total_out > size_t(maxLength))
+            break;
+          if (grow > size_t(maxLength) + 1 - zs.total_out)
+            grow = size_t(maxLength) + 1 - zs.total_out;
+        }
+        out.resize(used + grow);
+        zs.next_out = (Bytef*) &out[used];
+        zs.avail_out = uInt(grow);
+        rc = inflate(&zs, Z_NO_FLUSH);
+      }
+      out.resize(start + zs.total_out);
+      inflateEnd(&zs);
+
+      if (rc == Z_STREAM_END)
+        return true;
+
+      out.resize(start);
+      if (rc == Z_OK) {
+        XmlRpcUtil::error("XmlRpcCompression::decompress: data longer than %d bytes.", maxLength);
+        return false;
+      }
+      if (rc == Z_DATA_ERROR && encoding == Deflate && windowBits > 0) {
+        windowBits = -15;
+        continue;
+      }
+
+      XmlRpcUtil::error("XmlRpcCompression::decompress: inflate failed (%d).", rc);
+      return false;
+    }
+    return false;
+  }
+
+#else
+
+  bool
+  XmlRpcCompression::compress(Encoding encoding, const char* data, int length, std::string& out)
+  {
+    if (encoding != Identity)
+      return false;
+    out.append(data, length);
+    return true;
+  }
+
+  bool
+  XmlRpcCompression::decompress(Encoding encoding, const char* data, int length, std::string& out,
+                                int maxLength /*= 0*/)
+  {
+    if (encoding != Identity || (maxLength > 0 && length > maxLength))
+      return false;
+    out.append(data, length);
+    return true;
+  }
+
+#endif // _ZLIB_ENABLED
+
+} // namespace XmlRpc
@@ -0,0 +1,53 @@
+
+#ifndef _XMLRPCCOMPRESSION_H_
+#define _XMLRPCCOMPRESSION_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+// XmlRpc++ Copyright (c) 2016 by Philip Meulengracht
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+#ifndef MAKEDEPEND
+# include <string>
+#endif
+
+namespace XmlRpc {
+
+  //! Compression of http message bodies (Content-Encoding). Compression is
+  //! only available when built with _ZLIB_ENABLED, otherwise only the identity
+  //! encoding is supported.
+  class XmlRpcCompression {
+  public:
+    //! Content encodings
+    enum Encoding {
+      Identity = 0,   //!< not compressed
+      Gzip     = 1,   //!< gzip format (RFC 1952)
+      Deflate  = 2,   //!< zlib format (RFC 1950)
+      Unknown  = 3    //!< an encoding we cannot decode
+    };
+
+    //! Returns true if compressed encodings are supported.
+    static bool isSupported();
+
+    //! Returns the token naming an encoding in http headers.
+    static const char* getName(Encoding encoding);
+
+    //! Returns the encoding named by a Content-Encoding header value.
+    static Encoding parseEncoding(const char* value, int length);
+
+    //! Returns the preferred supported encoding listed in an Accept-Encoding header value.
+    static Encoding parseAcceptEncoding(const char* value, int length);
+
+    //! Compress data with the encoding, appending the result to out. Returns false on error.
+    static bool compress(Encoding encoding, const char* data, int length, std::string& out);
+
+    //! Decompress data in the encoding, appending the result to out. Returns false on error,
+    //! or if the result would be longer than maxLength bytes (0 for no limit).
+    static bool decompress(Encoding encoding, const char* data, int length, std::string& out,
+                           int maxLength = 0);
+  };
+} // namespace XmlRpc
+
+#endif // _XMLRPCCOMPRESSION_H_
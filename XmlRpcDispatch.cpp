@@ -4,35 +4,85 @@
 #include "XmlRpcUtil.h"
 
 #include <math.h>
-#include <sys/timeb.h>
 #include <QtCore>
 
 #if defined(_WIN32)
 # include <winsock2.h>
-
-# define USE_FTIME
-# if defined(_MSC_VER)
-#  define timeb _timeb
-#  define ftime _ftime
-# endif
+# include <windows.h>
 #else
+# include <errno.h>
+# include <fcntl.h>
+# include <stdint.h>
 # include <sys/time.h>
+# include <time.h>
+# include <unistd.h>
+# if defined(__linux__)
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+# endif
 #endif  // _WIN32
 
 
 using namespace XmlRpc;
 
 
+XmlRpcTimer::~XmlRpcTimer()
+{
+  if (_dispatch)
+    _dispatch->cancelTimer(this);
+}
+
+
 XmlRpcDispatch::XmlRpcDispatch()
 {
+  _watcher = 0;
   _endTime = -1.0;
   _doClear = false;
   _inWork = false;
+
+  for (int level = 0; level < WHEEL_LEVELS; ++level)
+    for (int i = 0; i < WHEEL_SLOTS; ++i)
+      _wheel[level][i] = 0;
+  _wheelTick = getTick();
+  _timerCount = 0;
+
+  _taskTail = new Task;
+  _taskTail->_next = 0;
+  _taskHead = _taskTail;
+
+  _wakeupWriteFd = -1;
+  _wakeupReadFd = -1;
+  _wakeupPending = false;
+  _exitRequested = false;
+
+  _epollFd = -1;
+  _epollTried = false;
 }
 
 
 XmlRpcDispatch::~XmlRpcDispatch()
 {
+  // Timers still armed will not expire
+  for (int level = 0; level < WHEEL_LEVELS; ++level)
+    for (int i = 0; i < WHEEL_SLOTS; ++i)
+      while (_wheel[level][i])
+        cancelTimer(_wheel[level][i]);
+
+  // Discard the tasks that have not run
+  while (_taskTail) {
+    Task* next = _taskTail->_next;
+    delete _taskTail;
+    _taskTail = next;
+  }
+
+#if !defined(_WIN32)
+  if (_wakeupReadFd >= 0)
+    ::close(_wakeupReadFd);
+  if (_wakeupWriteFd >= 0 && _wakeupWriteFd != _wakeupReadFd)
+    ::close(_wakeupWriteFd);
+  if (_epollFd >= 0)
+    ::close(_epollFd);
+#endif
 }
 
 // Monitor this source for the specified events and call its event handler
@@ -40,19 +90,38 @@ XmlRpcDispatch::~XmlRpcDispatch()
 void
 XmlRpcDispatch::addSource(XmlRpcSource* source, unsigned mask)
 {
-  _sources.push_back(MonitoredSource(source, mask));
+  // A source is monitored once, adding it again replaces the events watched for
+  SourceIndex::iterator i = _sourceIndex.find(source);
+  if (i != _sourceIndex.end()) {
+    int fd = i->second->_fd;
+    eraseSource(i->second);
+    notify(fd, 0);
+  }
+
+  int fd = source->getfd();
+  SourceList::iterator it = _sources.insert(_sources.end(), MonitoredSource(source, mask, fd));
+  _sourceIndex[source] = it;
+  _fdIndex.insert(std::make_pair(fd, it));
+  notify(fd, mask, true);
 }
 
 // Stop monitoring this source. Does not close the source.
 void
 XmlRpcDispatch::removeSource(XmlRpcSource* source)
 {
-  for (SourceList::iterator it=_sources.begin(); it!=_sources.end(); ++it)
-    if (it->getSource() == source)
-    {
-      _sources.erase(it);
-      break;
-    }
+  SourceIndex::iterator i = _sourceIndex.find(source);
+  if (i != _sourceIndex.end()) {
+    int fd = i->second->_fd;
+    eraseSource(i->second);
+    notify(fd, 0);
+  }
+}
+
+
+bool
+XmlRpcDispatch::hasSource(XmlRpcSource* source) const
+{
+  return _sourceIndex.count(source) != 0;
 }
 
 
@@ -60,12 +129,38 @@ XmlRpcDispatch::removeSource(XmlRpcSource* source)
 void 
 XmlRpcDispatch::setSourceEvents(XmlRpcSource* source, unsigned eventMask)
 {
-  for (SourceList::iterator it=_sources.begin(); it!=_sources.end(); ++it)
-    if (it->getSource() == source)
-    {
+  SourceIndex::iterator i = _sourceIndex.find(source);
+  if (i != _sourceIndex.end()) {
+    SourceList::iterator it = i->second;
+    if (it->getMask() != eventMask) {
       it->getMask() = eventMask;
+      notify(it->_fd, eventMask);
+    }
+  }
+}
+
+
+// Remove a source from the list and the indexes
+void
+XmlRpcDispatch::eraseSource(SourceList::iterator it)
+{
+  _sourceIndex.erase(it->getSource());
+  std::pair<FdIndex::iterator, FdIndex::iterator> range = _fdIndex.equal_range(it->_fd);
+  for (FdIndex::iterator i = range.first; i != range.second; ++i)
+    if (i->second == it) {
+      _fdIndex.erase(i);
       break;
     }
+  _sources.erase(it);
+}
+
+
+// Find the source monitoring a descriptor, or _sources.end()
+XmlRpcDispatch::SourceList::iterator
+XmlRpcDispatch::findFd(int fd)
+{
+  FdIndex::iterator i = _fdIndex.find(fd);
+  return (i == _fdIndex.end()) ? _sources.end() : i->second;
 }
 
 
@@ -78,78 +173,62 @@ XmlRpcDispatch::work(double timeout)
   _endTime = (timeout < 0.0) ? -1.0 : (getTime() + timeout);
   _doClear = false;
   _inWork = true;
+  _exitRequested = false;
+
+  // Other threads can wake us up once the channel is open
+  if (_wakeupReadFd < 0)
+    openWakeup();
+
+  // Wait with epoll where it is available
+  if ( ! _epollTried)
+    openEpoll();
 
   // Only work while there is something to monitor
   while (_sources.size() > 0) {
 
-    // Construct the sets of descriptors we are interested in
-    fd_set inFd, outFd, excFd;
-	  FD_ZERO(&inFd);
-	  FD_ZERO(&outFd);
-	  FD_ZERO(&excFd);
-
-    int maxFd = -1;     // Not used on windows
-    SourceList::iterator it;
-    for (it=_sources.begin(); it!=_sources.end(); ++it) {
-      int fd = it->getSource()->getfd();
-      if (it->getMask() & ReadableEvent) FD_SET(fd, &inFd);
-      if (it->getMask() & WritableEvent) FD_SET(fd, &outFd);
-      if (it->getMask() & Exception)     FD_SET(fd, &excFd);
-      if (it->getMask() && fd > maxFd)   maxFd = fd;
+    // Wait no longer than the time remaining, and wake up in time for the next timer
+    double waitTime = -1.0;
+    if (_endTime >= 0.0) {
+      double now = getTime();
+      waitTime = (_endTime > now) ? _endTime - now : 0.0;
     }
+    if (_exitRequested)
+      waitTime = 0.0;
 
-    // Check for events
-    int nEvents;
-    if (timeout < 0.0)
-      nEvents = select(maxFd+1, &inFd, &outFd, &excFd, NULL);
-    else 
-    {
-      struct timeval tv;
-      tv.tv_sec = (int)floor(timeout);
-      tv.tv_usec = ((int)floor(1000000.0 * (timeout-floor(timeout)))) % 1000000;
-      nEvents = select(maxFd+1, &inFd, &outFd, &excFd, &tv);
-    }
+    double timerWait = getTimeout();
+    if (timerWait >= 0.0 && (waitTime < 0.0 || timerWait < waitTime))
+      waitTime = timerWait;
+
+    // Check for events and handle them
+    int nEvents = (_epollFd >= 0) ? waitEpoll(waitTime) : waitSelect(waitTime);
+
+#if !defined(_WIN32)
+    // A signal interrupted the wait, wait again for the time remaining
+    if (nEvents < 0 && errno == EINTR)
+      continue;
+#endif
 
     if (nEvents < 0)
     {
-      XmlRpcUtil::error("Error in XmlRpcDispatch::work: error in select (%d).", nEvents);
+      XmlRpcUtil::error("Error in XmlRpcDispatch::work: error waiting for events (%d).", nEvents);
       _inWork = false;
       return;
     }
 
-    // Process events
-    for (it=_sources.begin(); it != _sources.end(); )
-    {
-      SourceList::iterator thisIt = it++;
-      XmlRpcSource* src = thisIt->getSource();
-      int fd = src->getfd();
-      unsigned newMask = (unsigned) -1;
-      if (fd <= maxFd) {
-        // If you select on multiple event types this could be ambiguous
-        if (FD_ISSET(fd, &inFd))
-          newMask &= src->handleEvent(ReadableEvent);
-        if (FD_ISSET(fd, &outFd))
-          newMask &= src->handleEvent(WritableEvent);
-        if (FD_ISSET(fd, &excFd))
-          newMask &= src->handleEvent(Exception);
-
-        if ( ! newMask) {
-          _sources.erase(thisIt);  // Stop monitoring this one
-          if ( ! src->getKeepOpen())
-            src->close();
-        } else if (newMask != (unsigned) -1) {
-          thisIt->getMask() = newMask;
-        }
-      }
-    }
+    // Call the timers that have expired, then the tasks posted
+    runTimers();
+    runTasks();
 
     // Check whether to clear all sources
     if (_doClear)
     {
       SourceList closeList = _sources;
       _sources.clear();
+      _sourceIndex.clear();
+      _fdIndex.clear();
       for (SourceList::iterator it=closeList.begin(); it!=closeList.end(); ++it) {
 	XmlRpcSource *src = it->getSource();
+        notify(it->_fd, 0);
         src->close();
       }
 
@@ -157,7 +236,7 @@ XmlRpcDispatch::work(double timeout)
     }
 
     // Check whether end time has passed
-    if (0 <= _endTime && getTime() > _endTime)
+    if (_exitRequested || (0 <= _endTime && getTime() >= _endTime))
       break;
   }
 
@@ -165,12 +244,287 @@ XmlRpcDispatch::work(double timeout)
 }
 
 
-// Exit from work routine. Presumably this will be called from
-// one of the source event handlers.
+// Wait for events with select and handle them
+int
+XmlRpcDispatch::waitSelect(double waitTime)
+{
+  // Construct the sets of descriptors we are interested in
+  fd_set inFd, outFd, excFd;
+  FD_ZERO(&inFd);
+  FD_ZERO(&outFd);
+  FD_ZERO(&excFd);
+
+  int maxFd = -1;     // Not used on windows
+  SourceList::iterator it;
+  for (it=_sources.begin(); it!=_sources.end(); ++it) {
+    int fd = it->getSource()->getfd();
+    if (it->getMask() & ReadableEvent) FD_SET(fd, &inFd);
+    if (it->getMask() & WritableEvent) FD_SET(fd, &outFd);
+    if (it->getMask() & Exception)     FD_SET(fd, &excFd);
+    if (it->getMask() && fd > maxFd)   maxFd = fd;
+  }
+  if (_wakeupReadFd >= 0) {
+    FD_SET(_wakeupReadFd, &inFd);
+    if (_wakeupReadFd > maxFd) maxFd = _wakeupReadFd;
+  }
+
+  int nEvents;
+  if (waitTime < 0.0)
+    nEvents = select(maxFd+1, &inFd, &outFd, &excFd, NULL);
+  else 
+  {
+    // Round up, waking early would only mean waiting again
+    double us = ceil(waitTime * 1000000.0);
+    struct timeval tv;
+    tv.tv_sec = (long)(us / 1000000.0);
+    tv.tv_usec = (long)(us - (double)tv.tv_sec * 1000000.0);
+    nEvents = select(maxFd+1, &inFd, &outFd, &excFd, &tv);
+  }
+  if (nEvents <= 0)
+    return nEvents;
+
+  // Process events
+  for (it=_sources.begin(); it != _sources.end(); )
+  {
+    SourceList::iterator thisIt = it++;
+    int fd = thisIt->getSource()->getfd();
+    if (fd <= maxFd) {
+      unsigned events = 0;
+      if (FD_ISSET(fd, &inFd))  events |= ReadableEvent;
+      if (FD_ISSET(fd, &outFd)) events |= WritableEvent;
+      if (FD_ISSET(fd, &excFd)) events |= Exception;
+
+      // An earlier handler may have changed the events wanted
+      events &= thisIt->getMask();
+      if (events)
+        handleEvents(thisIt, events);
+    }
+  }
+
+  if (_wakeupReadFd >= 0 && FD_ISSET(_wakeupReadFd, &inFd))
+    clearWakeup();
+  return nEvents;
+}
+
+
+// Wait for events with epoll and handle them
+int
+XmlRpcDispatch::waitEpoll(double waitTime)
+{
+#if defined(__linux__)
+  struct epoll_event events[64];
+
+  // Round up, waking early would only mean waiting again
+  int ms = (waitTime < 0.0) ? -1 : (int) ceil(waitTime * 1000.0);
+  int nEvents = epoll_wait(_epollFd, events, 64, ms);
+
+  for (int i = 0; i < nEvents; ++i) {
+    int fd = events[i].data.fd;
+    if (fd == _wakeupReadFd) {
+      clearWakeup();
+      continue;
+    }
+
+    // Errors and hangups are reported as readable and writable, as select() does
+    unsigned eventMask = 0;
+    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))  eventMask |= ReadableEvent;
+    if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) eventMask |= WritableEvent;
+    if (events[i].events & EPOLLPRI)                         eventMask |= Exception;
+
+    // An earlier handler may have removed the source, or replaced it by one
+    // reusing its descriptor; the mask filters events it did not ask for.
+    SourceList::iterator it = findFd(fd);
+    if (it != _sources.end()) {
+      unsigned wanted = eventMask & it->getMask();
+      if (wanted)
+        handleEvents(it, wanted);
+    }
+  }
+  return nEvents;
+#else
+  (void) waitTime;
+  return -1;
+#endif
+}
+
+
+// Create the epoll instance and register the descriptors monitored so far
+bool
+XmlRpcDispatch::openEpoll()
+{
+  _epollTried = true;
+#if defined(__linux__)
+  _epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epollFd < 0) {
+    XmlRpcUtil::log(2, "XmlRpcDispatch::openEpoll: epoll not available (%d), using select.", errno);
+    return false;
+  }
+
+  if (_wakeupReadFd >= 0)
+    updateEpoll(_wakeupReadFd, ReadableEvent, true);
+  for (SourceList::iterator it=_sources.begin(); it!=_sources.end(); ++it)
+    updateEpoll(it->_fd, it->getMask(), true);
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+// Register a change to the events watched for on a descriptor
+void
+XmlRpcDispatch::updateEpoll(int fd, unsigned eventMask, bool added)
+{
+#if defined(__linux__)
+  struct epoll_event ev;
+  ev.events = 0;
+  ev.data.u64 = 0;
+  ev.data.fd = fd;
+
+  // A removed descriptor may already have been closed and reused by another
+  // source, which keeps the registration. Otherwise closing the descriptor
+  // unregistered it, and removing it may fail harmlessly.
+  if ( ! eventMask && ! added) {
+    SourceList::iterator it = findFd(fd);
+    if (it != _sources.end())
+      eventMask = it->getMask();
+  }
+
+  // A descriptor watched for no events (a paused source) is unregistered, as
+  // epoll would still report errors and hangups on it. It is registered again
+  // when events are wanted.
+  if ( ! eventMask) {
+    epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, &ev);
+    return;
+  }
+
+  if (eventMask & ReadableEvent) ev.events |= EPOLLIN;
+  if (eventMask & WritableEvent) ev.events |= EPOLLOUT;
+  if (eventMask & Exception)     ev.events |= EPOLLPRI;
+
+  int op = added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (epoll_ctl(_epollFd, op, fd, &ev) == 0)
+    return;
+  if (errno == EEXIST || errno == ENOENT) {
+    op = (errno == EEXIST) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(_epollFd, op, fd, &ev) == 0)
+      return;
+  }
+  XmlRpcUtil::error("XmlRpcDispatch::updateEpoll: could not watch fd %d (%d).", fd, errno);
+#else
+  (void) fd; (void) eventMask; (void) added;
+#endif
+}
+
+
+// Exit from work routine, from one of the source event handlers or
+// from another thread.
 void
 XmlRpcDispatch::exit()
 {
-  _endTime = 0.0;   // Return from work asap
+  _exitRequested = true;   // Return from work asap
+  wakeup();
+}
+
+
+// Queue a task for the thread running work
+void
+XmlRpcDispatch::post(std::function<void()> task)
+{
+  Task* node = new Task;
+  node->_next = 0;
+  node->_run.swap(task);
+
+  // Append the node; the consumer sees it once it is linked to the previous one
+  Task* prev = _taskHead.exchange(node);
+  prev->_next = node;
+
+  wakeup();
+}
+
+
+// Run the tasks queued. A task posted while the queue is being appended to
+// by another thread may be left for the next wakeup.
+void
+XmlRpcDispatch::runTasks()
+{
+  for (;;) {
+    Task* next = _taskTail->_next;
+    if ( ! next)
+      break;
+
+    // The next node becomes the first, its task is moved out before it runs
+    delete _taskTail;
+    _taskTail = next;
+    std::function<void()> task;
+    task.swap(next->_run);
+    task();
+  }
+}
+
+
+void
+XmlRpcDispatch::wakeup()
+{
+  int fd = _wakeupWriteFd;
+  if (fd < 0 || _wakeupPending.exchange(true))
+    return;
+
+#if defined(__linux__)
+  uint64_t one = 1;
+  if (::write(fd, &one, sizeof(one)) < 0)
+    XmlRpcUtil::error("XmlRpcDispatch::wakeup: could not signal (%d).", errno);
+#elif !defined(_WIN32)
+  char one = 1;
+  if (::write(fd, &one, sizeof(one)) < 0)
+    XmlRpcUtil::error("XmlRpcDispatch::wakeup: could not signal (%d).", errno);
+#endif
+}
+
+
+// Open the wakeup channel
+bool
+XmlRpcDispatch::openWakeup()
+{
+#if defined(__linux__)
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    XmlRpcUtil::error("XmlRpcDispatch::openWakeup: could not create eventfd (%d).", errno);
+    return false;
+  }
+  _wakeupReadFd = fd;
+  _wakeupWriteFd = fd;
+  return true;
+#elif !defined(_WIN32)
+  int fds[2];
+  if (pipe(fds) != 0) {
+    XmlRpcUtil::error("XmlRpcDispatch::openWakeup: could not create pipe (%d).", errno);
+    return false;
+  }
+  for (int i = 0; i < 2; ++i) {
+    fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  _wakeupReadFd = fds[0];
+  _wakeupWriteFd = fds[1];
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+// Consume the wakeup signal. Clearing the pending flag first means a wakeup
+// arriving meanwhile signals again rather than being lost.
+void
+XmlRpcDispatch::clearWakeup()
+{
+  _wakeupPending = false;
+#if !defined(_WIN32)
+  char buf[64];
+  while (::read(_wakeupReadFd, buf, sizeof(buf)) > 0)
+    ;
+#endif
 }
 
 // Clear all sources from the monitored sources list
@@ -183,28 +537,282 @@ XmlRpcDispatch::clear()
   {
     SourceList closeList = _sources;
     _sources.clear();
-    for (SourceList::iterator it=closeList.begin(); it!=closeList.end(); ++it)
+    _sourceIndex.clear();
+    _fdIndex.clear();
+    for (SourceList::iterator it=closeList.begin(); it!=closeList.end(); ++it) {
+      notify(it->_fd, 0);
       it->getSource()->close();
+    }
+  }
+}
+
+
+// Call the source's handler for each event. If you select on multiple
+// event types this could be ambiguous.
+void
+XmlRpcDispatch::handleEvents(SourceList::iterator it, unsigned eventMask)
+{
+  XmlRpcSource* src = it->getSource();
+  unsigned oldMask = it->getMask();
+  unsigned newMask = (unsigned) -1;
+  if (eventMask & ReadableEvent)
+    newMask &= src->handleEvent(ReadableEvent);
+  if (eventMask & WritableEvent)
+    newMask &= src->handleEvent(WritableEvent);
+  if (eventMask & Exception)
+    newMask &= src->handleEvent(Exception);
+
+  if ( ! newMask) {
+    int fd = it->_fd;
+    eraseSource(it);  // Stop monitoring this one
+    notify(fd, 0);
+    if ( ! src->getKeepOpen())
+      src->close();
+  } else if (newMask != (unsigned) -1 && newMask != it->getMask() && it->getMask() == oldMask) {
+    // Events the handler set itself with setSourceEvents are kept
+    it->getMask() = newMask;
+    notify(it->_fd, newMask);
+  }
+}
+
+
+void
+XmlRpcDispatch::notify(int fd, unsigned eventMask, bool added)
+{
+  if (fd < 0)
+    return;
+  if (_epollFd >= 0)
+    updateEpoll(fd, eventMask, added);
+  if (_watcher)
+    _watcher->watch(fd, eventMask);
+}
+
+
+// Report the descriptors monitored to a watcher
+void
+XmlRpcDispatch::setWatcher(XmlRpcWatcher* watcher)
+{
+  _watcher = watcher;
+  if ( ! watcher)
+    return;
+
+  if (_wakeupReadFd < 0)
+    openWakeup();
+  notify(_wakeupReadFd, ReadableEvent);
+
+  for (SourceList::iterator it=_sources.begin(); it!=_sources.end(); ++it)
+    notify(it->_fd, it->getMask());
+}
+
+
+// Handle events reported by another event loop
+void
+XmlRpcDispatch::processEvents(int fd, unsigned eventMask)
+{
+  if (fd >= 0 && fd == _wakeupReadFd)
+    clearWakeup();
+  else {
+    SourceList::iterator it = findFd(fd);
+    if (it != _sources.end()) {
+      unsigned events = eventMask & it->getMask();
+      if (events)
+        handleEvents(it, events);
+    }
   }
+
+  processTimers();
+}
+
+
+void
+XmlRpcDispatch::processTimers()
+{
+  runTimers();
+  runTasks();
+}
+
+
+// Seconds until the next timer expires, 0 if tasks are waiting to run
+double
+XmlRpcDispatch::getTimeout()
+{
+  if (_taskTail->_next)
+    return 0.0;
+
+  unsigned long long ticks = ticksUntilNext();
+  if (ticks == 0)
+    return -1.0;
+
+  double due = double(_wheelTick + ticks) / 1000.0;
+  double now = getTime();
+  return (due > now) ? due - now : 0.0;
+}
+
+
+// Arm a timer to expire after the specified number of seconds
+void
+XmlRpcDispatch::armTimer(XmlRpcTimer* timer, double seconds)
+{
+  cancelTimer(timer);
+
+  // With no timers armed the wheel may lag behind, nothing is skipped by catching up
+  unsigned long long now = getTick();
+  if (_timerCount == 0 && now > _wheelTick)
+    _wheelTick = now;
+
+  unsigned long long ticks = (seconds > 0.0) ? (unsigned long long) ceil(seconds * 1000.0) : 0;
+  timer->_expires = ((now > _wheelTick) ? now : _wheelTick) + ticks;
+  if (timer->_expires <= _wheelTick)
+    timer->_expires = _wheelTick + 1;
+
+  timer->_dispatch = this;
+  ++_timerCount;
+  insertTimer(timer);
+}
+
+
+// Cancel a timer
+void
+XmlRpcDispatch::cancelTimer(XmlRpcTimer* timer)
+{
+  if (timer->_dispatch != this) {
+    if (timer->_dispatch)
+      timer->_dispatch->cancelTimer(timer);
+    return;
+  }
+
+  unlinkTimer(timer);
+  timer->_dispatch = 0;
+  --_timerCount;
+}
+
+
+// Place a timer in the wheel that covers its expiry time
+void
+XmlRpcDispatch::insertTimer(XmlRpcTimer* timer)
+{
+  unsigned long long delta = (timer->_expires > _wheelTick) ? timer->_expires - _wheelTick : 0;
+  int level = 0;
+  while (level < WHEEL_LEVELS-1 && delta >= (1ULL << (WHEEL_BITS * (level+1))))
+    ++level;
+
+  // Timers beyond the top wheel are moved down early and placed again
+  int index = int((timer->_expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS-1));
+  XmlRpcTimer** slot = &_wheel[level][index];
+  timer->_slot = slot;
+  timer->_prev = 0;
+  timer->_next = *slot;
+  if (*slot)
+    (*slot)->_prev = timer;
+  *slot = timer;
+}
+
+
+void
+XmlRpcDispatch::unlinkTimer(XmlRpcTimer* timer)
+{
+  if (timer->_prev)
+    timer->_prev->_next = timer->_next;
+  else
+    *timer->_slot = timer->_next;
+  if (timer->_next)
+    timer->_next->_prev = timer->_prev;
+
+  timer->_slot = 0;
+  timer->_prev = 0;
+  timer->_next = 0;
+}
+
+
+// The wheel needs to be advanced when a timer in the bottom wheel expires,
+// or when a higher wheel comes round to a slot holding timers
+unsigned long long
+XmlRpcDispatch::ticksUntilNext()
+{
+  if (_timerCount == 0)
+    return 0;
+
+  unsigned long long best = ~0ULL;
+  for (int level = 0; level < WHEEL_LEVELS; ++level) {
+    int shift = WHEEL_BITS * level;
+    unsigned long long base = _wheelTick >> shift;
+    for (unsigned long long i = 1; i <= WHEEL_SLOTS; ++i)
+      if (_wheel[level][(base + i) & (WHEEL_SLOTS-1)]) {
+        unsigned long long ticks = ((base + i) << shift) - _wheelTick;
+        if (ticks < best)
+          best = ticks;
+        break;
+      }
+  }
+  return best;
+}
+
+
+// Advance the wheel to the current time
+void
+XmlRpcDispatch::runTimers()
+{
+  unsigned long long now = getTick();
+  while (_wheelTick < now) {
+    // Skip the ticks where there is nothing to do
+    unsigned long long ticks = ticksUntilNext();
+    if (ticks == 0 || _wheelTick + ticks > now) {
+      _wheelTick = now;
+      break;
+    }
+    _wheelTick += ticks;
+
+    // When a wheel comes round, move the timers of the next slot of the wheel above down
+    int index = int(_wheelTick & (WHEEL_SLOTS-1));
+    for (int level = 1; index == 0 && level < WHEEL_LEVELS; ++level) {
+      index = int((_wheelTick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS-1));
+      XmlRpcTimer* timer = _wheel[level][index];
+      _wheel[level][index] = 0;
+      while (timer) {
+        XmlRpcTimer* next = timer->_next;
+        insertTimer(timer);
+        timer = next;
+      }
+    }
+
+    // Call the expired timers. A handler may arm and cancel timers, including
+    // the others in this slot, so each is removed before it is called.
+    XmlRpcTimer** slot = &_wheel[0][_wheelTick & (WHEEL_SLOTS-1)];
+    while (*slot) {
+      XmlRpcTimer* timer = *slot;
+      unlinkTimer(timer);
+      timer->_dispatch = 0;
+      --_timerCount;
+      timer->handleTimeout();
+    }
+  }
+}
+
+
+unsigned long long
+XmlRpcDispatch::getTick()
+{
+  return (unsigned long long) (getTime() * 1000.0);
 }
 
 
 double
 XmlRpcDispatch::getTime()
 {
-#ifdef USE_FTIME
-  struct timeb	tbuff;
+#if defined(_WIN32)
+  static LARGE_INTEGER frequency;
+  if (frequency.QuadPart == 0)
+    QueryPerformanceFrequency(&frequency);
 
-  ftime(&tbuff);
-  return ((double) tbuff.time + ((double)tbuff.millitm / 1000.0) +
-	  ((double) tbuff.timezone * 60));
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (double) counter.QuadPart / (double) frequency.QuadPart;
 #else
-  struct timeval	tv;
-  struct timezone	tz;
+  struct timespec ts;
 
-  gettimeofday(&tv, &tz);
-  return (tv.tv_sec + tv.tv_usec / 1000000.0);
-#endif /* USE_FTIME */
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + ts.tv_nsec / 1000000000.0);
+#endif  // _WIN32
 }
 
 
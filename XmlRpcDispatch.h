@@ -10,16 +10,73 @@
 #endif
 
 #ifndef MAKEDEPEND
+# include <atomic>
+# include <functional>
 # include <list>
+# include <unordered_map>
 #endif
 
 namespace XmlRpc {
 
   // An RPC source represents a file descriptor to monitor
   class XmlRpcSource;
+  class XmlRpcDispatch;
+
+  //! A timeout handled by a dispatcher. Timers are armed and cancelled with
+  //! XmlRpcDispatch::armTimer and cancelTimer, and a timer is cancelled when
+  //! it is destroyed.
+  class XmlRpcTimer {
+  public:
+    //! Constructor
+    XmlRpcTimer() : _dispatch(0), _slot(0), _prev(0), _next(0), _expires(0) {}
+
+    //! Destructor
+    virtual ~XmlRpcTimer();
+
+    //! Returns true if the timer is armed and has not expired yet.
+    bool isArmed() const { return _dispatch != 0; }
+
+    //! Called by the dispatcher when the timer expires.
+    virtual void handleTimeout() = 0;
+
+  private:
+    friend class XmlRpcDispatch;
+
+    // The dispatcher the timer is armed in, and its place in the wheel
+    XmlRpcDispatch* _dispatch;
+    XmlRpcTimer** _slot;
+    XmlRpcTimer* _prev;
+    XmlRpcTimer* _next;
+    unsigned long long _expires;
+  };
+
+
+  //! Receives the descriptors a dispatcher monitors and the events wanted on
+  //! each, so that another event loop can watch them in its place.
+  //! @see XmlRpcDispatch::setWatcher
+  class XmlRpcWatcher {
+  public:
+    virtual ~XmlRpcWatcher() {}
+
+    //! Start watching a descriptor, or change the events watched for. Events
+    //! must be reported for as long as they last (level triggered), as sockets
+    //! are not always read until they would block.
+    //!  @param fd The descriptor
+    //!  @param eventMask The events to watch for (@see XmlRpcDispatch::EventType),
+    //!   0 to stop watching the descriptor
+    virtual void watch(int fd, unsigned eventMask) = 0;
+  };
+
 
   //! An object which monitors file descriptors for events and performs
   //! callbacks when interesting events happen.
+  //!
+  //! The dispatcher normally runs its own loop in work(), waiting for events
+  //! with epoll on linux, or with select() elsewhere or if epoll is not
+  //! available. Alternatively another
+  //! event loop can watch the descriptors (@see setWatcher), report their
+  //! events to processEvents(), and call processTimers() when getTimeout()
+  //! has passed.
   class XmlRpcDispatch {
   public:
     //! Constructor
@@ -34,7 +91,8 @@ namespace XmlRpc {
     };
     
     //! Monitor this source for the event types specified by the event mask
-    //! and call its event handler when any of the events occur.
+    //! and call its event handler when any of the events occur. Adding a
+    //! source already monitored replaces the event types it is watched for.
     //!  @param source The source to monitor
     //!  @param eventMask Which event types to watch for. \see EventType
     void addSource(XmlRpcSource* source, unsigned eventMask);
@@ -43,41 +101,173 @@ namespace XmlRpc {
     //!  @param source The source to stop monitoring
     void removeSource(XmlRpcSource* source);
 
-    //! Modify the types of events to watch for on this source
+    //! Modify the types of events to watch for on this source. When a source
+    //! calls this from its event handler, the events set replace those the
+    //! handler returns. A source watching no events stays monitored.
     void setSourceEvents(XmlRpcSource* source, unsigned eventMask);
 
+    //! Returns true if this source is being monitored.
+    bool hasSource(XmlRpcSource* source) const;
+
 
     //! Watch current set of sources and process events for the specified
-    //! duration (in ms, -1 implies wait forever, or until exit is called)
+    //! duration (in seconds, -1 implies wait forever, or until exit is called).
+    //! The duration is measured on a monotonic clock.
+    //! Each wait costs a single system call however many sources there are.
     void work(double msTime);
 
-    //! Exit from work routine
+    //! Exit from work routine. May be called from any thread; a thread
+    //! blocked in work() is woken up.
     void exit();
 
+    //! Run a task in the thread calling work(), after the events and timers
+    //! being handled. May be called from any thread; a thread blocked in work()
+    //! is woken up. Tasks run in the order they are posted. Tasks still queued
+    //! when the dispatcher is destroyed are discarded.
+    void post(std::function<void()> task);
+
     //! Clear all sources from the monitored sources list. Sources are closed.
     void clear();
 
+    //! Report the descriptors monitored and their changes to a watcher, for
+    //! another event loop to watch them instead of work(). The descriptors
+    //! monitored so far are reported straight away, including one that becomes
+    //! readable when another thread posts a task or calls exit(). Pass 0 to
+    //! stop reporting; the previous watcher is not told to stop watching.
+    void setWatcher(XmlRpcWatcher* watcher);
+
+    //! Handle events on a descriptor reported to the watcher, then the timers
+    //! that have expired and the tasks posted. Errors on a descriptor should be
+    //! reported as readable and writable, as select() does.
+    //!  @param fd The descriptor
+    //!  @param eventMask The events that occurred (@see EventType)
+    void processEvents(int fd, unsigned eventMask);
+
+    //! Handle the timers that have expired and the tasks posted.
+    void processTimers();
+
+    //! Return the seconds until processTimers() should be called, or -1 if
+    //! no timer is armed.
+    double getTimeout();
+
+    //! Arm a timer to expire after the specified number of seconds. A timer that
+    //! is already armed is restarted. Timers expire while work() is running.
+    void armTimer(XmlRpcTimer* timer, double seconds);
+
+    //! Cancel a timer. Nothing happens if the timer is not armed.
+    void cancelTimer(XmlRpcTimer* timer);
+
   protected:
 
-    // helper
+    // Seconds on a monotonic clock, unaffected by changes to the system time
     double getTime();
 
+    // The timer wheel. Timers are kept in a hierarchy of wheels of 64 slots;
+    // each slot of a wheel spans a whole turn of the wheel below, and its
+    // timers are moved down when the lower wheel comes round to it. Arming
+    // and cancelling a timer are constant time.
+    enum { WHEEL_BITS = 6, WHEEL_SLOTS = 1 << WHEEL_BITS, WHEEL_LEVELS = 4 };
+
+    // The current time in wheel ticks (milliseconds)
+    unsigned long long getTick();
+
+    // Place an armed timer in the slot for its expiry time
+    void insertTimer(XmlRpcTimer* timer);
+
+    // Remove a timer from its slot
+    void unlinkTimer(XmlRpcTimer* timer);
+
+    // Return the number of ticks until the wheel next needs to be advanced
+    // (a timer expires or a slot is moved down), or 0 if no timer is armed
+    unsigned long long ticksUntilNext();
+
+    // Advance the wheel to the current time, calling the expired timers
+    void runTimers();
+
+    XmlRpcTimer* _wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long long _wheelTick;
+    int _timerCount;
+
+    // Posted tasks are kept in a lock-free queue with many producers and a
+    // single consumer, the thread running work(). The queue always holds a
+    // node; the first node's task has already been run.
+    struct Task {
+      std::atomic<Task*> _next;
+      std::function<void()> _run;
+    };
+    std::atomic<Task*> _taskHead;   // last posted, updated by producers
+    Task* _taskTail;                // first, updated by the consumer
+
+    // Run the posted tasks
+    void runTasks();
+
+    // Wake up a thread blocked in work(). Wakeups are coalesced until the
+    // dispatcher has noticed them.
+    void wakeup();
+    bool openWakeup();
+    void clearWakeup();
+
+    // The descriptors of the wakeup channel (an eventfd, or a pipe), created by
+    // the first call to work(). On windows there is no wakeup channel, posted
+    // tasks run when the next event is handled.
+    std::atomic<int> _wakeupWriteFd;
+    int _wakeupReadFd;
+    std::atomic<bool> _wakeupPending;
+    std::atomic<bool> _exitRequested;
+
+    // Wait for events and handle them. Return the number of events, or -1
+    // with errno set on failure.
+    int waitSelect(double waitTime);
+    int waitEpoll(double waitTime);
+
+    // The epoll instance used by work() on linux, created by its first call.
+    // Sources are registered as they are added and changed, rather than on each
+    // wait. If it cannot be created, select() is used instead.
+    bool openEpoll();
+    void updateEpoll(int fd, unsigned eventMask, bool added);
+    int _epollFd;
+    bool _epollTried;
+
     // A source to monitor and what to monitor it for
     struct MonitoredSource {
-      MonitoredSource(XmlRpcSource* src, unsigned mask) : _src(src), _mask(mask) {}
+      MonitoredSource(XmlRpcSource* src, unsigned mask, int fd) : _src(src), _mask(mask), _fd(fd) {}
       XmlRpcSource* getSource() const { return _src; }
       unsigned& getMask() { return _mask; }
       XmlRpcSource* _src;
       unsigned _mask;
+      int _fd;      // The descriptor reported to the watcher
     };
 
     // A list of sources to monitor
     typedef std::list< MonitoredSource > SourceList; 
 
+    // The sources indexed by source and by descriptor, so events and changes
+    // find their source without scanning the list
+    typedef std::unordered_map< XmlRpcSource*, SourceList::iterator > SourceIndex;
+    typedef std::unordered_multimap< int, SourceList::iterator > FdIndex;
+
+    // Stop monitoring a source, and find the source monitoring a descriptor
+    void eraseSource(SourceList::iterator it);
+    SourceList::iterator findFd(int fd);
+
+    // Call a source's event handler for the events that occurred, and stop
+    // monitoring it if it asks to
+    void handleEvents(SourceList::iterator it, unsigned eventMask);
+
+    // Tell the watcher, and epoll, about a change to the events watched for.
+    // added is true for a source that was not monitored before.
+    void notify(int fd, unsigned eventMask, bool added = false);
+
+    // Receives the changes to the descriptors monitored, if set
+    XmlRpcWatcher* _watcher;
+
     // Sources being monitored
     SourceList _sources;
+    SourceIndex _sourceIndex;
+    FdIndex _fdIndex;
 
-    // When work should stop (-1 implies wait forever, or until exit is called)
+    // When work should stop (-1 implies wait forever, or until exit is called),
+    // on the clock of getTime()
     double _endTime;
 
     bool _doClear;
@@ -0,0 +1,257 @@
+
+#include "XmlRpcHttpHeader.h"
+#include "XmlRpcChunked.h"
+
+#ifndef MAKEDEPEND
+# include <ctype.h>
+# include <string.h>
+#endif
+
+namespace XmlRpc {
+
+
+  void
+  XmlRpcHttpHeader::reset()
+  {
+    _status = Incomplete;
+    _lineStart = 0;
+    _scanned = 0;
+    _bodyOffset = 0;
+    _startLineParsed = false;
+    _majorVersion = 0;
+    _minorVersion = 0;
+    _statusCode = 0;
+    _fields.clear();
+    _nFields = 0;
+    _contentLength = -1;
+    _chunked = false;
+    _keepAlive = false;
+  }
+
+
+  XmlRpcHttpHeader::Status
+  XmlRpcHttpHeader::parse(const char* data, int length)
+  {
+    if (_status != Incomplete)
+      return _status;
+
+    for (;;) {
+      // Only the bytes received since the last call are searched for the end of line
+      const char* lp = data + _lineStart;
+      const char* sp = data + _scanned;
+      const char* nl = (const char*) memchr(sp, '\n', length - _scanned);
+      if ( ! nl) {
+        _scanned = length;
+        if (length > _maxLength)
+          _status = Invalid;
+        return _status;
+      }
+
+      int lineLength = int(nl - lp);
+      if (lineLength > 0 && lp[lineLength-1] == '\r')
+        --lineLength;
+      _lineStart = _scanned = int(nl - data) + 1;
+      if (_lineStart > _maxLength)
+        return _status = Invalid;
+
+      if (lineLength == 0) {
+        // Empty lines preceding the start line are ignored, otherwise this ends the header
+        if ( ! _startLineParsed)
+          continue;
+        _bodyOffset = _lineStart;
+        return _status = finish();
+      }
+
+      if (parseLine(lp, lineLength) == Invalid)
+        return _status = Invalid;
+    }
+  }
+
+
+  XmlRpcHttpHeader::Status
+  XmlRpcHttpHeader::parseLine(const char* line, int length)
+  {
+    if ( ! _startLineParsed) {
+      _startLineParsed = true;
+      return parseStartLine(line, length);
+    }
+    return parseField(line, length);
+  }
+
+
+  // Parse "HTTP/major.minor"
+  static bool
+  parseVersion(const char* cp, int length, int* major, int* minor)
+  {
+    if (length < 8 || strncmp(cp, "HTTP/", 5) != 0)
+      return false;
+
+    const char* ep = cp + length;
+    cp += 5;
+    int n[2] = { 0, 0 };
+    for (int i = 0; i < 2; ++i) {
+      const char* start = cp;
+      while (cp < ep && *cp >= '0' && *cp <= '9' && cp - start < 3)
+        n[i] = n[i] * 10 + (*cp++ - '0');
+      if (cp == start)
+        return false;
+      if (i == 0 && (cp == ep || *cp++ != '.'))
+        return false;
+    }
+    *major = n[0];
+    *minor = n[1];
+    return cp == ep;
+  }
+
+
+  // A request line is "method uri version", a status line is "version code reason"
+  XmlRpcHttpHeader::Status
+  XmlRpcHttpHeader::parseStartLine(const char* line, int length)
+  {
+    if (length > 5 && strncmp(line, "HTTP/", 5) == 0) {
+      const char* sp = (const char*) memchr(line, ' ', length);
+      if ( ! sp || ! parseVersion(line, int(sp - line), &_majorVersion, &_minorVersion))
+        return Invalid;
+
+      const char* cp = sp + 1;
+      const char* ep = line + length;
+      if (ep - cp < 3)
+        return Invalid;
+      for (int i = 0; i < 3; ++i, ++cp) {
+        if (*cp < '0' || *cp > '9')
+          return Invalid;
+        _statusCode = _statusCode * 10 + (*cp - '0');
+      }
+      if (cp < ep && *cp != ' ')
+        return Invalid;
+      return _statusCode >= 100 ? Incomplete : Invalid;
+    }
+
+    const char* sp = line + length;
+    while (sp > line && sp[-1] != ' ')
+      --sp;
+    if (sp == line || ! parseVersion(sp, int(line + length - sp), &_majorVersion, &_minorVersion))
+      return Invalid;
+    return Incomplete;
+  }
+
+
+  // Returns true for the whitespace allowed around field values
+  static inline bool
+  isOws(char c)
+  {
+    return c == ' ' || c == '\t';
+  }
+
+
+  // Field names are indexed in lower case
+  static std::string
+  lowerCase(const char* name, int length)
+  {
+    std::string lower(name, length);
+    for (size_t i = 0; i < lower.length(); ++i)
+      lower[i] = char(tolower((unsigned char) lower[i]));
+    return lower;
+  }
+
+
+  XmlRpcHttpHeader::Status
+  XmlRpcHttpHeader::parseField(const char* line, int length)
+  {
+    // Folded (continuation) lines are obsolete and rejected, as is
+    // whitespace between the field name and the colon.
+    if (isOws(*line) || ++_nFields > MAX_FIELDS)
+      return Invalid;
+
+    const char* colon = (const char*) memchr(line, ':', length);
+    if ( ! colon || colon == line || isOws(colon[-1]))
+      return Invalid;
+
+    const char* vp = colon + 1;
+    const char* ep = line + length;
+    while (vp < ep && isOws(*vp))
+      ++vp;
+    while (ep > vp && isOws(ep[-1]))
+      --ep;
+
+    std::string name = lowerCase(line, int(colon - line));
+    std::string value(vp, ep - vp);
+
+    std::pair<FieldMap::iterator, bool> inserted = _fields.emplace(name, value);
+    if ( ! inserted.second) {
+      // Repeated fields form a list, except for the length of the body
+      std::string& list = inserted.first->second;
+      if (name == "content-length")
+        return (list == value) ? Incomplete : Invalid;
+      list += ", ";
+      list += value;
+    }
+    return Incomplete;
+  }
+
+
+  const std::string*
+  XmlRpcHttpHeader::getField(const char* name) const
+  {
+    FieldMap::const_iterator i = _fields.find(lowerCase(name, int(strlen(name))));
+    return (i != _fields.end()) ? &i->second : 0;
+  }
+
+
+  // Returns true if a comma separated list contains a token, ignoring case
+  static bool
+  hasToken(std::string const& list, const char* token)
+  {
+    int tokenLength = int(strlen(token));
+    const char* cp = list.c_str();
+    const char* ep = cp + list.length();
+    while (cp < ep) {
+      while (cp < ep && (isOws(*cp) || *cp == ','))
+        ++cp;
+      const char* start = cp;
+      while (cp < ep && *cp != ',')
+        ++cp;
+      const char* end = cp;
+      while (end > start && isOws(end[-1]))
+        --end;
+      if (end - start == tokenLength && strncasecmp(start, token, tokenLength) == 0)
+        return true;
+    }
+    return false;
+  }
+
+
+  // Interpret the fields that affect how the body is read
+  XmlRpcHttpHeader::Status
+  XmlRpcHttpHeader::finish()
+  {
+    const std::string* value = getField("Content-Length");
+    if (value) {
+      if (value->empty() || value->length() > 9)
+        return Invalid;
+      _contentLength = 0;
+      for (size_t i = 0; i < value->length(); ++i) {
+        char c = (*value)[i];
+        if (c < '0' || c > '9')
+          return Invalid;
+        _contentLength = _contentLength * 10 + (c - '0');
+      }
+    }
+
+    value = getField("Transfer-Encoding");
+    _chunked = value && XmlRpcChunked::isChunked(value->c_str(), int(value->length()));
+
+    // HTTP/1.1 connections persist unless closed, HTTP/1.0 ones only if asked to
+    _keepAlive = (_majorVersion > 1 || (_majorVersion == 1 && _minorVersion >= 1));
+    value = getField("Connection");
+    if (value) {
+      if (hasToken(*value, "close"))
+        _keepAlive = false;
+      else if (hasToken(*value, "keep-alive"))
+        _keepAlive = true;
+    }
+
+    return Complete;
+  }
+
+} // namespace XmlRpc
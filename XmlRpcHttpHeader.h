@@ -0,0 +1,116 @@
+
+#ifndef _XMLRPCHTTPHEADER_H_
+#define _XMLRPCHTTPHEADER_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+// XmlRpc++ Copyright (c) 2016 by Philip Meulengracht
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+#ifndef MAKEDEPEND
+# include <string>
+# include <unordered_map>
+#endif
+
+namespace XmlRpc {
+
+  //! An incremental HTTP/1.x message header parser, used by both the client
+  //! and the server. The header is parsed as it arrives: each call resumes at
+  //! the first line not yet parsed, and each field is indexed once.
+  class XmlRpcHttpHeader {
+  public:
+    //! Parse results
+    enum Status {
+      Incomplete,   //!< more data is needed
+      Complete,     //!< the header has been parsed, the body follows
+      Invalid       //!< the header is malformed, too long or has too many fields
+    };
+
+    //! The longest header accepted by default
+    static const int MAX_LENGTH = 65536;
+
+    //! The most field lines accepted in a header
+    static const int MAX_FIELDS = 100;
+
+    //! Constructor
+    XmlRpcHttpHeader() : _maxLength(MAX_LENGTH) { reset(); }
+
+    //! Specify the longest header accepted, in bytes.
+    void setMaxLength(int length) { _maxLength = length; }
+
+    //! Return the longest header accepted.
+    int getMaxLength() const { return _maxLength; }
+
+    //! Prepare to parse a new header.
+    void reset();
+
+    //! Continue parsing a header.
+    //!  @param data The data received so far, starting with the header. Data
+    //!   given to previous calls must be unchanged.
+    //!  @param length The number of bytes of data
+    Status parse(const char* data, int length);
+
+    //! Return the status of the last parse.
+    Status getStatus() const { return _status; }
+
+    //! Return the offset of the body in the data, once the header is complete.
+    int getBodyOffset() const { return _bodyOffset; }
+
+    //! Returns true if the header starts a request rather than a response.
+    bool isRequest() const { return _statusCode == 0; }
+
+    //! Return the HTTP version numbers.
+    int getMajorVersion() const { return _majorVersion; }
+    int getMinorVersion() const { return _minorVersion; }
+
+    //! Return the status code of a response.
+    int getStatusCode() const { return _statusCode; }
+
+    //! Return the value of a field, or 0 if it is not present. Field names are
+    //! not case sensitive. Repeated fields are combined into a list.
+    const std::string* getField(const char* name) const;
+
+    //! Return the Content-Length, or -1 if it is not specified.
+    int getContentLength() const { return _contentLength; }
+
+    //! Returns true if the body has chunked transfer coding.
+    bool isChunked() const { return _chunked; }
+
+    //! Returns true if the connection persists after this message, based on
+    //! the HTTP version and the Connection field.
+    bool isKeepAlive() const { return _keepAlive; }
+
+  private:
+    Status parseLine(const char* line, int length);
+    Status parseStartLine(const char* line, int length);
+    Status parseField(const char* line, int length);
+    Status finish();
+
+    Status _status;
+    int _maxLength;
+
+    // Offset of the first line not parsed yet, and of the first byte not
+    // yet searched for its end
+    int _lineStart;
+    int _scanned;
+    int _bodyOffset;
+    bool _startLineParsed;
+
+    int _majorVersion;
+    int _minorVersion;
+    int _statusCode;
+
+    // Field values by lower case name, and the number of field lines parsed
+    typedef std::unordered_map<std::string, std::string> FieldMap;
+    FieldMap _fields;
+    int _nFields;
+
+    int _contentLength;
+    bool _chunked;
+    bool _keepAlive;
+  };
+} // namespace XmlRpc
+
+#endif // _XMLRPCHTTPHEADER_H_
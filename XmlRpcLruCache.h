@@ -0,0 +1,134 @@
+
+#ifndef _XMLRPCLRUCACHE_H_
+#define _XMLRPCLRUCACHE_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+// XmlRpc++ Copyright (c) 2016 by Philip Meulengracht
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+#ifndef MAKEDEPEND
+# include <chrono>
+# include <list>
+# include <unordered_map>
+#endif
+
+namespace XmlRpc {
+
+  //! A bounded cache of values that expire after a time to live, evicting
+  //! the least recently used entries when it is full. Not thread-safe.
+  template<typename K, typename V>
+  class XmlRpcLruCache {
+  public:
+    //! Constructor
+    //!  @param maxEntries The maximum number of entries kept
+    //!  @param ttl Seconds an entry stays valid after it is inserted, 0 for no expiry
+    XmlRpcLruCache(int maxEntries = 100, double ttl = 0.0) :
+      _maxEntries(maxEntries), _ttl(ttl) {}
+
+    //! Change the limits. Entries beyond the new maximum are evicted.
+    void setLimits(int maxEntries, double ttl)
+    {
+      _maxEntries = maxEntries;
+      _ttl = ttl;
+      evict();
+    }
+
+    //! Return the value stored for a key, or 0 if there is none or it has expired.
+    //! The pointer is valid until the cache is next modified.
+    V* find(K const& key)
+    {
+      typename Index::iterator i = _index.find(key);
+      if (i == _index.end())
+        return 0;
+
+      typename EntryList::iterator e = i->second;
+      if (_ttl > 0.0 && now() > e->_expires) {
+        _entries.erase(e);
+        _index.erase(i);
+        return 0;
+      }
+
+      // Most recently used entries are kept at the front
+      _entries.splice(_entries.begin(), _entries, e);
+      return &e->_value;
+    }
+
+    //! Store a value, replacing any value with the same key.
+    void insert(K const& key, V const& value)
+    {
+      erase(key);
+      if (_maxEntries <= 0)
+        return;
+
+      Entry entry = { key, value, now() + _ttl };
+      _entries.push_front(entry);
+      _index[key] = _entries.begin();
+      evict();
+    }
+
+    //! Remove the value stored for a key.
+    void erase(K const& key)
+    {
+      typename Index::iterator i = _index.find(key);
+      if (i != _index.end()) {
+        _entries.erase(i->second);
+        _index.erase(i);
+      }
+    }
+
+    //! Remove the entries for which pred(key, value) returns true.
+    template<typename P>
+    void eraseIf(P pred)
+    {
+      for (typename EntryList::iterator e = _entries.begin(); e != _entries.end(); )
+        if (pred(e->_key, e->_value)) {
+          _index.erase(e->_key);
+          e = _entries.erase(e);
+        } else
+          ++e;
+    }
+
+    //! Remove all entries.
+    void clear()
+    {
+      _entries.clear();
+      _index.clear();
+    }
+
+    //! Return the number of entries, including expired ones not yet removed.
+    int size() const { return int(_index.size()); }
+
+  private:
+    // Drop the least recently used entries beyond the maximum
+    void evict()
+    {
+      while (int(_index.size()) > _maxEntries && ! _entries.empty()) {
+        _index.erase(_entries.back()._key);
+        _entries.pop_back();
+      }
+    }
+
+    static double now()
+    {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct Entry {
+      K _key;
+      V _value;
+      double _expires;
+    };
+    typedef std::list< Entry > EntryList;
+    typedef std::unordered_map< K, typename EntryList::iterator > Index;
+
+    EntryList _entries;
+    Index _index;
+    int _maxEntries;
+    double _ttl;
+  };
+} // namespace XmlRpc
+
+#endif // _XMLRPCLRUCACHE_H_
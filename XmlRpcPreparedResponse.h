@@ -0,0 +1,72 @@
+
+#ifndef _XMLRPCPREPAREDRESPONSE_H_
+#define _XMLRPCPREPAREDRESPONSE_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+// XmlRpc++ Copyright (c) 2016 by Philip Meulengracht
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+#ifndef MAKEDEPEND
+# include <memory>
+# include <mutex>
+# include <string>
+#endif
+
+#include "XmlRpcCompression.h"
+
+namespace XmlRpc {
+
+  //! A complete, serialized http response (header and body). It is immutable,
+  //! so a single instance can be shared by any number of connections and
+  //! written directly to their sockets.
+  class XmlRpcPreparedResponse {
+  public:
+    //! Prepared responses are shared through reference counted pointers
+    typedef std::shared_ptr<const XmlRpcPreparedResponse> Ptr;
+
+    //! Constructor
+    //!   @param header The http header, including the blank line ending it
+    //!   @param body   The methodResponse xml
+    XmlRpcPreparedResponse(std::string const& header, std::string const& body) :
+      _message(header + body), _headerLength(int(header.length())) {}
+
+    //! Return the complete response.
+    std::string const& getMessage() const { return _message; }
+
+    //! Return the number of bytes of the response taken by the http header.
+    int getHeaderLength() const { return _headerLength; }
+
+    //! Return the number of bytes of the response taken by the body.
+    int getBodyLength() const { return int(_message.length()) - _headerLength; }
+
+    //! Return the variant of this response compressed with an encoding, or null
+    //! if it has not been stored yet.
+    Ptr getEncoded(XmlRpcCompression::Encoding encoding) const
+    {
+      std::lock_guard<std::mutex> lock(_encodedLock);
+      return (encoding > 0 && encoding < XmlRpcCompression::Unknown) ? _encoded[encoding] : Ptr();
+    }
+
+    //! Store the variant of this response compressed with an encoding, so it
+    //! is only compressed once.
+    void setEncoded(XmlRpcCompression::Encoding encoding, Ptr const& response) const
+    {
+      std::lock_guard<std::mutex> lock(_encodedLock);
+      if (encoding > 0 && encoding < XmlRpcCompression::Unknown)
+        _encoded[encoding] = response;
+    }
+
+  private:
+    std::string _message;
+    int _headerLength;
+
+    // Compressed variants, indexed by encoding
+    mutable Ptr _encoded[XmlRpcCompression::Unknown];
+    mutable std::mutex _encodedLock;
+  };
+} // namespace XmlRpc
+
+#endif // _XMLRPCPREPAREDRESPONSE_H_
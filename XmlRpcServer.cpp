@@ -2,19 +2,54 @@
 #include "XmlRpcServer.h"
 #include "XmlRpcServerConnection.h"
 #include "XmlRpcServerMethod.h"
+#include "XmlRpcShm.h"
 #include "XmlRpcSocket.h"
+#include "XmlRpcThreadPool.h"
 #include "XmlRpcUtil.h"
 #include "XmlRpcException.h"
+#include "XmlRpc.h"
 
 
+#ifndef MAKEDEPEND
+# include <errno.h>
+# include <stdio.h>
+# include <string.h>
+#endif
+
 using namespace XmlRpc;
 
+// Seconds to wait before accepting again once out of descriptors
+static const double ACCEPT_RETRY_DELAY = 0.1;
+
 
-XmlRpcServer::XmlRpcServer()
+XmlRpcServer::XmlRpcServer() :
+  _acceptTimer(this)
 {
   _introspectionEnabled = false;
   _listMethods = 0;
   _methodHelp = 0;
+  _multicallPool = 0;
+  _responseCacheEnabled = false;
+  _compressionThreshold = -1;
+  _shmListener = 0;
+  _unixInode = 0;
+  _acceptPaused = false;
+  _acceptBudget = 64;
+  _idleTimeout = 60.0;
+  _headerTimeout = 30.0;
+  _bodyTimeout = 30.0;
+  _writeTimeout = 30.0;
+  _maxConnections = 0;
+  _connectionCount = 0;
+  _maxHeaderSize = XmlRpcHttpHeader::MAX_LENGTH;
+  _maxRequestSize = 0;
+  _maxResponseSize = 0;
+  _bufferedOutput = 0;
+  _maxBufferedOutput = 0;
+#ifdef _OPENSSL_ENABLED
+  _sslContext = NULL;
+  _kernelTLS = false;
+#endif
 }
 
 
@@ -22,8 +57,17 @@ XmlRpcServer::~XmlRpcServer()
 {
   this->shutdown();
   _methods.clear();
+  _dispatch.clear();
+  for (size_t i=0; i<_ownedMethods.size(); ++i)
+    delete _ownedMethods[i];
   delete _listMethods;
   delete _methodHelp;
+  delete _multicallPool;
+  delete _shmListener;
+#ifdef _OPENSSL_ENABLED
+  if (_sslContext)
+    XmlRpcSocket::freeSSLContext(_sslContext);
+#endif
 }
 
 
@@ -32,6 +76,8 @@ void
 XmlRpcServer::addMethod(XmlRpcServerMethod* method)
 {
   _methods[method->name()] = method;
+  rebuildDispatchTable();
+  if (_listMethods) _listMethods->invalidateResponse();
 }
 
 // Remove a command from the RPC server
@@ -39,8 +85,12 @@ void
 XmlRpcServer::removeMethod(XmlRpcServerMethod* method)
 {
   MethodMap::iterator i = _methods.find(method->name());
-  if (i != _methods.end())
+  if (i != _methods.end()) {
+    _responseCache.erase(i->second);
     _methods.erase(i);
+    rebuildDispatchTable();
+    if (_listMethods) _listMethods->invalidateResponse();
+  }
 }
 
 // Remove a command from the RPC server by name
@@ -48,8 +98,67 @@ void
 XmlRpcServer::removeMethod(const std::string& methodName)
 {
   MethodMap::iterator i = _methods.find(methodName);
-  if (i != _methods.end())
+  if (i != _methods.end()) {
+    _responseCache.erase(i->second);
     _methods.erase(i);
+    rebuildDispatchTable();
+    if (_listMethods) _listMethods->invalidateResponse();
+  }
+}
+
+
+// Add a command that is owned by the RPC server
+void
+XmlRpcServer::adoptMethod(XmlRpcServerMethod* method)
+{
+  for (size_t i=0; i<_ownedMethods.size(); ++i)
+    if (_ownedMethods[i]->name() == method->name()) {
+      removeMethod(_ownedMethods[i]);
+      delete _ownedMethods[i];
+      _ownedMethods.erase(_ownedMethods.begin() + i);
+      break;
+    }
+
+  _ownedMethods.push_back(method);
+  addMethod(method);
+}
+
+
+// FNV-1a hash of a method name
+static unsigned
+hashMethodName(const char* name, int length)
+{
+  unsigned h = 2166136261u;
+  for (int i=0; i<length; ++i) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+// Rebuild the hash table used to dispatch requests. Methods are added and
+// removed rarely, so the table is simply rebuilt at half load or less.
+void
+XmlRpcServer::rebuildDispatchTable()
+{
+  size_t size = 8;
+  while (size < 2 * _methods.size())
+    size *= 2;
+
+  DispatchSlot empty = { 0, 0, 0 };
+  _dispatch.assign(size, empty);
+
+  for (MethodMap::iterator it=_methods.begin(); it != _methods.end(); ++it) {
+    unsigned h = hashMethodName(it->first.data(), int(it->first.length()));
+    size_t i = h & (size - 1);
+    while (_dispatch[i]._name != 0)
+      i = (i + 1) & (size - 1);
+
+    _dispatch[i]._hash = h;
+    _dispatch[i]._name = &it->first;
+    _dispatch[i]._method = it->second;
+  }
 }
 
 
@@ -57,19 +166,119 @@ XmlRpcServer::removeMethod(const std::string& methodName)
 XmlRpcServerMethod* 
 XmlRpcServer::findMethod(const std::string& name) const
 {
-  MethodMap::const_iterator i = _methods.find(name);
-  if (i == _methods.end())
+  return findMethod(name.data(), int(name.length()));
+}
+
+// Look up a method by a name that is not nul-terminated
+XmlRpcServerMethod*
+XmlRpcServer::findMethod(const char* name, int length) const
+{
+  if (_dispatch.empty())
     return 0;
-  return i->second;
+
+  size_t mask = _dispatch.size() - 1;
+  unsigned h = hashMethodName(name, length);
+  for (size_t i = h & mask; _dispatch[i]._name != 0; i = (i + 1) & mask) {
+    const DispatchSlot& slot = _dispatch[i];
+    if (slot._hash == h && int(slot._name->length()) == length &&
+        memcmp(slot._name->data(), name, length) == 0)
+      return slot._method;
+  }
+  return 0;
+}
+
+
+// Execute the thread-safe sub-calls of a multicall on a pool of worker threads
+void
+XmlRpcServer::enableParallelMulticall(int nThreads /*= 0*/)
+{
+  delete _multicallPool;
+  _multicallPool = 0;
+
+  if (nThreads >= 0)
+    _multicallPool = new XmlRpcThreadPool(nThreads);
+}
+
+
+// Specify whether responses of cacheable methods are cached
+void
+XmlRpcServer::enableResponseCache(bool enabled /*= true*/)
+{
+  _responseCacheEnabled = enabled;
+  if ( ! enabled)
+    _responseCache.clear();
+}
+
+
+// Look up the cached response to a call
+XmlRpcPreparedResponse::Ptr
+XmlRpcServer::findCachedResponse(XmlRpcServerMethod* method, const char* params, int length)
+{
+  if ( ! _responseCacheEnabled || method->getCacheTtl() <= 0.0)
+    return XmlRpcPreparedResponse::Ptr();
+
+  ResponseCacheMap::iterator i = _responseCache.find(method);
+  if (i == _responseCache.end())
+    return XmlRpcPreparedResponse::Ptr();
+
+  // Compare the parameters too, in case of a hash collision
+  CachedResponse* cached = i->second.find(XmlRpcUtil::hash(params, length));
+  if ( ! cached || int(cached->_params.length()) != length ||
+       memcmp(cached->_params.data(), params, length) != 0)
+    return XmlRpcPreparedResponse::Ptr();
+
+  XmlRpcUtil::log(3, "XmlRpcServer::findCachedResponse: cache hit for %s.", method->name().c_str());
+  return cached->_response;
+}
+
+
+// Store the response to a call in the cache
+void
+XmlRpcServer::cacheResponse(XmlRpcServerMethod* method, const char* params, int length,
+                            XmlRpcPreparedResponse::Ptr const& response)
+{
+  if ( ! _responseCacheEnabled || method->getCacheTtl() <= 0.0)
+    return;
+
+  // The limits are taken from the method every time, in case they changed
+  ResponseCache& cache = _responseCache[method];
+  cache.setLimits(method->getCacheEntries(), method->getCacheTtl());
+
+  CachedResponse cached;
+  cached._params.assign(params, length);
+  cached._response = response;
+  cache.insert(XmlRpcUtil::hash(params, length), cached);
+}
+
+
+// Discard cached responses
+void
+XmlRpcServer::invalidateCache(XmlRpcServerMethod* method /*= 0*/)
+{
+  if (method)
+    _responseCache.erase(method);
+  else
+    _responseCache.clear();
 }
 
 
 // Create a socket, bind to the specified port, and
 // set it in listen mode to make it available for clients.
 bool 
-XmlRpcServer::bindAndListen(int port, int backlog /*= 5*/)
+XmlRpcServer::bindAndListen(int port, int backlog /*= DEFAULT_BACKLOG*/)
 {
-  int fd = XmlRpcSocket::socket();
+  return bindAndListen(port, XmlRpcSocketOptions(), backlog);
+}
+
+
+// Create a socket with the specified options, bind to the specified port, and
+// set it in listen mode to make it available for clients.
+bool 
+XmlRpcServer::bindAndListen(int port, XmlRpcSocketOptions const& options, int backlog /*= DEFAULT_BACKLOG*/)
+{
+  _socketOptions = options;
+
+  int fd = XmlRpcSocket::socketDualStack();
   if (fd < 0)
   {
     XmlRpcUtil::error("XmlRpcServer::bindAndListen: Could not create socket (%s).", XmlRpcSocket::getErrorMsg().c_str());
@@ -102,6 +311,13 @@ XmlRpcServer::bindAndListen(int port, int backlog /*= 5*/)
     return false;
   }
 
+  if ( ! XmlRpcSocket::setListenOptions(fd, options))
+  {
+    this->close();
+    XmlRpcUtil::error("XmlRpcServer::bindAndListen: Could not set socket options (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    return false;
+  }
+
   // Set in listening mode
   if ( ! XmlRpcSocket::listen(fd, backlog))
   {
@@ -119,6 +335,104 @@ XmlRpcServer::bindAndListen(int port, int backlog /*= 5*/)
 }
 
 
+#ifdef _OPENSSL_ENABLED
+// Load the certificate the connections are served with
+bool
+XmlRpcServer::enableSSL(const char* certFile, const char* keyFile /*= 0*/)
+{
+  void* context = XmlRpcSocket::createSSLContext(true, certFile, keyFile);
+  if ( ! context) {
+    XmlRpcUtil::error("XmlRpcServer::enableSSL: Could not load the certificate from %s.", certFile);
+    return false;
+  }
+
+  if (_sslContext)
+    XmlRpcSocket::freeSSLContext(_sslContext);
+  _sslContext = context;
+  XmlRpcSocket::setKernelTLS(_sslContext, _kernelTLS);
+  return true;
+}
+
+
+void
+XmlRpcServer::setKernelTLS(bool enable)
+{
+  _kernelTLS = enable;
+  if (_sslContext)
+    XmlRpcSocket::setKernelTLS(_sslContext, enable);
+}
+#endif
+
+
+#if !defined(_WIN32)
+// Create a Unix domain socket, bind to the path and listen for connections
+bool 
+XmlRpcServer::bindAndListen(const char* path, int backlog /*= DEFAULT_BACKLOG*/)
+{
+  int fd = XmlRpcSocket::socketUnix();
+  if (fd < 0)
+  {
+    XmlRpcUtil::error("XmlRpcServer::bindAndListen: Could not create socket (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    return false;
+  }
+
+  this->setfd(fd);
+
+  // Don't block on reads/writes
+  if ( ! XmlRpcSocket::setNonBlocking(fd))
+  {
+    this->close();
+    XmlRpcUtil::error("XmlRpcServer::bindAndListen: Could not set socket to non-blocking input mode (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    return false;
+  }
+
+  if ( ! XmlRpcSocket::bindUnix(fd, path, &_unixInode))
+  {
+    this->close();
+    XmlRpcUtil::error("XmlRpcServer::bindAndListen: Could not bind to specified path (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    return false;
+  }
+  _unixPath = path;
+
+  // Set in listening mode
+  if ( ! XmlRpcSocket::listen(fd, backlog))
+  {
+    this->close();
+    XmlRpcUtil::error("XmlRpcServer::bindAndListen: Could not set socket in listening mode (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    return false;
+  }
+
+  XmlRpcUtil::log(2, "XmlRpcServer::bindAndListen: server listening on %s fd %d", path, fd);
+
+  // Notify the dispatcher to listen on this source when we are in work()
+  _disp.addSource(this, XmlRpcDispatch::ReadableEvent);
+
+  return true;
+}
+#endif
+
+
+#if defined(__linux__)
+// Listen for shared memory transport clients
+bool
+XmlRpcServer::bindSharedMemory(const char* path, int backlog /*= DEFAULT_BACKLOG*/)
+{
+  if (_shmListener) {
+    _disp.removeSource(_shmListener);
+    delete _shmListener;
+  }
+
+  XmlRpcShmListener* listener = new XmlRpcShmListener(this);
+  _shmListener = listener;
+  if ( ! listener->bindAndListen(path, backlog))
+    return false;
+
+  _disp.addSource(listener, XmlRpcDispatch::ReadableEvent);
+  return true;
+}
+#endif
+
+
 // Process client requests for the specified time
 void 
 XmlRpcServer::work(double msTime)
@@ -145,23 +459,108 @@ XmlRpcServer::handleEvent(unsigned mask)
 void
 XmlRpcServer::acceptConnection()
 {
-  int s = XmlRpcSocket::accept(this->getfd());
-  XmlRpcUtil::log(2, "XmlRpcServer::acceptConnection: socket %d", s);
-  if (s < 0)
+  // Drain the queue of pending connections, up to the budget for this wakeup
+  for (int accepted = 0; _acceptBudget <= 0 || accepted < _acceptBudget; ++accepted)
   {
-    //this->close();
-    XmlRpcUtil::error("XmlRpcServer::acceptConnection: Could not accept connection (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    int s = XmlRpcSocket::acceptNonBlocking(this->getfd());
+    XmlRpcUtil::log(2, "XmlRpcServer::acceptConnection: socket %d", s);
+    if (s < 0)
+    {
+      // The queue is empty, or the next connection cannot be accepted yet
+      if ( ! XmlRpcSocket::nonFatalError())
+        XmlRpcUtil::error("XmlRpcServer::acceptConnection: Could not accept connection (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      if (isResourceError(XmlRpcSocket::getError()))
+        pauseAccepting();
+      break;
+    }
+
+    if (_maxConnections > 0 && _connectionCount >= _maxConnections)
+    {
+      XmlRpcUtil::log(2, "XmlRpcServer::acceptConnection: refusing connection, %d connections open", _connectionCount);
+      refuseConnection(s);
+    }
+    else if ( ! XmlRpcSocket::setOptions(s, _socketOptions))
+    {
+      XmlRpcSocket::close(s);
+      XmlRpcUtil::error("XmlRpcServer::acceptConnection: Could not set socket options (%s).", XmlRpcSocket::getErrorMsg().c_str());
+    }
+    else  // Notify the dispatcher to listen for input on this source when we are in work()
+    {
+      XmlRpcUtil::log(2, "XmlRpcServer::acceptConnection: creating a connection");
+      XmlRpcServerConnection* sc = this->createConnection(s);
+#ifdef _OPENSSL_ENABLED
+      if (_sslContext)
+        sc->startSSL(_sslContext);
+#endif
+      addConnection(sc);
+    }
   }
-  else if ( ! XmlRpcSocket::setNonBlocking(s))
-  {
+}
+
+
+// Returns true if accept failed for lack of descriptors or memory, in which
+// case the pending connection stays queued
+bool
+XmlRpcServer::isResourceError(int error)
+{
+#if defined(_WIN32)
+  return error == WSAEMFILE || error == WSAENOBUFS;
+#else
+  return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
+#endif
+}
+
+
+// Stop watching the listening socket, which stays readable while the
+// connection that could not be accepted is queued. Accepting resumes when a
+// connection closes, or after a delay.
+void
+XmlRpcServer::pauseAccepting()
+{
+  if (_acceptPaused)
+    return;
+  XmlRpcUtil::log(2, "XmlRpcServer::pauseAccepting: out of resources, %d connections open", _connectionCount);
+  _acceptPaused = true;
+  _disp.setSourceEvents(this, 0);
+  _disp.armTimer(&_acceptTimer, ACCEPT_RETRY_DELAY);
+}
+
+
+void
+XmlRpcServer::resumeAccepting()
+{
+  if ( ! _acceptPaused)
+    return;
+  _acceptPaused = false;
+  _disp.cancelTimer(&_acceptTimer);
+  if (_disp.hasSource(this))
+    _disp.setSourceEvents(this, XmlRpcDispatch::ReadableEvent);
+}
+
+
+// The client is told to retry later rather than finding the connection reset
+void
+XmlRpcServer::refuseConnection(int s)
+{
+  static const std::string response = std::string(
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Server: ") + XMLRPC_VERSION + "\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+#ifdef _OPENSSL_ENABLED
+  // A TLS client would not understand the response before the handshake
+  if (_sslContext) {
     XmlRpcSocket::close(s);
-    XmlRpcUtil::error("XmlRpcServer::acceptConnection: Could not set socket to non-blocking input mode (%s).", XmlRpcSocket::getErrorMsg().c_str());
-  }
-  else  // Notify the dispatcher to listen for input on this source when we are in work()
-  {
-    XmlRpcUtil::log(2, "XmlRpcServer::acceptConnection: creating a connection");
-    _disp.addSource(this->createConnection(s), XmlRpcDispatch::ReadableEvent);
+    return;
   }
+#endif
+
+  // A new socket has room for the response, a partial write is abandoned
+  int written = 0;
+  XmlRpcSocket::nbWrite(s, response, &written);
+  XmlRpcSocket::close(s);
 }
 
 
@@ -174,10 +573,72 @@ XmlRpcServer::createConnection(int s)
 }
 
 
+void 
+XmlRpcServer::addConnection(XmlRpcServerConnection* sc)
+{
+  ++_connectionCount;
+  _disp.addSource(sc, XmlRpcDispatch::ReadableEvent);
+}
+
+
 void 
 XmlRpcServer::removeConnection(XmlRpcServerConnection* sc)
 {
+  --_connectionCount;
   _disp.removeSource(sc);
+
+  for (size_t i = 0; i < _pausedConnections.size(); ++i)
+    if (_pausedConnections[i] == sc) {
+      _pausedConnections.erase(_pausedConnections.begin() + i);
+      break;
+    }
+
+  // The descriptor released may let a queued connection be accepted
+  resumeAccepting();
+}
+
+
+void
+XmlRpcServer::setMaxBufferedOutput(size_t bytes)
+{
+  _maxBufferedOutput = bytes;
+  if (_maxBufferedOutput == 0 || _bufferedOutput < _maxBufferedOutput)
+    resumeConnections();
+}
+
+
+void
+XmlRpcServer::addBufferedOutput(long long bytes)
+{
+  _bufferedOutput = size_t((long long) _bufferedOutput + bytes);
+  if (bytes < 0 && _bufferedOutput < _maxBufferedOutput)
+    resumeConnections();
+}
+
+
+// Connections are paused when they have a request to read, so idle ones
+// keep watching for requests
+bool
+XmlRpcServer::pauseConnection(XmlRpcServerConnection* sc)
+{
+  if (_maxBufferedOutput == 0 || _bufferedOutput < _maxBufferedOutput)
+    return false;
+
+  XmlRpcUtil::log(3, "XmlRpcServer::pauseConnection: %d bytes of responses buffered, pausing socket %d.",
+                  int(_bufferedOutput), sc->getfd());
+  _disp.setSourceEvents(sc, 0);
+  _pausedConnections.push_back(sc);
+  return true;
+}
+
+
+void
+XmlRpcServer::resumeConnections()
+{
+  std::vector< XmlRpcServerConnection* > paused;
+  paused.swap(_pausedConnections);
+  for (size_t i = 0; i < paused.size(); ++i)
+    _disp.setSourceEvents(paused[i], XmlRpcDispatch::ReadableEvent);
 }
 
 
@@ -195,6 +656,13 @@ XmlRpcServer::shutdown()
 {
   // This closes and destroys all connections as well as closing this socket
   _disp.clear();
+  _disp.cancelTimer(&_acceptTimer);
+  _acceptPaused = false;
+
+  if ( ! _unixPath.empty()) {
+    XmlRpcSocket::removeUnix(_unixPath.c_str(), _unixInode);
+    _unixPath.clear();
+  }
 }
 
 
@@ -208,7 +676,7 @@ static const std::string MULTICALL("system.multicall");
 class ListMethods : public XmlRpcServerMethod
 {
 public:
-  ListMethods(XmlRpcServer* s) : XmlRpcServerMethod(LIST_METHODS, s) {}
+  ListMethods(XmlRpcServer* s) : XmlRpcServerMethod(LIST_METHODS, s) { setConstantResult(); }
 
   void execute(XmlRpcValue& params, XmlRpcValue& result)
   {
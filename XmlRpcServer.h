@@ -12,9 +12,13 @@
 #ifndef MAKEDEPEND
 # include <map>
 # include <string>
+# include <vector>
 #endif
 
 #include "XmlRpcDispatch.h"
+#include "XmlRpcLruCache.h"
+#include "XmlRpcPreparedResponse.h"
+#include "XmlRpcSocket.h"
 #include "XmlRpcSource.h"
 
 namespace XmlRpc {
@@ -29,10 +33,17 @@ namespace XmlRpc {
   // Class representing argument and result values
   class XmlRpcValue;
 
+  // Worker threads for executing multicall sub-calls in parallel
+  class XmlRpcThreadPool;
+
 
   //! A class to handle XML RPC requests
   class XmlRpcServer : public XmlRpcSource {
   public:
+    //! The default length of the queue of connections waiting to be accepted.
+    //! The system may limit it further (somaxconn on Linux).
+    static const int DEFAULT_BACKLOG = 511;
+
     //! Create a server object.
     XmlRpcServer();
     //! Destructor.
@@ -50,12 +61,187 @@ namespace XmlRpc {
     //! Remove a command from the RPC server by name
     void removeMethod(const std::string& methodName);
 
+    //! Add a command that is owned by the RPC server and deleted with it.
+    //! A method previously adopted under the same name is deleted.
+    void adoptMethod(XmlRpcServerMethod* method);
+
+    //! Add a command calling a function or lambda, with the parameters and result
+    //! converted between xml-rpc values and the native types of its signature, eg
+    //!   server.bind("add", [](int a, double b) -> double { return a + b; });
+    //! The method is owned by the server. Defined in XmlRpcBinding.h.
+    template<typename F>
+    XmlRpcServerMethod* bind(std::string const& name, F fn, std::string const& help = std::string());
+
     //! Look up a method by name
     XmlRpcServerMethod* findMethod(const std::string& name) const;
 
+    //! Look up a method by a name that is not nul-terminated, eg a range of the request buffer
+    XmlRpcServerMethod* findMethod(const char* name, int length) const;
+
+    //! Execute the thread-safe sub-calls of a system.multicall concurrently
+    //! on a pool of worker threads. Default is sequential execution.
+    //!  @param nThreads Number of worker threads, 0 to use one per hardware thread,
+    //!                  negative to disable parallel execution.
+    void enableParallelMulticall(int nThreads = 0);
+
+    //! Return the worker pool used for multicalls, or 0 if not enabled.
+    XmlRpcThreadPool* getMulticallPool() const { return _multicallPool; }
+
+    //! Specify whether responses of methods declared cacheable with
+    //! XmlRpcServerMethod::setCacheable are cached. Default is not enabled.
+    //! Responses are keyed by method and the raw bytes of the parameters, so a
+    //! hit is sent without parsing the parameters or executing the method.
+    void enableResponseCache(bool enabled=true);
+
+    //! Return whether the response cache is enabled.
+    bool isResponseCacheEnabled() const { return _responseCacheEnabled; }
+
+    //! Look up the cached response to a call, returns null if there is none.
+    //!  @param params The raw request bytes following the method name
+    XmlRpcPreparedResponse::Ptr findCachedResponse(XmlRpcServerMethod* method, const char* params, int length);
+
+    //! Store the response to a call in the cache.
+    void cacheResponse(XmlRpcServerMethod* method, const char* params, int length,
+                       XmlRpcPreparedResponse::Ptr const& response);
+
+    //! Discard the cached responses of a method, or of all methods if method is 0.
+    //! Like the rest of the cache, this must be called from the thread running work().
+    void invalidateCache(XmlRpcServerMethod* method = 0);
+
+    //! Specify the minimum size in bytes of a response body that is compressed
+    //! for clients that accept it (Accept-Encoding). Smaller responses are sent
+    //! as they are; a negative size disables compression, which is the default.
+    //! Older XmlRpc++ clients send Accept-Encoding without being able to decode
+    //! compressed responses, so only enable this once the clients are upgraded.
+    //! Has no effect unless built with _ZLIB_ENABLED.
+    void setCompressionThreshold(int bytes) { _compressionThreshold = bytes; }
+
+    //! Return the minimum size of a compressed response body.
+    int getCompressionThreshold() const { return _compressionThreshold; }
+
+    //! Specify the seconds a connection may wait for its next request before
+    //! it is closed. 0 disables the timeout. Default is 60.
+    void setIdleTimeout(double seconds) { _idleTimeout = seconds; }
+    double getIdleTimeout() const { return _idleTimeout; }
+
+    //! Specify the seconds a client has to send a whole request header once
+    //! it has started. 0 disables the timeout. Default is 30.
+    void setHeaderTimeout(double seconds) { _headerTimeout = seconds; }
+    double getHeaderTimeout() const { return _headerTimeout; }
+
+    //! Specify the seconds reading a request body may go without receiving
+    //! data. 0 disables the timeout. Default is 30.
+    void setBodyTimeout(double seconds) { _bodyTimeout = seconds; }
+    double getBodyTimeout() const { return _bodyTimeout; }
+
+    //! Specify the seconds writing a response may go without the client
+    //! accepting data. 0 disables the timeout. Default is 30.
+    void setWriteTimeout(double seconds) { _writeTimeout = seconds; }
+    double getWriteTimeout() const { return _writeTimeout; }
+
+    //! Specify the most connections accepted each time the listening socket
+    //! becomes readable, so a flood of new clients does not starve the
+    //! connections already established. 0 accepts all pending connections.
+    //! Default is 64.
+    void setAcceptBudget(int connections) { _acceptBudget = connections; }
+
+    //! Return the most connections accepted per wakeup.
+    int getAcceptBudget() const { return _acceptBudget; }
+
+    //! Specify the most connections served at once. Clients connecting beyond
+    //! the limit receive a 503 (Service Unavailable) response and are
+    //! disconnected. 0 means no limit, which is the default.
+    void setMaxConnections(int connections) { _maxConnections = connections; }
+
+    //! Return the most connections served at once.
+    int getMaxConnections() const { return _maxConnections; }
+
+    //! Return the number of connections currently served.
+    int getConnectionCount() const { return _connectionCount; }
+
+    //! Specify the longest request header accepted, in bytes. Default is 65536.
+    void setMaxHeaderSize(int bytes) { _maxHeaderSize = bytes; }
+
+    //! Return the longest request header accepted.
+    int getMaxHeaderSize() const { return _maxHeaderSize; }
+
+    //! Specify the largest request body accepted, in bytes, once decompressed.
+    //! A request with a longer Content-length is refused before its body is
+    //! read. 0 means no limit, which is the default.
+    void setMaxRequestSize(int bytes) { _maxRequestSize = bytes; }
+
+    //! Return the largest request body accepted.
+    int getMaxRequestSize() const { return _maxRequestSize; }
+
+    //! Specify the largest response a connection buffers, in bytes. A method
+    //! returning more sends a fault instead. 0 means no limit, which is the default.
+    void setMaxResponseSize(int bytes) { _maxResponseSize = bytes; }
+
+    //! Return the largest response a connection buffers.
+    int getMaxResponseSize() const { return _maxResponseSize; }
+
+    //! Specify the most bytes of responses buffered by all connections
+    //! together. Beyond it, connections stop reading requests until enough
+    //! of the responses have been sent. 0 means no limit, which is the default.
+    void setMaxBufferedOutput(size_t bytes);
+
+    //! Return the most bytes of responses buffered by all connections.
+    size_t getMaxBufferedOutput() const { return _maxBufferedOutput; }
+
+    //! Return the bytes of responses buffered by all connections.
+    size_t getBufferedOutput() const { return _bufferedOutput; }
+
+    //! Account for a response buffered by a connection, or released when it
+    //! has been sent (a negative number of bytes).
+    void addBufferedOutput(long long bytes);
+
+    //! Stop reading requests on a connection if too many bytes of responses
+    //! are buffered. Returns true if the connection was paused; it resumes
+    //! once the buffered output is below the limit again.
+    bool pauseConnection(XmlRpcServerConnection* connection);
+
     //! Create a socket, bind to the specified port, and
     //! set it in listen mode to make it available for clients.
-    bool bindAndListen(int port, int backlog = 5);
+    bool bindAndListen(int port, int backlog = DEFAULT_BACKLOG);
+
+    //! Create a socket, bind to the specified port, and set it in listen mode
+    //! to make it available for clients, with the given socket options. The
+    //! options also apply to the connections accepted.
+    bool bindAndListen(int port, XmlRpcSocketOptions const& options, int backlog = DEFAULT_BACKLOG);
+
+    //! Return the options applied to accepted connections.
+    XmlRpcSocketOptions const& getSocketOptions() const { return _socketOptions; }
+
+#ifdef _OPENSSL_ENABLED
+    //! Serve the connections accepted by bindAndListen over TLS (HTTPS), with
+    //! the certificate chain and private key in PEM files. The connections
+    //! share one TLS context. Returns false if the files cannot be loaded.
+    bool enableSSL(const char* certFile, const char* keyFile = 0);
+
+    //! Return the TLS context of the connections, NULL if TLS is not enabled.
+    void* getSSLContext() const { return _sslContext; }
+
+    //! Specify whether the kernel encrypts the responses (kTLS), where it
+    //! can (@see XmlRpcSocket::setKernelTLS). Default is false.
+    void setKernelTLS(bool enable);
+
+    //! Return whether kernel TLS is used where it can be.
+    bool getKernelTLS() const { return _kernelTLS; }
+#endif
+
+#if !defined(_WIN32)
+    //! Create a Unix domain socket, bind to the specified path, and set it in
+    //! listen mode to make it available for local clients. The socket file is
+    //! removed by shutdown().
+    bool bindAndListen(const char* path, int backlog = DEFAULT_BACKLOG);
+#endif
+
+#if defined(__linux__)
+    //! Accept clients of the shared memory transport (@see XmlRpcShmClient) on
+    //! a Unix domain socket at the specified path. This may be used alongside
+    //! bindAndListen. The socket file is removed by shutdown().
+    bool bindSharedMemory(const char* path, int backlog = DEFAULT_BACKLOG);
+#endif
 
     //! Process client requests for the specified time
     void work(double msTime);
@@ -74,14 +260,25 @@ namespace XmlRpc {
     //! Handle client connection requests
     virtual unsigned handleEvent(unsigned eventType);
 
+    //! Add a connection to the dispatcher, its requests are served by work()
+    virtual void addConnection(XmlRpcServerConnection*);
+
     //! Remove a connection from the dispatcher
     virtual void removeConnection(XmlRpcServerConnection*);
 
+    //! Return the dispatcher serving the connections.
+    XmlRpcDispatch* getDispatch() { return &_disp; }
+
   protected:
 
-    //! Accept a client connection request
+    //! Accept pending client connection requests, up to the accept budget.
+    //! When the process runs out of descriptors, the listening socket is not
+    //! watched until a connection closes or a short delay has passed.
     virtual void acceptConnection();
 
+    //! Turn away a client when the connection limit is reached.
+    virtual void refuseConnection(int socket);
+
     //! Create a new connection object for processing requests from a specific client.
     virtual XmlRpcServerConnection* createConnection(int socket);
 
@@ -95,10 +292,103 @@ namespace XmlRpc {
     typedef std::map< std::string, XmlRpcServerMethod* > MethodMap;
     MethodMap _methods;
 
+    // Rebuild the dispatch table after the collection of methods changed
+    void rebuildDispatchTable();
+
+    // Open addressing (linear probing) hash table over _methods, used to
+    // dispatch requests without string allocations. The size is a power of 2.
+    struct DispatchSlot {
+      unsigned _hash;
+      const std::string* _name;       // Key in _methods, 0 if the slot is empty
+      XmlRpcServerMethod* _method;
+    };
+    typedef std::vector< DispatchSlot > DispatchTable;
+    DispatchTable _dispatch;
+
+    // Methods owned by the server
+    std::vector< XmlRpcServerMethod* > _ownedMethods;
+
     // system methods
     XmlRpcServerMethod* _listMethods;
     XmlRpcServerMethod* _methodHelp;
 
+    // Workers for parallel multicall execution
+    XmlRpcThreadPool* _multicallPool;
+
+    // A cached response along with the parameters it was generated for,
+    // keyed by the hash of the parameters
+    struct CachedResponse {
+      std::string _params;
+      XmlRpcPreparedResponse::Ptr _response;
+    };
+    typedef XmlRpcLruCache< unsigned long long, CachedResponse > ResponseCache;
+    typedef std::map< XmlRpcServerMethod*, ResponseCache > ResponseCacheMap;
+    ResponseCacheMap _responseCache;
+    bool _responseCacheEnabled;
+
+    // Minimum size of a response body to compress, negative to disable
+    int _compressionThreshold;
+
+    // Connection timeouts in seconds, 0 to disable
+    double _idleTimeout;
+    double _headerTimeout;
+    double _bodyTimeout;
+    double _writeTimeout;
+
+    // Most connections accepted per wakeup, 0 for no limit
+    int _acceptBudget;
+
+    // Most connections served at once, 0 for no limit, and the current count
+    int _maxConnections;
+    int _connectionCount;
+
+    // Memory limits of connections, 0 for no limit
+    int _maxHeaderSize;
+    int _maxRequestSize;
+    int _maxResponseSize;
+
+    // Bytes of responses buffered by all connections, the most allowed
+    // before connections stop reading, and the connections stopped
+    size_t _bufferedOutput;
+    size_t _maxBufferedOutput;
+    std::vector< XmlRpcServerConnection* > _pausedConnections;
+
+    // Let the paused connections read again
+    void resumeConnections();
+
+    // Options for the listening socket and accepted connections
+    XmlRpcSocketOptions _socketOptions;
+
+#ifdef _OPENSSL_ENABLED
+    // TLS context of the connections, if enabled, and whether it uses kernel TLS
+    void* _sslContext;
+    bool _kernelTLS;
+#endif
+
+    // Path of the Unix domain socket listened on, if any, and its inode
+    std::string _unixPath;
+    unsigned long long _unixInode;
+
+    // Listener for shared memory transport clients
+    XmlRpcSource* _shmListener;
+
+    // Whether the listening socket is not watched for lack of descriptors,
+    // and the timer that watches it again
+    class AcceptTimer : public XmlRpcTimer {
+    public:
+      AcceptTimer(XmlRpcServer* server) : _server(server) {}
+      virtual void handleTimeout() { _server->resumeAccepting(); }
+    private:
+      XmlRpcServer* _server;
+    };
+
+    bool _acceptPaused;
+    AcceptTimer _acceptTimer;
+
+    static bool isResourceError(int error);
+    void pauseAccepting();
+    void resumeAccepting();
+
   };
 } // namespace XmlRpc
 
@@ -1,18 +1,23 @@
 
 #include "XmlRpcServerConnection.h"
 
+#include "XmlRpcServerMethod.h"
 #include "XmlRpcSocket.h"
+#include "XmlRpcThreadPool.h"
 #include "XmlRpc.h"
 #ifndef MAKEDEPEND
+# include <exception>
 # include <stdio.h>
 # include <stdlib.h>
 # include <string.h>
+# include <vector>
 #endif
 
 using namespace XmlRpc;
 
 // Static data
 const char XmlRpcServerConnection::METHODNAME_TAG[] = "<methodName>";
+const char XmlRpcServerConnection::METHODNAME_ETAG[] = "</methodName>";
 const char XmlRpcServerConnection::PARAMS_TAG[] = "<params>";
 const char XmlRpcServerConnection::PARAMS_ETAG[] = "</params>";
 const char XmlRpcServerConnection::PARAM_TAG[] = "<param>";
@@ -35,14 +40,57 @@ XmlRpcServerConnection::XmlRpcServerConnection(int fd, XmlRpcServer* server, boo
   _server = server;
   _connectionState = READ_HEADER;
   _keepAlive = true;
+  _requestEncoding = XmlRpcCompression::Identity;
+  _responseEncoding = XmlRpcCompression::Identity;
+  _chunkedRequest = false;
+  _bytesWritten = 0;
+  _bufferedOutput = 0;
+  _httpHeader.setMaxLength(server->getMaxHeaderSize());
+  _timeout = NO_TIMEOUT;
+#ifdef _OPENSSL_ENABLED
+  _sslHandle = NULL;
+  _sslAccepted = true;
+#endif
+  updateTimeout();
 }
 
 
 XmlRpcServerConnection::~XmlRpcServerConnection()
 {
   XmlRpcUtil::log(4,"XmlRpcServerConnection dtor.");
+  releaseOutput();
   _server->removeConnection(this);
+#ifdef _OPENSSL_ENABLED
+  if (_sslHandle)
+    XmlRpcSocket::freeSSL(_sslHandle);
+#endif
+}
+
+
+// End TLS before the socket is closed
+void
+XmlRpcServerConnection::close()
+{
+#ifdef _OPENSSL_ENABLED
+  if (_sslHandle) {
+    XmlRpcSocket::shutdownSSL(_sslHandle);
+    XmlRpcSocket::freeSSL(_sslHandle);
+    _sslHandle = NULL;
+  }
+#endif
+  XmlRpcSource::close();
+}
+
+
+#ifdef _OPENSSL_ENABLED
+void
+XmlRpcServerConnection::startSSL(void* context)
+{
+  // A connection that cannot start TLS is closed by its first event
+  _sslHandle = XmlRpcSocket::createSSL(context, getfd(), true);
+  _sslAccepted = false;
 }
+#endif
 
 
 // Handle input on the server socket by accepting the connection
@@ -51,26 +99,105 @@ XmlRpcServerConnection::~XmlRpcServerConnection()
 unsigned
 XmlRpcServerConnection::handleEvent(unsigned /*eventType*/)
 {
-  if (_connectionState == READ_HEADER)
-    if ( ! readHeader()) return 0;
+#ifdef _OPENSSL_ENABLED
+  // The TLS handshake completes before the request is read
+  if ( ! _sslAccepted) {
+    int status = _sslHandle ? XmlRpcSocket::handshakeSSL(_sslHandle) : -1;
+    if (status < 0) {
+      XmlRpcUtil::error("XmlRpcServerConnection::handleEvent: TLS handshake failed on socket %d.", getfd());
+      return 0;
+    }
+    if (status == 0)
+      return XmlRpcSocket::getSSLEvents(_sslHandle);
+    _sslAccepted = true;
+  }
+#endif
+
+  // Leave the request in the socket while the server has too many responses
+  // to send; the connection watches no events until it is resumed
+  if (_connectionState != WRITE_RESPONSE && _server->pauseConnection(this))
+    return XmlRpcDispatch::ReadableEvent;
+
+  for (;;) {
+    if (_connectionState == READ_HEADER)
+      if ( ! readHeader()) return 0;
+
+    if (_connectionState == READ_REQUEST)
+      if ( ! readRequest()) return 0;
+
+    if (_connectionState == WRITE_RESPONSE)
+      if ( ! writeResponse()) return 0;
 
-  if (_connectionState == READ_REQUEST)
-    if ( ! readRequest()) return 0;
+#ifdef _OPENSSL_ENABLED
+    // A read that stopped at the end of a request may have left the next
+    // request decrypted in OpenSSL, where the poll does not see it
+    if (_connectionState == READ_HEADER && _sslHandle && XmlRpcSocket::hasPendingSSL(_sslHandle))
+      continue;
+#endif
+    break;
+  }
 
-  if (_connectionState == WRITE_RESPONSE)
-    if ( ! writeResponse()) return 0;
+  updateTimeout();
+
+#ifdef _OPENSSL_ENABLED
+  // A TLS read may need to write, or a write to read
+  if (_sslHandle && XmlRpcSocket::getSSLEvents(_sslHandle))
+    return XmlRpcSocket::getSSLEvents(_sslHandle);
+#endif
 
   return (_connectionState == WRITE_RESPONSE) 
         ? XmlRpcDispatch::WritableEvent : XmlRpcDispatch::ReadableEvent;
 }
 
 
+// Arm the timer for the state the connection is in
+void
+XmlRpcServerConnection::updateTimeout()
+{
+  ConnectionTimeout timeout;
+  double seconds;
+  switch (_connectionState) {
+    case READ_HEADER:
+      // Trickling a header in does not extend its deadline
+      timeout = _header.empty() ? IDLE_TIMEOUT : HEADER_TIMEOUT;
+      if (timeout == _timeout)
+        return;
+      seconds = _header.empty() ? _server->getIdleTimeout() : _server->getHeaderTimeout();
+      break;
+    case READ_REQUEST:
+      timeout = BODY_TIMEOUT;
+      seconds = _server->getBodyTimeout();
+      break;
+    default:
+      timeout = WRITE_TIMEOUT;
+      seconds = _server->getWriteTimeout();
+      break;
+  }
+
+  _timeout = timeout;
+  if (seconds > 0.0)
+    _server->getDispatch()->armTimer(this, seconds);
+  else
+    _server->getDispatch()->cancelTimer(this);
+}
+
+
+void
+XmlRpcServerConnection::handleTimeout()
+{
+  static const char* names[] = { "", "idle", "header", "body", "write" };
+  XmlRpcUtil::log(2, "XmlRpcServerConnection::handleTimeout: %s timeout on socket %d, closing.", names[_timeout], getfd());
+  close();
+}
+
+
 bool
 XmlRpcServerConnection::readHeader()
 {
   // Read available data
+  // Read no more than the longest header allowed, with one byte to tell it is too long
   bool eof;
-  if ( ! XmlRpcSocket::nbRead(this->getfd(), _header, &eof)) {
+  if ( ! readSocket(_header, &eof, _httpHeader.getMaxLength() + 1)) {
     // Its only an error if we already have read some data
     if (_header.length() > 0)
       XmlRpcUtil::error("XmlRpcServerConnection::readHeader: error while reading header (%s).",XmlRpcSocket::getErrorMsg().c_str());
@@ -78,25 +205,16 @@ XmlRpcServerConnection::readHeader()
   }
 
   XmlRpcUtil::log(4, "XmlRpcServerConnection::readHeader: read %d bytes.", _header.length());
-  char *hp = (char*)_header.c_str();  // Start of header
-  char *ep = hp + _header.length();   // End of string
-  char *bp = 0;                       // Start of body
-  char *lp = 0;                       // Start of content-length value
-  char *kp = 0;                       // Start of connection value
-
-  for (char *cp = hp; (bp == 0) && (cp < ep); ++cp) {
-	if ((ep - cp > 16) && (strncasecmp(cp, "Content-length: ", 16) == 0))
-	  lp = cp + 16;
-	else if ((ep - cp > 12) && (strncasecmp(cp, "Connection: ", 12) == 0))
-	  kp = cp + 12;
-	else if ((ep - cp > 4) && (strncmp(cp, "\r\n\r\n", 4) == 0))
-	  bp = cp + 4;
-	else if ((ep - cp > 2) && (strncmp(cp, "\n\n", 2) == 0))
-	  bp = cp + 2;
+
+  // Parse the lines that arrived since the last read
+  XmlRpcHttpHeader::Status status = _httpHeader.parse(_header.data(), int(_header.length()));
+  if (status == XmlRpcHttpHeader::Invalid) {
+    XmlRpcUtil::error("XmlRpcServerConnection::readHeader: Invalid header");
+    return false;
   }
 
   // If we haven't gotten the entire header yet, return (keep reading)
-  if (bp == 0) {
+  if (status == XmlRpcHttpHeader::Incomplete) {
     // EOF in the middle of a request is an error, otherwise its ok
     if (eof) {
       XmlRpcUtil::log(4, "XmlRpcServerConnection::readHeader: EOF");
@@ -108,36 +226,71 @@ XmlRpcServerConnection::readHeader()
     return true;  // Keep reading
   }
 
-  // Decode content length
-  if (lp == 0) {
-    XmlRpcUtil::error("XmlRpcServerConnection::readHeader: No Content-length specified");
-    return false;   // We could try to figure it out by parsing as we read, but for now...
-  }
-
-  _contentLength = atoi(lp);
-  if (_contentLength <= 0) {
-    XmlRpcUtil::error("XmlRpcServerConnection::readHeader: Invalid Content-length specified (%d).", _contentLength);
+  if ( ! _httpHeader.isRequest()) {
+    XmlRpcUtil::error("XmlRpcServerConnection::readHeader: Invalid request line");
     return false;
   }
+
+  const char *bp = _header.data() + _httpHeader.getBodyOffset();   // Start of body
+  const char *ep = _header.data() + _header.length();              // End of data
+
+  // A chunked body ends with its last chunk, otherwise decode content length
+  _chunkedRequest = _httpHeader.isChunked();
+  if (_chunkedRequest) {
+    XmlRpcUtil::log(3, "XmlRpcServerConnection::readHeader: chunked request.");
+  } else {
+    _contentLength = _httpHeader.getContentLength();
+    if (_contentLength < 0) {
+      XmlRpcUtil::error("XmlRpcServerConnection::readHeader: No Content-length specified");
+      return false;
+    }
+    if (_contentLength == 0) {
+      XmlRpcUtil::error("XmlRpcServerConnection::readHeader: Invalid Content-length specified (%d).", _contentLength);
+      return false;
+    }
+    if (_server->getMaxRequestSize() > 0 && _contentLength > _server->getMaxRequestSize()) {
+      XmlRpcUtil::error("XmlRpcServerConnection::readHeader: Content-length %d is over the limit of %d.",
+                        _contentLength, _server->getMaxRequestSize());
+      return false;
+    }
   	
-  XmlRpcUtil::log(3, "XmlRpcServerConnection::readHeader: specified content length is %d.", _contentLength);
+    XmlRpcUtil::log(3, "XmlRpcServerConnection::readHeader: specified content length is %d.", _contentLength);
+  }
+
+  // Compressed requests are decoded once they have been read
+  const std::string* value = _httpHeader.getField("Content-Encoding");
+  _requestEncoding = XmlRpcCompression::Identity;
+  if (value) {
+    _requestEncoding = XmlRpcCompression::parseEncoding(value->c_str(), int(value->length()));
+    if (_requestEncoding == XmlRpcCompression::Unknown ||
+        (_requestEncoding != XmlRpcCompression::Identity && ! XmlRpcCompression::isSupported())) {
+      XmlRpcUtil::error("XmlRpcServerConnection::readHeader: Unsupported Content-Encoding specified.");
+      return false;
+    }
+  }
+
+  value = _httpHeader.getField("Accept-Encoding");
+  _responseEncoding = XmlRpcCompression::Identity;
+  if (value)
+    _responseEncoding = XmlRpcCompression::parseAcceptEncoding(value->c_str(), int(value->length()));
 
   // Otherwise copy non-header data to request buffer and set state to read request.
-  _request = bp;
+  // The body may be compressed, so it is copied by length rather than as a C string.
+  if (_chunkedRequest) {
+    _request.clear();
+    _chunkDecoder.reset();
+    if ( ! _chunkDecoder.decode(bp, int(ep - bp), _request))
+      return false;
+  } else
+    _request.assign(bp, ep - bp);
 
   // Parse out any interesting bits from the header (HTTP version, connection)
-  _keepAlive = true;
-  if (_header.find("HTTP/1.0") != std::string::npos) {
-    if (kp == 0 || strncasecmp(kp, "keep-alive", 10) != 0)
-      _keepAlive = false;           // Default for HTTP 1.0 is to close the connection
-  } else {
-    if (kp != 0 && strncasecmp(kp, "close", 5) == 0)
-      _keepAlive = false;
-  }
+  _keepAlive = _httpHeader.isKeepAlive();
   XmlRpcUtil::log(3, "KeepAlive: %d", _keepAlive);
 
 
   _header = ""; 
+  _httpHeader.reset();
   _connectionState = READ_REQUEST;
   return true;    // Continue monitoring this source
 }
@@ -145,10 +298,39 @@ XmlRpcServerConnection::readHeader()
 bool
 XmlRpcServerConnection::readRequest()
 {
+  // Chunked requests are decoded as they are read, until the last chunk
+  if (_chunkedRequest && ! _chunkDecoder.isComplete()) {
+    bool eof;
+    std::string data;
+    if ( ! readSocket(data, &eof)) {
+      XmlRpcUtil::error("XmlRpcServerConnection::readRequest: read error (%s).",XmlRpcSocket::getErrorMsg().c_str());
+      return false;
+    }
+
+    if ( ! _chunkDecoder.decode(data.data(), int(data.length()), _request))
+      return false;
+
+    if (_server->getMaxRequestSize() > 0 && int(_request.length()) > _server->getMaxRequestSize()) {
+      XmlRpcUtil::error("XmlRpcServerConnection::readRequest: chunked request over the limit of %d bytes.",
+                        _server->getMaxRequestSize());
+      return false;
+    }
+
+    if ( ! _chunkDecoder.isComplete()) {
+      if (eof) {
+        XmlRpcUtil::error("XmlRpcServerConnection::readRequest: EOF while reading request");
+        return false;
+      }
+      return true;
+    }
+  }
+  if (_chunkedRequest)
+    _contentLength = int(_request.length());
+
   // If we dont have the entire request yet, read available data
   if (int(_request.length()) < _contentLength) {
     bool eof;
-    if ( ! XmlRpcSocket::nbRead(this->getfd(), _request, &eof)) {
+    if ( ! readSocket(_request, &eof, _contentLength)) {
       XmlRpcUtil::error("XmlRpcServerConnection::readRequest: read error (%s).",XmlRpcSocket::getErrorMsg().c_str());
       return false;
     }
@@ -165,6 +347,18 @@ XmlRpcServerConnection::readRequest()
 
   // Otherwise, parse and dispatch the request
   XmlRpcUtil::log(3, "XmlRpcServerConnection::readRequest read %d bytes.", _request.length());
+
+  if (_requestEncoding != XmlRpcCompression::Identity) {
+    std::string request;
+    if ( ! XmlRpcCompression::decompress(_requestEncoding, _request.data(), _contentLength, request,
+                                         _server->getMaxRequestSize())) {
+      XmlRpcUtil::error("XmlRpcServerConnection::readRequest: could not decompress %s request.",
+                        XmlRpcCompression::getName(_requestEncoding));
+      return false;
+    }
+    _request.swap(request);
+    XmlRpcUtil::log(3, "XmlRpcServerConnection::readRequest decompressed to %d bytes.", _request.length());
+  }
   //XmlRpcUtil::log(5, "XmlRpcServerConnection::readRequest:\n%s\n", _request.c_str());
 
   _connectionState = WRITE_RESPONSE;
@@ -176,47 +370,149 @@ XmlRpcServerConnection::readRequest()
 bool
 XmlRpcServerConnection::writeResponse()
 {
-  if (_response.length() == 0) {
+  if (_response.length() == 0 && ! _prepared) {
     executeRequest();
     _bytesWritten = 0;
-    if (_response.length() == 0) {
+    if (_response.length() == 0 && ! _prepared) {
       XmlRpcUtil::error("XmlRpcServerConnection::writeResponse: empty response.");
       return false;
     }
+    bufferOutput();
   }
 
+  // Prepared responses are written from the shared copy
+  std::string const& response = _prepared ? _prepared->getMessage() : _response;
+
+  // Hold partial frames until the whole response is written
+  bool cork = _server->getSocketOptions().cork;
+  if (cork && _bytesWritten == 0)
+    XmlRpcSocket::setCork(this->getfd(), true);
+
   // Try to write the response
-  if ( ! XmlRpcSocket::nbWrite(this->getfd(), _response, &_bytesWritten)) {
+  if ( ! writeSocket(response, &_bytesWritten)) {
     XmlRpcUtil::error("XmlRpcServerConnection::writeResponse: write error (%s).",XmlRpcSocket::getErrorMsg().c_str());
     return false;
   }
-  XmlRpcUtil::log(3, "XmlRpcServerConnection::writeResponse: wrote %d of %d bytes.", _bytesWritten, _response.length());
+  XmlRpcUtil::log(3, "XmlRpcServerConnection::writeResponse: wrote %d of %d bytes.", _bytesWritten, response.length());
 
   // Prepare to read the next request
-  if (_bytesWritten == int(_response.length())) {
+  if (_bytesWritten == int(response.length())) {
+    _timeout = NO_TIMEOUT;      // The idle timeout starts over
+    if (cork)
+      XmlRpcSocket::setCork(this->getfd(), false);
+    releaseOutput();
     _header = "";
     _request = "";
     _response = "";
+    _prepared.reset();
     _connectionState = READ_HEADER;
   }
 
   return _keepAlive;    // Continue monitoring this source if true
 }
 
+// Count the response in the server's buffered output. A response over the
+// limit for a connection is replaced by a fault.
+void
+XmlRpcServerConnection::bufferOutput()
+{
+  int size = _prepared ? int(_prepared->getMessage().length())
+                       : int(_response.length());
+  int maxSize = _server->getMaxResponseSize();
+  if (maxSize > 0 && size > maxSize) {
+    XmlRpcUtil::error("XmlRpcServerConnection::bufferOutput: response of %d bytes is over the limit of %d.", size, maxSize);
+    _prepared.reset();
+    generateFaultResponse("Response too large");
+    size = int(_response.length());
+  }
+
+  _bufferedOutput = size;
+  _server->addBufferedOutput(size);
+}
+
+
+void
+XmlRpcServerConnection::releaseOutput()
+{
+  if (_bufferedOutput) {
+    _server->addBufferedOutput(-(long long) _bufferedOutput);
+    _bufferedOutput = 0;
+  }
+}
+
+
+bool
+XmlRpcServerConnection::readSocket(std::string& s, bool* eof, int target)
+{
+#ifdef _OPENSSL_ENABLED
+  return XmlRpcSocket::nbRead(this->getfd(), s, eof, _sslHandle, target);
+#else
+  return XmlRpcSocket::nbRead(this->getfd(), s, eof, target);
+#endif
+}
+
+
+bool
+XmlRpcServerConnection::writeSocket(std::string const& s, int* bytesSoFar)
+{
+#ifdef _OPENSSL_ENABLED
+  return XmlRpcSocket::nbWrite(this->getfd(), s, bytesSoFar, _sslHandle);
+#else
+  return XmlRpcSocket::nbWrite(this->getfd(), s, bytesSoFar);
+#endif
+}
+
+
 // Run the method, generate _response string
 void
 XmlRpcServerConnection::executeRequest()
 {
-  XmlRpcValue params, resultValue;
-  std::string methodName = parseRequest(params);
-  XmlRpcUtil::log(2, "XmlRpcServerConnection::executeRequest: server calling method '%s'", 
-                    methodName.c_str());
+  int offset = 0, nameStart = 0, nameLength = 0;
+  bool hasName = parseMethodName(&nameStart, &nameLength, &offset);
+
+  // The name is looked up in place, a string is only built for multicalls and faults
+  const char* name = _request.c_str() + nameStart;
+  XmlRpcUtil::log(2, "XmlRpcServerConnection::executeRequest: server calling method '%.*s'", 
+                    nameLength, name);
 
   try {
 
-    if ( ! executeMethod(methodName, params, resultValue) &&
-         ! executeMulticall(methodName, params, resultValue))
-      generateFaultResponse(methodName + ": unknown method name");
+    // The method decodes its own parameters from the request
+    XmlRpcServerMethod* method = _server->findMethod(name, nameLength);
+    if (method && method->hasConstantResult()) {
+      // Send the response prepared by an earlier call, or prepare it for the next ones
+      unsigned generation;
+      _prepared = method->getPreparedResponse(&generation);
+      if ( ! _prepared) {
+        _prepared = prepareResponse(method->executeXml(_request, &offset));
+        method->setPreparedResponse(_prepared, generation);
+      }
+      encodePreparedResponse();
+      return;
+    }
+    if (method && method->getCacheTtl() > 0.0 && _server->isResponseCacheEnabled()) {
+      // Look for a response to the same parameters in the server's cache
+      const char* params = _request.c_str() + offset;
+      int paramsLength = int(_request.length()) - offset;
+      _prepared = _server->findCachedResponse(method, params, paramsLength);
+      if ( ! _prepared) {
+        _prepared = prepareResponse(method->executeXml(_request, &offset));
+        _server->cacheResponse(method, params, paramsLength, _prepared);
+      }
+      encodePreparedResponse();
+      return;
+    }
+    if (method) {
+      generateResponse(method->executeXml(_request, &offset));
+      return;
+    }
+
+    XmlRpcValue params, resultValue;
+    if (hasName)
+      parseParams(params, &offset);
+
+    if ( ! executeMulticall(std::string(name, nameLength), params, resultValue))
+      generateFaultResponse(std::string(name, nameLength) + ": unknown method name");
     else
       generateResponse(resultValue.toXml());
 
@@ -231,22 +527,40 @@ XmlRpcServerConnection::executeRequest()
 std::string
 XmlRpcServerConnection::parseRequest(XmlRpcValue& params)
 {
-  int offset = 0;   // Number of chars parsed from the request
+  int offset = 0, nameStart = 0, nameLength = 0;
+  if ( ! parseMethodName(&nameStart, &nameLength, &offset))
+    return std::string();
 
-  std::string methodName = XmlRpcUtil::parseTag(METHODNAME_TAG, _request, &offset);
+  parseParams(params, &offset);
+  return _request.substr(nameStart, nameLength);
+}
 
-  if (methodName.size() > 0 && XmlRpcUtil::findTag(PARAMS_TAG, _request, &offset))
-  {
-    int nArgs = 0;
-    while (XmlRpcUtil::nextTagIs(PARAM_TAG, _request, &offset)) {
-      params[nArgs++] = XmlRpcValue(_request, &offset);
-      (void) XmlRpcUtil::nextTagIs(PARAM_ETAG, _request, &offset);
-    }
+// Locate the method name in the request without copying it. Updates offset
+// to the char after </methodName>.
+bool
+XmlRpcServerConnection::parseMethodName(int* nameStart, int* nameLength, int* offset)
+{
+  *nameStart = *nameLength = 0;
+  if (*offset >= int(_request.length())) return false;
 
-    (void) XmlRpcUtil::nextTagIs(PARAMS_ETAG, _request, &offset);
-  }
+  size_t istart = _request.find(METHODNAME_TAG, *offset);
+  if (istart == std::string::npos) return false;
+  istart += sizeof(METHODNAME_TAG) - 1;
+
+  size_t iend = _request.find(METHODNAME_ETAG, istart);
+  if (iend == std::string::npos) return false;
 
-  return methodName;
+  *nameStart = int(istart);
+  *nameLength = int(iend - istart);
+  *offset = int(iend + sizeof(METHODNAME_ETAG) - 1);
+  return *nameLength > 0;
+}
+
+// Parse the argument values following the method name.
+void
+XmlRpcServerConnection::parseParams(XmlRpcValue& params, int* offset)
+{
+  XmlRpcServerMethod::parseParams(_request, offset, params);
 }
 
 // Execute a named method with the specified params.
@@ -258,13 +572,20 @@ XmlRpcServerConnection::executeMethod(const std::string& methodName,
 
   if ( ! method) return false;
 
+  executeMethod(method, params, result);
+  return true;
+}
+
+// Execute a method that has already been looked up.
+void
+XmlRpcServerConnection::executeMethod(XmlRpcServerMethod* method,
+                                      XmlRpcValue& params, XmlRpcValue& result)
+{
   method->execute(params, result);
 
   // Ensure a valid result value
   if ( ! result.valid())
       result = std::string();
-
-  return true;
 }
 
 // Execute multiple calls and return the results in an array.
@@ -281,6 +602,10 @@ XmlRpcServerConnection::executeMulticall(const std::string& methodName,
   int nc = params[0].size();
   result.setSize(nc);
 
+  // Calls to thread-safe methods are deferred and run on the worker pool, if enabled
+  XmlRpcThreadPool* pool = _server->getMulticallPool();
+  std::vector<int> deferred;
+
   for (int i=0; i<nc; ++i) {
 
     if ( ! params[0][i].hasMember(METHODNAME) ||
@@ -294,56 +619,162 @@ XmlRpcServerConnection::executeMulticall(const std::string& methodName,
     const std::string& methodName = params[0][i][METHODNAME];
     XmlRpcValue& methodParams = params[0][i][PARAMS];
 
-    XmlRpcValue resultValue;
-    resultValue.setSize(1);
-    try {
-      if ( ! executeMethod(methodName, methodParams, resultValue[0]) &&
-           ! executeMulticall(methodName, params, resultValue[0]))
-      {
-        result[i][FAULTCODE] = -1;
-        result[i][FAULTSTRING] = methodName + ": unknown method name";
+    if (pool) {
+      XmlRpcServerMethod* method = _server->findMethod(methodName);
+      if (method && method->isThreadSafe()) {
+        deferred.push_back(i);
+        continue;
       }
-      else
-        result[i] = resultValue;
+    }
 
-    } catch (const XmlRpcException& fault) {
-        result[i][FAULTCODE] = fault.getCode();
-        result[i][FAULTSTRING] = fault.getMessage();
+    executeMulticallEntry(methodName, methodParams, result[i]);
+  }
+
+  if ( ! deferred.empty()) {
+    XmlRpcUtil::log(3, "XmlRpcServerConnection::executeMulticall: running %d calls on %d threads.",
+                    int(deferred.size()), pool->size());
+
+    // Resolve the values up front so the workers only touch their own entries
+    std::vector<const std::string*> names(deferred.size());
+    std::vector<XmlRpcValue*> args(deferred.size());
+    std::vector<XmlRpcValue*> results(deferred.size());
+    for (size_t j=0; j<deferred.size(); ++j) {
+      XmlRpcValue& call = params[0][deferred[j]];
+      names[j] = &static_cast<std::string&>(call[METHODNAME]);
+      args[j] = &call[PARAMS];
+      results[j] = &result[deferred[j]];
     }
+
+    pool->parallelFor(int(deferred.size()), [&](int j) {
+      executeMulticallEntry(*names[j], *args[j], *results[j]);
+    });
   }
 
   return true;
 }
 
+// Execute one call of a multicall. The result is stored as a single element
+// array, or as a fault struct if the call failed.
+void
+XmlRpcServerConnection::executeMulticallEntry(const std::string& methodName,
+                                              XmlRpcValue& params, XmlRpcValue& result)
+{
+  XmlRpcValue resultValue;
+  resultValue.setSize(1);
+  try {
+    if ( ! executeMethod(methodName, params, resultValue[0]) &&
+         ! executeMulticall(methodName, params, resultValue[0]))
+    {
+      result[FAULTCODE] = -1;
+      result[FAULTSTRING] = methodName + ": unknown method name";
+    }
+    else
+      result = resultValue;
+
+  } catch (const XmlRpcException& fault) {
+      result[FAULTCODE] = fault.getCode();
+      result[FAULTSTRING] = fault.getMessage();
+  } catch (const std::exception& e) {
+      // Calls may run on the worker pool, where nothing else would catch this
+      result[FAULTCODE] = -1;
+      result[FAULTSTRING] = methodName + ": " + e.what();
+  } catch (...) {
+      result[FAULTCODE] = -1;
+      result[FAULTSTRING] = methodName + ": unknown exception";
+  }
+}
+
 
 // Create a response from results xml
+static const char RESPONSE_1[] = 
+  "<?xml version=\"1.0\"?>\r\n"
+  "<methodResponse><params><param>\r\n\t";
+static const char RESPONSE_2[] =
+  "\r\n</param></params></methodResponse>\r\n";
+
 void
 XmlRpcServerConnection::generateResponse(std::string const& resultXml)
 {
-  const char RESPONSE_1[] = 
-    "<?xml version=\"1.0\"?>\r\n"
-    "<methodResponse><params><param>\r\n\t";
-  const char RESPONSE_2[] =
-    "\r\n</param></params></methodResponse>\r\n";
-
   std::string body = RESPONSE_1 + resultXml + RESPONSE_2;
-  std::string header = generateHeader(body);
 
-  _response = header + body;
+  generateMessage(body);
   XmlRpcUtil::log(5, "XmlRpcServerConnection::generateResponse:\n%s\n", _response.c_str()); 
 }
 
+// Create a response from results xml that can be shared with other connections
+XmlRpcPreparedResponse::Ptr
+XmlRpcServerConnection::prepareResponse(std::string const& resultXml)
+{
+  std::string body = RESPONSE_1 + resultXml + RESPONSE_2;
+  return std::make_shared<const XmlRpcPreparedResponse>(generateHeader(body), body);
+}
+
+// Choose the encoding of a response body of the given size
+XmlRpcCompression::Encoding
+XmlRpcServerConnection::selectEncoding(int bodyLength) const
+{
+  int threshold = _server->getCompressionThreshold();
+  if (threshold < 0 || bodyLength < threshold)
+    return XmlRpcCompression::Identity;
+  return _responseEncoding;
+}
+
+// Replace a shared response with its compressed variant, compressing it if
+// this is the first client to ask for the encoding
+void
+XmlRpcServerConnection::encodePreparedResponse()
+{
+  XmlRpcCompression::Encoding encoding = selectEncoding(_prepared->getBodyLength());
+  if (encoding == XmlRpcCompression::Identity)
+    return;
+
+  XmlRpcPreparedResponse::Ptr encoded = _prepared->getEncoded(encoding);
+  if ( ! encoded) {
+    std::string body;
+    const char* message = _prepared->getMessage().data();
+    if ( ! XmlRpcCompression::compress(encoding, message + _prepared->getHeaderLength(),
+                                       _prepared->getBodyLength(), body))
+      return;
+    encoded = std::make_shared<const XmlRpcPreparedResponse>(generateHeader(body, encoding), body);
+    _prepared->setEncoded(encoding, encoded);
+  }
+  _prepared = encoded;
+}
+
+// Create the http message for a body, compressed if the client accepts it.
+// The body is consumed.
+void
+XmlRpcServerConnection::generateMessage(std::string& body)
+{
+  XmlRpcCompression::Encoding encoding = selectEncoding(int(body.length()));
+  if (encoding != XmlRpcCompression::Identity) {
+    std::string compressed;
+    if (XmlRpcCompression::compress(encoding, body.data(), int(body.length()), compressed))
+      body.swap(compressed);
+    else
+      encoding = XmlRpcCompression::Identity;
+  }
+
+  _response = generateHeader(body, encoding) + body;
+}
+
 // Prepend http headers
 std::string
-XmlRpcServerConnection::generateHeader(std::string const& body)
+XmlRpcServerConnection::generateHeader(std::string const& body,
+                                       XmlRpcCompression::Encoding encoding /*= Identity*/)
 {
   std::string header = 
     "HTTP/1.1 200 OK\r\n"
     "Server: ";
   header += XMLRPC_VERSION;
   header += "\r\n"
-    "Content-Type: text/xml\r\n"
-    "Content-length: ";
+    "Content-Type: text/xml\r\n";
+  if (encoding != XmlRpcCompression::Identity) {
+    header += "Content-Encoding: ";
+    header += XmlRpcCompression::getName(encoding);
+    header += "\r\n";
+  }
+  header += "Content-length: ";
 
   char buffLen[40];
   sprintf(buffLen,"%u\r\n\r\n", (unsigned int)body.size());
@@ -365,8 +796,7 @@ XmlRpcServerConnection::generateFaultResponse(std::string const& errorMsg, int e
   faultStruct[FAULTCODE] = errorCode;
   faultStruct[FAULTSTRING] = errorMsg;
   std::string body = RESPONSE_1 + faultStruct.toXml() + RESPONSE_2;
-  std::string header = generateHeader(body);
 
-  _response = header + body;
+  generateMessage(body);
 }
 
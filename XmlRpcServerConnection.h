@@ -12,6 +12,11 @@
 # include <string>
 #endif
 
+#include "XmlRpcChunked.h"
+#include "XmlRpcCompression.h"
+#include "XmlRpcDispatch.h"
+#include "XmlRpcHttpHeader.h"
+#include "XmlRpcPreparedResponse.h"
 #include "XmlRpcValue.h"
 #include "XmlRpcSource.h"
 
@@ -22,11 +27,13 @@ namespace XmlRpc {
   class XmlRpcServer;
   class XmlRpcServerMethod;
 
-  //! A class to handle XML RPC requests from a particular client
-  class XmlRpcServerConnection : public XmlRpcSource {
+  //! A class to handle XML RPC requests from a particular client. Connections
+  //! that wait too long for the client are closed (@see XmlRpcServer::setIdleTimeout).
+  class XmlRpcServerConnection : public XmlRpcSource, public XmlRpcTimer {
   public:
     // Static data
     static const char METHODNAME_TAG[];
+    static const char METHODNAME_ETAG[];
     static const char PARAMS_TAG[];
     static const char PARAMS_ETAG[];
     static const char PARAM_TAG[];
@@ -49,28 +56,67 @@ namespace XmlRpc {
     //!   @param eventType Type of IO event that occurred. @see XmlRpcDispatch::EventType.
     virtual unsigned handleEvent(unsigned eventType);
 
+    //! Close the connection.
+    virtual void close();
+
+    // XmlRpcTimer interface implementation
+    //! Close the connection when the client takes too long.
+    virtual void handleTimeout();
+
+#ifdef _OPENSSL_ENABLED
+    //! Serve the connection over TLS. The handshake is performed as the
+    //! client's messages arrive, before the request is read.
+    void startSSL(void* context);
+#endif
+
   protected:
 
+    // Start the timeout for the current state.
+    void updateTimeout();
+
     bool readHeader();
     bool readRequest();
     bool writeResponse();
 
+    // Read and write the socket, through TLS if it is enabled
+    bool readSocket(std::string& s, bool* eof, int target = -1);
+    bool writeSocket(std::string const& s, int* bytesSoFar);
+
     // Parses the request, runs the method, generates the response xml.
     virtual void executeRequest();
 
     // Parse the methodName and parameters from the request.
     std::string parseRequest(XmlRpcValue& params);
 
+    // Locate the methodName in the request buffer without copying it.
+    bool parseMethodName(int* nameStart, int* nameLength, int* offset);
+
+    // Parse the parameters following the methodName.
+    void parseParams(XmlRpcValue& params, int* offset);
+
     // Execute a named method with the specified params.
     bool executeMethod(const std::string& methodName, XmlRpcValue& params, XmlRpcValue& result);
 
+    // Execute a method that has already been looked up.
+    void executeMethod(XmlRpcServerMethod* method, XmlRpcValue& params, XmlRpcValue& result);
+
     // Execute multiple calls and return the results in an array.
     bool executeMulticall(const std::string& methodName, XmlRpcValue& params, XmlRpcValue& result);
 
+    // Execute one call of a multicall, storing its result or a fault struct.
+    void executeMulticallEntry(const std::string& methodName, XmlRpcValue& params, XmlRpcValue& result);
+
     // Construct a response from the result XML.
     void generateResponse(std::string const& resultXml);
+    XmlRpcPreparedResponse::Ptr prepareResponse(std::string const& resultXml);
     void generateFaultResponse(std::string const& msg, int errorCode = -1);
-    std::string generateHeader(std::string const& body);
+    void generateMessage(std::string& body);
+    std::string generateHeader(std::string const& body,
+                               XmlRpcCompression::Encoding encoding = XmlRpcCompression::Identity);
+
+    // Compression of responses the client accepts compressed
+    XmlRpcCompression::Encoding selectEncoding(int bodyLength) const;
+    void encodePreparedResponse();
 
 
     // The XmlRpc server that accepted this connection
@@ -80,23 +126,53 @@ namespace XmlRpc {
     enum ServerConnectionState { READ_HEADER, READ_REQUEST, WRITE_RESPONSE };
     ServerConnectionState _connectionState;
 
-    // Request headers
+    // The timeout running. The idle and header timeouts run from the start of
+    // the state, the others restart whenever data is transferred.
+    enum ConnectionTimeout { NO_TIMEOUT, IDLE_TIMEOUT, HEADER_TIMEOUT, BODY_TIMEOUT, WRITE_TIMEOUT };
+    ConnectionTimeout _timeout;
+
+    // Request headers, and the parser they are fed to as they are read
     std::string _header;
+    XmlRpcHttpHeader _httpHeader;
 
     // Number of bytes expected in the request body (parsed from header)
     int _contentLength;
 
+    // Encoding of the request body, and the encoding the client prefers for the response
+    XmlRpcCompression::Encoding _requestEncoding;
+    XmlRpcCompression::Encoding _responseEncoding;
+
+    // Chunked request bodies are decoded as they are read
+    bool _chunkedRequest;
+    XmlRpcChunked _chunkDecoder;
+
     // Request body
     std::string _request;
 
     // Response
     std::string _response;
 
+    // Shared response, sent instead of _response if set
+    XmlRpcPreparedResponse::Ptr _prepared;
+
     // Number of bytes of the response written so far
     int _bytesWritten;
 
+    // Bytes of the response counted in the server's buffered output
+    int _bufferedOutput;
+
+    // Count the response in the server's buffered output, or release it
+    void bufferOutput();
+    void releaseOutput();
+
     // Whether to keep the current client connection open for further requests
     bool _keepAlive;
+
+#ifdef _OPENSSL_ENABLED
+    // TLS on the connection, if enabled, and whether its handshake has completed
+    void* _sslHandle;
+    bool _sslAccepted;
+#endif
   };
 } // namespace XmlRpc
 
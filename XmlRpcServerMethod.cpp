@@ -1,14 +1,26 @@
 
 #include "XmlRpcServerMethod.h"
 #include "XmlRpcServer.h"
+#include "XmlRpcUtil.h"
+#include "XmlRpcValue.h"
 
 namespace XmlRpc {
 
+  static const char PARAMS_TAG[] = "<params>";
+  static const char PARAMS_ETAG[] = "</params>";
+  static const char PARAM_TAG[] = "<param>";
+  static const char PARAM_ETAG[] = "</param>";
+
 
   XmlRpcServerMethod::XmlRpcServerMethod(std::string const& name, XmlRpcServer* server)
   {
     _name = name;
     _server = server;
+    _threadSafe = false;
+    _constantResult = false;
+    _responseGeneration = 0;
+    _cacheTtl = 0.0;
+    _cacheEntries = 0;
     if (_server) _server->addMethod(this);
   }
 
@@ -18,4 +30,74 @@ namespace XmlRpc {
   }
 
 
+  // Specify that the result does not depend on the parameters or the caller
+  void
+  XmlRpcServerMethod::setConstantResult(bool b /*= true*/)
+  {
+    _constantResult = b;
+    if ( ! b)
+      invalidateResponse();
+  }
+
+  // The prepared response may be invalidated from another thread while a
+  // connection is using it or building a new one.
+  XmlRpcPreparedResponse::Ptr
+  XmlRpcServerMethod::getPreparedResponse(unsigned* generation /*= 0*/)
+  {
+    std::lock_guard<std::mutex> guard(_responseLock);
+    if (generation)
+      *generation = _responseGeneration;
+    return _preparedResponse;
+  }
+
+  void
+  XmlRpcServerMethod::setPreparedResponse(XmlRpcPreparedResponse::Ptr const& response, unsigned generation)
+  {
+    std::lock_guard<std::mutex> guard(_responseLock);
+    if (generation == _responseGeneration)
+      _preparedResponse = response;
+  }
+
+  void
+  XmlRpcServerMethod::invalidateResponse()
+  {
+    std::lock_guard<std::mutex> guard(_responseLock);
+    _preparedResponse.reset();
+    ++_responseGeneration;
+  }
+
+
+  // Decode the parameters, execute the method and encode the result
+  std::string
+  XmlRpcServerMethod::executeXml(std::string const& request, int* offset)
+  {
+    XmlRpcValue params, result;
+    parseParams(request, offset, params);
+    execute(params, result);
+
+    // Ensure a valid result value
+    if ( ! result.valid())
+      result = std::string();
+
+    return result.toXml();
+  }
+
+
+  // Decode the <params> section into an array of values
+  void
+  XmlRpcServerMethod::parseParams(std::string const& xml, int* offset, XmlRpcValue& params)
+  {
+    if (XmlRpcUtil::findTag(PARAMS_TAG, xml, offset))
+    {
+      int nArgs = 0;
+      while (XmlRpcUtil::nextTagIs(PARAM_TAG, xml, offset)) {
+        params[nArgs++] = XmlRpcValue(xml, offset);
+        (void) XmlRpcUtil::nextTagIs(PARAM_ETAG, xml, offset);
+      }
+
+      (void) XmlRpcUtil::nextTagIs(PARAMS_ETAG, xml, offset);
+    }
+  }
+
+
 } // namespace XmlRpc
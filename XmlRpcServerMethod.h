@@ -10,9 +10,12 @@
 #endif
 
 #ifndef MAKEDEPEND
+# include <mutex>
 # include <string>
 #endif
 
+#include "XmlRpcPreparedResponse.h"
+
 namespace XmlRpc {
 
   // Representation of a parameter or result value
@@ -35,13 +38,67 @@ namespace XmlRpc {
     //! Execute the method. Subclasses must provide a definition for this method.
     virtual void execute(XmlRpcValue& params, XmlRpcValue& result) = 0;
 
+    //! Execute the method with its parameters still encoded in the request xml,
+    //! starting at offset, and return the xml encoded result value. The default
+    //! decodes the parameters with parseParams, calls execute() and encodes the result.
+    //! Subclasses may override this to decode the parameters into native types directly.
+    virtual std::string executeXml(std::string const& request, int* offset);
+
+    //! Decode the <params> section at offset in the xml into an array of values.
+    static void parseParams(std::string const& xml, int* offset, XmlRpcValue& params);
+
     //! Returns a help string for the method.
     //! Subclasses should define this method if introspection is being used.
     virtual std::string help() { return std::string(); }
 
+    //! Return whether execute() may be called concurrently from several threads.
+    bool isThreadSafe() const { return _threadSafe; }
+    //! Specify whether execute() may be called concurrently from several threads.
+    //! Only thread-safe methods are run in parallel within a system.multicall.
+    void setThreadSafe(bool b=true) { _threadSafe = b; }
+
+    //! Return whether the result is the same for every call.
+    bool hasConstantResult() const { return _constantResult; }
+    //! Specify that the result does not depend on the parameters or the caller.
+    //! The response serialized for one call is then sent for the following calls,
+    //! without executing the method, until invalidateResponse() is called.
+    void setConstantResult(bool b=true);
+
+    //! Return the response prepared for a method with a constant result, or null.
+    //!  @param generation If not null, receives the number of invalidations so far.
+    XmlRpcPreparedResponse::Ptr getPreparedResponse(unsigned* generation = 0);
+    //! Specify the response to send for a method with a constant result. The response
+    //! is dropped if invalidateResponse() was called since getPreparedResponse()
+    //! returned the generation, as it may have been built from outdated data.
+    void setPreparedResponse(XmlRpcPreparedResponse::Ptr const& response, unsigned generation);
+    //! Discard the prepared response, eg when the data the result is built from
+    //! has changed. The next call executes the method again. This may be called
+    //! from any thread.
+    void invalidateResponse();
+
+    //! Specify that the responses of this method may be kept in the server's
+    //! response cache (\see XmlRpcServer::enableResponseCache) and sent again
+    //! for calls with identical parameters, without executing the method.
+    //!  @param ttl Seconds a cached response stays valid, 0 to disable caching
+    //!  @param maxEntries The maximum number of parameter sets cached for this method
+    void setCacheable(double ttl, int maxEntries = 100) { _cacheTtl = ttl; _cacheEntries = maxEntries; }
+    //! Return the number of seconds responses are cached, 0 if they are not.
+    double getCacheTtl() const { return _cacheTtl; }
+    //! Return the maximum number of responses cached for this method.
+    int getCacheEntries() const { return _cacheEntries; }
+
   protected:
     std::string _name;
     XmlRpcServer* _server;
+    bool _threadSafe;
+    bool _constantResult;
+    double _cacheTtl;
+    int _cacheEntries;
+
+    // Response shared by the calls to a method with a constant result
+    XmlRpcPreparedResponse::Ptr _preparedResponse;
+    unsigned _responseGeneration;
+    std::mutex _responseLock;
   };
 } // namespace XmlRpc
 
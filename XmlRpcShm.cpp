@@ -0,0 +1,597 @@
+
+#include "XmlRpcShm.h"
+
+#if defined(__linux__)
+
+#include "XmlRpcServer.h"
+#include "XmlRpcServerConnection.h"
+#include "XmlRpcSocket.h"
+#include "XmlRpcUtil.h"
+
+#ifndef MAKEDEPEND
+# include <errno.h>
+# include <fcntl.h>
+# include <stdio.h>
+# include <string.h>
+# include <unistd.h>
+# include <sys/eventfd.h>
+# include <sys/mman.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+#endif
+
+namespace XmlRpc {
+
+
+  // Limits on the ring size a client may ask for. Both rings and their
+  // headers must fit in an int.
+  static const int MIN_RING = 4096;
+  static const int MAX_RING = 1 << 28;
+
+  // Number of descriptors passed to the server: memory, request and response doorbells
+  static const int NUM_FDS = 3;
+
+
+  int
+  XmlRpcShmRing::sizeFor(int capacity)
+  {
+    return int(sizeof(Header)) + capacity;
+  }
+
+
+  void
+  XmlRpcShmRing::attach(void* memory, int capacity, bool init)
+  {
+    _header = static_cast<Header*>(memory);
+    _data = static_cast<char*>(memory) + sizeof(Header);
+    _capacity = capacity;
+    _broken = false;
+    if (init) {
+      _header->_head.store(0, std::memory_order_relaxed);
+      _header->_tail.store(0, std::memory_order_relaxed);
+      _header->_closed.store(0, std::memory_order_release);
+    }
+  }
+
+
+  void
+  XmlRpcShmRing::copyIn(uint32_t pos, const char* data, int length)
+  {
+    int i = int(pos & uint32_t(_capacity - 1));
+    int n = (length < _capacity - i) ? length : _capacity - i;
+    memcpy(_data + i, data, n);
+    memcpy(_data, data + n, length - n);
+  }
+
+
+  void
+  XmlRpcShmRing::copyOut(uint32_t pos, char* data, int length) const
+  {
+    int i = int(pos & uint32_t(_capacity - 1));
+    int n = (length < _capacity - i) ? length : _capacity - i;
+    memcpy(data, _data + i, n);
+    memcpy(data + n, _data, length - n);
+  }
+
+
+  // Messages are stored as a 32 bit length followed by the data
+  bool
+  XmlRpcShmRing::push(const char* data, int length)
+  {
+    uint32_t head = _header->_head.load(std::memory_order_relaxed);
+    uint32_t tail = _header->_tail.load(std::memory_order_acquire);
+    uint32_t used = head - tail;
+    if (length < 0 || used > uint32_t(_capacity) ||
+        uint32_t(length) + sizeof(uint32_t) > uint32_t(_capacity) - used)
+      return false;
+
+    uint32_t n = uint32_t(length);
+    copyIn(head, reinterpret_cast<const char*>(&n), sizeof(n));
+    copyIn(head + sizeof(n), data, length);
+    _header->_head.store(head + sizeof(n) + n, std::memory_order_release);
+    return true;
+  }
+
+
+  // The other process may have written anything, so lengths are checked
+  // against the data actually available.
+  bool
+  XmlRpcShmRing::pop(std::string& out)
+  {
+    if (_broken)
+      return false;
+
+    uint32_t tail = _header->_tail.load(std::memory_order_relaxed);
+    uint32_t head = _header->_head.load(std::memory_order_acquire);
+    uint32_t available = head - tail;
+    if (available == 0)
+      return false;
+
+    uint32_t n;
+    if (available < sizeof(n) || available > uint32_t(_capacity)) {
+      _broken = true;
+      return false;
+    }
+    copyOut(tail, reinterpret_cast<char*>(&n), sizeof(n));
+    if (n > available - sizeof(n)) {
+      _broken = true;
+      return false;
+    }
+
+    out.resize(n);
+    if (n > 0)
+      copyOut(tail + sizeof(n), &out[0], int(n));
+    _header->_tail.store(tail + sizeof(n) + n, std::memory_order_release);
+    return true;
+  }
+
+
+  void
+  XmlRpcShmRing::close()
+  {
+    _header->_closed.store(1, std::memory_order_release);
+  }
+
+
+  bool
+  XmlRpcShmRing::isClosed() const
+  {
+    return _header->_closed.load(std::memory_order_acquire) != 0;
+  }
+
+
+  // Signal a doorbell
+  static void
+  ring(int bell)
+  {
+    uint64_t one = 1;
+    if (::write(bell, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      XmlRpcUtil::error("XmlRpcShm: could not signal doorbell (%s).", XmlRpcSocket::getErrorMsg().c_str());
+  }
+
+
+  // Clear a doorbell. One read resets an eventfd, but one a client created
+  // in semaphore mode only counts down, so the reads are bounded.
+  static void
+  drain(int bell)
+  {
+    uint64_t count;
+    for (int i = 0; i < 16 && ::read(bell, &count, sizeof(count)) > 0; ++i)
+      ;
+  }
+
+
+  // Returns true if a descriptor is an eventfd
+  static bool
+  isEventFd(int fd)
+  {
+    static const char EVENTFD_LINK[] = "anon_inode:[eventfd]";
+    char path[32], link[sizeof(EVENTFD_LINK)];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(path, link, sizeof(link));
+    return n == ssize_t(sizeof(EVENTFD_LINK) - 1) && memcmp(link, EVENTFD_LINK, n) == 0;
+  }
+
+
+  // Serves the rings of a single client. The source fd is the request doorbell.
+  class XmlRpcShmConnection : public XmlRpcServerConnection {
+  public:
+    XmlRpcShmConnection(int requestBell, int responseBell, void* memory, int memorySize,
+                        int ringSize, XmlRpcServer* server) :
+      XmlRpcServerConnection(requestBell, server, true),
+      _responseBell(responseBell), _memory(memory), _memorySize(memorySize)
+    {
+      int ringBytes = XmlRpcShmRing::sizeFor(ringSize);
+      _requests.attach(memory, ringSize, false);
+      _responses.attach(static_cast<char*>(memory) + ringBytes, ringSize, false);
+
+      // The connection lasts as long as the client keeps the rings open
+      server->getDispatch()->cancelTimer(this);
+    }
+
+    virtual ~XmlRpcShmConnection()
+    {
+      // Let a waiting client know there will be no response
+      _responses.close();
+      ring(_responseBell);
+      ::close(_responseBell);
+      munmap(_memory, _memorySize);
+    }
+
+    virtual unsigned handleEvent(unsigned /*eventType*/)
+    {
+      drain(getfd());
+
+      std::string request;
+      while (_requests.pop(request)) {
+        _request.swap(request);
+        executeRequest();
+
+        if ( ! pushResponse()) {
+          XmlRpcUtil::error("XmlRpcShmConnection: response does not fit in the ring.");
+          _prepared.reset();
+          generateFaultResponse("Response too large for the shared memory transport");
+          if ( ! pushResponse())
+            return 0;
+        }
+        ring(_responseBell);
+
+        _request = "";
+        _response = "";
+        _prepared.reset();
+      }
+
+      if (_requests.isBroken()) {
+        XmlRpcUtil::error("XmlRpcShmConnection: invalid data in the request ring.");
+        return 0;
+      }
+      return _requests.isClosed() ? 0 : XmlRpcDispatch::ReadableEvent;
+    }
+
+  private:
+    // Only the body is passed back, the http header is not needed
+    bool pushResponse()
+    {
+      std::string const& response = _prepared ? _prepared->getMessage() : _response;
+      size_t bodyStart = _prepared ? size_t(_prepared->getHeaderLength()) : response.find("\r\n\r\n") + 4;
+      return _responses.push(response.data() + bodyStart, int(response.length() - bodyStart));
+    }
+
+    int _responseBell;
+    void* _memory;
+    int _memorySize;
+    XmlRpcShmRing _requests;
+    XmlRpcShmRing _responses;
+  };
+
+
+  XmlRpcShmClient::XmlRpcShmClient(const char* path, int ringSize /*= 1024*1024*/) :
+    XmlRpcClient(path)
+  {
+    _ringSize = MIN_RING;
+    while (_ringSize < ringSize && _ringSize < MAX_RING)
+      _ringSize *= 2;
+    _memory = 0;
+    _memorySize = 0;
+    _requestBell = -1;
+  }
+
+
+  XmlRpcShmClient::~XmlRpcShmClient()
+  {
+    close();
+  }
+
+
+  // Create the rings and hand them to the server
+  bool
+  XmlRpcShmClient::doConnect()
+  {
+    int ringBytes = XmlRpcShmRing::sizeFor(_ringSize);
+    _memorySize = 2 * ringBytes;
+
+    int fds[NUM_FDS] = { -1, -1, -1 };
+    int s = -1;
+    bool ok = false;
+
+    do {
+      // The size is sealed, the server only maps memory that cannot shrink
+      fds[0] = memfd_create("xmlrpc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+      if (fds[0] < 0 || ftruncate(fds[0], _memorySize) != 0 ||
+          fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+        break;
+
+      _memory = mmap(0, _memorySize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+      if (_memory == MAP_FAILED) {
+        _memory = 0;
+        break;
+      }
+      _requests.attach(_memory, _ringSize, true);
+      _responses.attach(static_cast<char*>(_memory) + ringBytes, _ringSize, true);
+
+      fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (fds[1] < 0 || fds[2] < 0)
+        break;
+
+      s = XmlRpcSocket::socketUnix();
+      if (s < 0 || ! XmlRpcSocket::connectUnix(s, _path))
+        break;
+
+      // The ring size is sent along with the descriptors
+      uint32_t ringSize = uint32_t(_ringSize);
+      struct iovec iov = { &ringSize, sizeof(ringSize) };
+      char control[CMSG_SPACE(sizeof(fds))];
+      memset(control, 0, sizeof(control));
+
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+      memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+      ok = (sendmsg(s, &msg, MSG_NOSIGNAL) == ssize_t(sizeof(ringSize)));
+    } while (false);
+
+    if ( ! ok)
+      XmlRpcUtil::error("Error in XmlRpcShmClient::doConnect: Could not connect to server (%s).", XmlRpcSocket::getErrorMsg().c_str());
+
+    // The server holds its own references now
+    if (s >= 0) ::close(s);
+    if (fds[0] >= 0) ::close(fds[0]);
+    if (fds[1] >= 0) {
+      if (ok) _requestBell = fds[1];
+      else ::close(fds[1]);
+    }
+    if (fds[2] >= 0) {
+      if (ok) setfd(fds[2]);
+      else ::close(fds[2]);
+    }
+    if ( ! ok && _memory) {
+      munmap(_memory, _memorySize);
+      _memory = 0;
+    }
+
+    XmlRpcUtil::log(3, "XmlRpcShmClient::doConnect: %s, rings of %d bytes.", ok ? "connected" : "failed", _ringSize);
+    return ok;
+  }
+
+
+  // Compressed requests would not be recognized without an http header
+  bool
+  XmlRpcShmClient::generateRequest(const char* method, XmlRpcValue const& params)
+  {
+    int threshold = _compressionThreshold;
+    _compressionThreshold = -1;
+    bool ok = XmlRpcClient::generateRequest(method, params);
+    _compressionThreshold = threshold;
+    return ok;
+  }
+
+
+  // Only the request body is passed to the server
+  std::string
+  XmlRpcShmClient::generateHeader(std::string const& /*body*/, XmlRpcCompression::Encoding /*encoding*/)
+  {
+    return std::string();
+  }
+
+
+  bool
+  XmlRpcShmClient::writeRequest()
+  {
+    if ( ! _requests.push(_request.data(), int(_request.length()))) {
+      XmlRpcUtil::error("Error in XmlRpcShmClient::writeRequest: request of %d bytes does not fit in the ring.",
+                        int(_request.length()));
+      return false;
+    }
+    ring(_requestBell);
+
+    _response = "";
+    _connectionState = READ_RESPONSE;
+    return true;
+  }
+
+
+  bool
+  XmlRpcShmClient::readResponse()
+  {
+    drain(getfd());
+
+    if ( ! _responses.pop(_response)) {
+      if (_responses.isBroken()) {
+        XmlRpcUtil::error("Error in XmlRpcShmClient::readResponse: invalid data in the response ring.");
+        return false;
+      }
+      if (_responses.isClosed()) {
+        XmlRpcUtil::error("Error in XmlRpcShmClient::readResponse: server closed the connection.");
+        return false;
+      }
+      return true;    // Keep waiting
+    }
+
+    XmlRpcUtil::log(3, "XmlRpcShmClient::readResponse (read %d bytes)", _response.length());
+    _connectionState = IDLE;
+    return false;     // Stop monitoring this source (causes return from work)
+  }
+
+
+  void
+  XmlRpcShmClient::close()
+  {
+    // Let the server release its end
+    if (_memory) {
+      _requests.close();
+      ring(_requestBell);
+    }
+
+    XmlRpcClient::close();
+
+    if (_requestBell >= 0) {
+      ::close(_requestBell);
+      _requestBell = -1;
+    }
+    if (_memory) {
+      munmap(_memory, _memorySize);
+      _memory = 0;
+    }
+  }
+
+
+  XmlRpcShmListener::XmlRpcShmListener(XmlRpcServer* server) :
+    _server(server), _inode(0)
+  {
+  }
+
+
+  XmlRpcShmListener::~XmlRpcShmListener()
+  {
+    close();
+  }
+
+
+  bool
+  XmlRpcShmListener::bindAndListen(const char* path, int backlog)
+  {
+    int fd = XmlRpcSocket::socketUnix();
+    if (fd < 0) {
+      XmlRpcUtil::error("XmlRpcShmListener::bindAndListen: Could not create socket (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      return false;
+    }
+    setfd(fd);
+
+    if ( ! XmlRpcSocket::setNonBlocking(fd) || ! XmlRpcSocket::bindUnix(fd, path, &_inode)) {
+      XmlRpcUtil::error("XmlRpcShmListener::bindAndListen: Could not bind to specified path (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      close();
+      return false;
+    }
+    _path = path;
+
+    if ( ! XmlRpcSocket::listen(fd, backlog)) {
+      XmlRpcUtil::error("XmlRpcShmListener::bindAndListen: Could not set socket in listening mode (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      close();
+      return false;
+    }
+
+    XmlRpcUtil::log(2, "XmlRpcShmListener::bindAndListen: listening on %s fd %d", path, fd);
+    return true;
+  }
+
+
+  void
+  XmlRpcShmListener::close()
+  {
+    XmlRpcSource::close();
+    if ( ! _path.empty()) {
+      XmlRpcSocket::removeUnix(_path.c_str(), _inode);
+      _path.clear();
+    }
+  }
+
+
+  // Receives the mapping and doorbells a client sends on its socket once it
+  // is readable, then serves the client's rings. Clients that do not send
+  // them within the header timeout are dropped.
+  class XmlRpcShmHandshake : public XmlRpcSource, public XmlRpcTimer {
+  public:
+    XmlRpcShmHandshake(int fd, XmlRpcServer* server) :
+      XmlRpcSource(fd, true), _server(server)
+    {
+      if (server->getHeaderTimeout() > 0.0)
+        server->getDispatch()->armTimer(this, server->getHeaderTimeout());
+    }
+
+    virtual unsigned handleEvent(unsigned /*eventType*/)
+    {
+      uint32_t ringSize = 0;
+      struct iovec iov = { &ringSize, sizeof(ringSize) };
+      int fds[NUM_FDS] = { -1, -1, -1 };
+
+      // Room for one descriptor more than expected, so extras are noticed
+      char control[CMSG_SPACE(sizeof(int) * (NUM_FDS + 1))];
+
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+
+      ssize_t n = recvmsg(getfd(), &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+      if (n < 0 && XmlRpcSocket::nonFatalError())
+        return XmlRpcDispatch::ReadableEvent;   // Wait for the message
+
+      // Every descriptor received is either kept or closed
+      int nfds = 0;
+      struct cmsghdr* cmsg = (n >= 0) ? CMSG_FIRSTHDR(&msg) : 0;
+      for ( ; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+        int count = int((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < count; ++i, ++nfds) {
+          int fd;
+          memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+          if (nfds < NUM_FDS)
+            fds[nfds] = fd;
+          else
+            ::close(fd);
+        }
+      }
+
+      // Check what the client sent before trusting it: exactly the memory
+      // and two eventfd doorbells
+      bool ok = (n == ssize_t(sizeof(ringSize)) && nfds == NUM_FDS && ! (msg.msg_flags & MSG_CTRUNC) &&
+                 ringSize >= uint32_t(MIN_RING) && ringSize <= uint32_t(MAX_RING) &&
+                 (ringSize & (ringSize - 1)) == 0 &&
+                 isEventFd(fds[1]) && isEventFd(fds[2]));
+
+      // The mapping must be sealed against shrinking, or the client could
+      // truncate it under the server
+      int memorySize = ok ? 2 * XmlRpcShmRing::sizeFor(int(ringSize)) : 0;
+      int seals = ok ? fcntl(fds[0], F_GET_SEALS) : -1;
+      struct stat st;
+      ok = ok && seals >= 0 && (seals & F_SEAL_SHRINK) &&
+           fstat(fds[0], &st) == 0 && st.st_size >= memorySize;
+
+      void* memory = ok ? mmap(0, memorySize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0) : MAP_FAILED;
+      if (fds[0] >= 0)
+        ::close(fds[0]);
+
+      if (memory == MAP_FAILED || ! XmlRpcSocket::setNonBlocking(fds[1]) ||
+          ! XmlRpcSocket::setNonBlocking(fds[2])) {
+        XmlRpcUtil::error("XmlRpcShmHandshake::handleEvent: invalid connection request from client.");
+        if (memory != MAP_FAILED) munmap(memory, memorySize);
+        if (fds[1] >= 0) ::close(fds[1]);
+        if (fds[2] >= 0) ::close(fds[2]);
+        return 0;
+      }
+
+      XmlRpcUtil::log(2, "XmlRpcShmHandshake::handleEvent: client connected, rings of %d bytes.", int(ringSize));
+      XmlRpcShmConnection* connection =
+        new XmlRpcShmConnection(fds[1], fds[2], memory, memorySize, int(ringSize), _server);
+      _server->addConnection(connection);
+
+      return 0;     // The socket is no longer needed
+    }
+
+    virtual void handleTimeout()
+    {
+      XmlRpcUtil::log(2, "XmlRpcShmHandshake::handleTimeout: no descriptors received on socket %d, closing.", getfd());
+      _server->getDispatch()->removeSource(this);
+      close();
+    }
+
+  private:
+    XmlRpcServer* _server;
+  };
+
+
+  // Accept a client, its descriptors are received when they arrive
+  unsigned
+  XmlRpcShmListener::handleEvent(unsigned /*eventType*/)
+  {
+    int s = XmlRpcSocket::accept(getfd());
+    if (s < 0) {
+      XmlRpcUtil::error("XmlRpcShmListener::handleEvent: Could not accept connection (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      return XmlRpcDispatch::ReadableEvent;
+    }
+    if ( ! XmlRpcSocket::setNonBlocking(s)) {
+      XmlRpcUtil::error("XmlRpcShmListener::handleEvent: Could not set socket to non-blocking input mode (%s).", XmlRpcSocket::getErrorMsg().c_str());
+      ::close(s);
+      return XmlRpcDispatch::ReadableEvent;
+    }
+
+    _server->getDispatch()->addSource(new XmlRpcShmHandshake(s, _server), XmlRpcDispatch::ReadableEvent);
+    return XmlRpcDispatch::ReadableEvent;   // Continue to monitor this fd
+  }
+
+} // namespace XmlRpc
+
+#endif // __linux__
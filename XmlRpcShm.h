@@ -0,0 +1,154 @@
+
+#ifndef _XMLRPCSHM_H_
+#define _XMLRPCSHM_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+// XmlRpc++ Copyright (c) 2016 by Philip Meulengracht
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+// The shared memory transport relies on memfd, eventfd and descriptor
+// passing over Unix domain sockets, so it is only available on Linux.
+#if defined(__linux__)
+
+#ifndef MAKEDEPEND
+# include <atomic>
+# include <stdint.h>
+# include <string>
+#endif
+
+#include "XmlRpcClient.h"
+#include "XmlRpcSource.h"
+
+namespace XmlRpc {
+
+  class XmlRpcServer;
+
+  //! A single producer, single consumer ring of messages in shared memory.
+  //! The producer and consumer may be in different processes.
+  class XmlRpcShmRing {
+  public:
+    //! Return the number of bytes of memory needed for a ring.
+    //!  @param capacity Bytes of message data, a power of 2
+    static int sizeFor(int capacity);
+
+    //! Constructor
+    XmlRpcShmRing() : _header(0), _data(0), _capacity(0), _broken(false) {}
+
+    //! Use a ring in shared memory.
+    //!  @param memory   At least sizeFor(capacity) bytes
+    //!  @param capacity Bytes of message data, a power of 2
+    //!  @param init     True to create an empty ring, false to use an existing one
+    void attach(void* memory, int capacity, bool init);
+
+    //! Append a message. Returns false if there is not enough free space.
+    bool push(const char* data, int length);
+
+    //! Remove the oldest message into out. Returns false if the ring is empty,
+    //! or if it holds invalid data (@see isBroken).
+    bool pop(std::string& out);
+
+    //! Mark the ring closed, the producer will not push any more messages.
+    void close();
+
+    //! Returns true if the producer closed the ring.
+    bool isClosed() const;
+
+    //! Returns true if the ring was found to hold invalid data.
+    bool isBroken() const { return _broken; }
+
+    //! Return the largest message that fits in the ring.
+    int maxMessage() const { return _capacity - int(sizeof(uint32_t)); }
+
+  private:
+    // Shared state. The positions count bytes from the creation of the ring,
+    // wrapping at 2^32, and are kept on separate cache lines.
+    struct Header {
+      alignas(64) std::atomic<uint32_t> _head;   // written by the producer
+      alignas(64) std::atomic<uint32_t> _tail;   // written by the consumer
+      alignas(64) std::atomic<uint32_t> _closed;
+    };
+
+    void copyIn(uint32_t pos, const char* data, int length);
+    void copyOut(uint32_t pos, char* data, int length) const;
+
+    Header* _header;
+    char* _data;
+    int _capacity;
+    bool _broken;
+  };
+
+
+  //! A client calling a server on the same host through shared memory. Requests
+  //! and responses are passed through a pair of rings in a memory mapping shared
+  //! with the server, and eventfd doorbells signal their arrival. The mapping
+  //! and the doorbells are handed to the server over its Unix domain socket
+  //! (@see XmlRpcServer::bindSharedMemory) when the client connects.
+  //!
+  //! Requests and responses must fit in the rings. Compression is not used.
+  class XmlRpcShmClient : public XmlRpcClient {
+  public:
+    //! Construct a client to connect to a server's shared memory socket
+    //!  @param path     The path of the server's socket
+    //!  @param ringSize Bytes in each ring, rounded up to a power of 2
+    XmlRpcShmClient(const char* path, int ringSize = 1024*1024);
+
+    //! Destructor
+    virtual ~XmlRpcShmClient();
+
+    //! Close the connection
+    virtual void close();
+
+  protected:
+    virtual bool doConnect();
+    virtual bool generateRequest(const char* method, XmlRpcValue const& params);
+    virtual std::string generateHeader(std::string const& body,
+                                       XmlRpcCompression::Encoding encoding = XmlRpcCompression::Identity);
+    virtual bool writeRequest();
+    virtual bool readResponse();
+
+    int _ringSize;
+
+    // Shared mapping of the request and response rings
+    void* _memory;
+    int _memorySize;
+    XmlRpcShmRing _requests;
+    XmlRpcShmRing _responses;
+
+    // Doorbell rung for each request. The response doorbell is the source fd.
+    int _requestBell;
+  };
+
+
+  //! Accepts clients of the shared memory transport on a Unix domain socket.
+  //! Created by XmlRpcServer::bindSharedMemory.
+  class XmlRpcShmListener : public XmlRpcSource {
+  public:
+    //! Constructor
+    XmlRpcShmListener(XmlRpcServer* server);
+
+    //! Destructor
+    virtual ~XmlRpcShmListener();
+
+    //! Create the socket and listen on the path.
+    bool bindAndListen(const char* path, int backlog);
+
+    //! Close the socket and remove its path.
+    virtual void close();
+
+    //! Accept a client and start serving its rings.
+    virtual unsigned handleEvent(unsigned eventType);
+
+  private:
+    XmlRpcServer* _server;
+    std::string _path;
+    unsigned long long _inode;
+  };
+
+} // namespace XmlRpc
+
+#endif // __linux__
+
+#endif // _XMLRPCSHM_H_
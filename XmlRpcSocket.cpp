@@ -1,5 +1,7 @@
 
 #include "XmlRpcSocket.h"
+#include "XmlRpcDispatch.h"
+#include "XmlRpcThreadPool.h"
 #include "XmlRpcUtil.h"
 #include <QtCore>
 
@@ -8,6 +10,7 @@
 #if defined(_WIN32)
 # include <stdio.h>
 # include <winsock2.h>
+# include <ws2tcpip.h>
 //# pragma lib(WS2_32.lib)
 
 #ifdef EINPROGRESS
@@ -28,13 +31,29 @@ extern "C" {
 # include <stdio.h>
 # include <sys/types.h>
 # include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+# include <sys/select.h>
+# include <poll.h>
 # include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <arpa/inet.h>
 # include <netdb.h>
 # include <errno.h>
 # include <fcntl.h>
 }
+# if defined(__linux__)
+#  include <sys/eventfd.h>
+# endif
 #endif  // _WIN32
 
+# include <math.h>
+# include <atomic>
+# include <chrono>
+# include <map>
+# include <memory>
+# include <mutex>
+# include <vector>
 #endif // MAKEDEPEND
 
 
@@ -69,8 +88,8 @@ static void initWinSock()
 
 
 // These errors are not considered fatal for an IO operation; the operation will be re-tried.
-static inline bool
-nonFatalError()
+bool
+XmlRpcSocket::nonFatalError()
 {
   int err = XmlRpcSocket::getError();
   return (err == EINPROGRESS || err == EAGAIN || err == EWOULDBLOCK || err == EINTR);
@@ -86,6 +105,17 @@ XmlRpcSocket::socket()
 }
 
 
+int
+XmlRpcSocket::socketDualStack()
+{
+  initWinSock();
+  int fd = (int) ::socket(AF_INET6, SOCK_STREAM, 0);
+  if (fd < 0)
+    fd = (int) ::socket(AF_INET, SOCK_STREAM, 0);
+  return fd;
+}
+
+
 void
 XmlRpcSocket::close(int fd)
 {
@@ -121,10 +151,99 @@ XmlRpcSocket::setReuseAddr(int fd)
 }
 
 
+// Returns true if a socket is a TCP socket
+static bool
+isTcp(int fd)
+{
+  struct sockaddr_storage local;
+#if defined(_WIN32)
+  int
+#else
+  socklen_t
+#endif
+    locallen = sizeof(local);
+  return getsockname(fd, (struct sockaddr*)&local, &locallen) == 0 &&
+         (local.ss_family == AF_INET || local.ss_family == AF_INET6);
+}
+
+
+bool
+XmlRpcSocket::setOptions(int fd, XmlRpcSocketOptions const& options)
+{
+  if (options.sendBuffer > 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const char *)&options.sendBuffer, sizeof(options.sendBuffer)) != 0)
+    return false;
+
+  if (options.receiveBuffer > 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char *)&options.receiveBuffer, sizeof(options.receiveBuffer)) != 0)
+    return false;
+
+  if (options.noDelay && isTcp(fd)) {
+    int flag = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag, sizeof(flag)) != 0)
+      return false;
+  }
+  return true;
+}
+
+
+bool
+XmlRpcSocket::setListenOptions(int fd, XmlRpcSocketOptions const& options)
+{
+#if defined(TCP_FASTOPEN)
+  if (options.fastOpen > 0 &&
+      setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (const char *)&options.fastOpen, sizeof(options.fastOpen)) != 0)
+    return false;
+#endif
+
+#if defined(TCP_DEFER_ACCEPT)
+  if (options.deferAccept > 0 &&
+      setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char *)&options.deferAccept, sizeof(options.deferAccept)) != 0)
+    return false;
+#endif
+
+  return true;
+}
+
+
+void
+XmlRpcSocket::setCork(int fd, bool cork)
+{
+#if defined(TCP_CORK)
+  int flag = cork ? 1 : 0;
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, (const char *)&flag, sizeof(flag));
+#else
+  (void) fd;
+  (void) cork;
+#endif
+}
+
+
 // Bind to a specified port
 bool 
 XmlRpcSocket::bind(int fd, int port)
 {
+  struct sockaddr_storage local;
+#if defined(_WIN32)
+  int
+#else
+  socklen_t
+#endif
+    locallen = sizeof(local);
+
+  if (getsockname(fd, (struct sockaddr*)&local, &locallen) == 0 && local.ss_family == AF_INET6) {
+    // Accept IPv4 connections too, as IPv4-mapped addresses
+    int v6only = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&v6only, sizeof(v6only));
+
+    struct sockaddr_in6 saddr6;
+    memset(&saddr6, 0, sizeof(saddr6));
+    saddr6.sin6_family = AF_INET6;
+    saddr6.sin6_addr = in6addr_any;
+    saddr6.sin6_port = htons((u_short) port);
+    return (::bind(fd, (struct sockaddr *)&saddr6, sizeof(saddr6)) == 0);
+  }
+
   struct sockaddr_in saddr;
   memset(&saddr, 0, sizeof(saddr));
   saddr.sin_family = AF_INET;
@@ -145,7 +264,7 @@ XmlRpcSocket::listen(int fd, int backlog)
 int
 XmlRpcSocket::accept(int fd)
 {
-  struct sockaddr_in addr;
+  struct sockaddr_storage addr;
 #if defined(_WIN32)
   int
 #else
@@ -156,72 +275,1054 @@ XmlRpcSocket::accept(int fd)
   return (int) ::accept(fd, (struct sockaddr*)&addr, &addrlen);
 }
 
+
+int
+XmlRpcSocket::acceptNonBlocking(int fd)
+{
+  struct sockaddr_storage addr;
+#if defined(_WIN32)
+  int
+#else
+  socklen_t
+#endif
+    addrlen = sizeof(addr);
+
+#if defined(__linux__)
+  // One call instead of three
+  return ::accept4(fd, (struct sockaddr*)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int s = (int) ::accept(fd, (struct sockaddr*)&addr, &addrlen);
+  if (s < 0)
+    return -1;
+
+# if !defined(_WIN32)
+  fcntl(s, F_SETFD, FD_CLOEXEC);
+# endif
+  if ( ! setNonBlocking(s)) {
+    close(s);
+    return -1;
+  }
+  return s;
+#endif
+}
+
+// A resolved address
+struct ResolvedAddress {
+  struct sockaddr_storage _addr;
+  int _length;
+};
+typedef std::vector<ResolvedAddress> AddressList;
+
+// Resolved addresses are cached by host and port
+struct ResolverEntry {
+  AddressList _addresses;
+  std::chrono::steady_clock::time_point _expires;
+};
+typedef std::map<std::string, ResolverEntry> ResolverCache;
+
+static std::mutex resolverLock;
+static ResolverCache resolverCache;
+static double resolverCacheTtl = 60.0;
+
+
+void
+XmlRpcSocket::setResolverCacheTtl(double seconds)
+{
+  std::lock_guard<std::mutex> lock(resolverLock);
+  resolverCacheTtl = seconds;
+  if (seconds <= 0.0)
+    resolverCache.clear();
+}
+
+
+void
+XmlRpcSocket::clearResolverCache()
+{
+  std::lock_guard<std::mutex> lock(resolverLock);
+  resolverCache.clear();
+}
+
+
+// Resolve a host's addresses, IPv6 and IPv4 interleaved as RFC 8305 suggests.
+// With numeric, only cached hosts and address literals are resolved, which
+// does not block; other hosts fail quietly.
+static bool
+resolve(std::string const& host, int port, AddressList& addresses, bool numeric = false)
+{
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  std::string key = host + ":" + service;
+
+  {
+    std::lock_guard<std::mutex> lock(resolverLock);
+    ResolverCache::iterator i = resolverCache.find(key);
+    if (i != resolverCache.end()) {
+      if (std::chrono::steady_clock::now() < i->second._expires) {
+        addresses = i->second._addresses;
+        return true;
+      }
+      resolverCache.erase(i);
+    }
+  }
+
+  initWinSock();
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG | (numeric ? AI_NUMERICHOST : 0);
+
+  struct addrinfo* result = 0;
+  int rc = getaddrinfo(host.c_str(), service, &hints, &result);
+  if (rc != 0) {
+    if (numeric)
+      return false;
+    XmlRpcUtil::error("XmlRpcSocket::resolve: could not resolve %s (%s).", host.c_str(), gai_strerror(rc));
+    return false;
+  }
+
+  bool v6Preferred = (result->ai_family == AF_INET6);
+  AddressList v6, v4;
+  for (struct addrinfo* ai = result; ai != 0; ai = ai->ai_next) {
+    if (ai->ai_family != AF_INET6 && ai->ai_family != AF_INET)
+      continue;
+    ResolvedAddress a;
+    memset(&a, 0, sizeof(a));
+    memcpy(&a._addr, ai->ai_addr, ai->ai_addrlen);
+    a._length = int(ai->ai_addrlen);
+    (ai->ai_family == AF_INET6 ? v6 : v4).push_back(a);
+  }
+  freeaddrinfo(result);
+
+  // Start with the family getaddrinfo preferred
+  bool v6First = ! v6.empty() && (v4.empty() || v6Preferred);
+  AddressList& first = v6First ? v6 : v4;
+  AddressList& second = v6First ? v4 : v6;
+  addresses.clear();
+  for (size_t i = 0; i < first.size() || i < second.size(); ++i) {
+    if (i < first.size()) addresses.push_back(first[i]);
+    if (i < second.size()) addresses.push_back(second[i]);
+  }
+  if (addresses.empty())
+    return false;
+
+  std::lock_guard<std::mutex> lock(resolverLock);
+  if (resolverCacheTtl > 0.0) {
+    ResolverEntry& entry = resolverCache[key];
+    entry._addresses = addresses;
+    entry._expires = std::chrono::steady_clock::now() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(resolverCacheTtl));
+  }
+  return true;
+}
+
+
 // Connect a socket to a server (from a client)
 bool
 XmlRpcSocket::connect(int fd, std::string& host, int port)
 {
-  struct sockaddr_in saddr;
-  memset(&saddr, 0, sizeof(saddr));
-  saddr.sin_family = AF_INET;
+  struct sockaddr_storage local;
+#if defined(_WIN32)
+  int
+#else
+  socklen_t
+#endif
+    locallen = sizeof(local);
+  if (getsockname(fd, (struct sockaddr*)&local, &locallen) != 0)
+    local.ss_family = AF_INET;
 
-  struct hostent *hp = gethostbyname(host.c_str());
-  if (hp == 0) return false;
+  AddressList addresses;
+  if ( ! resolve(host, port, addresses))
+    return false;
+
+  // Use the first address of the socket's family
+  for (size_t i = 0; i < addresses.size(); ++i) {
+    if (addresses[i]._addr.ss_family != local.ss_family)
+      continue;
+
+    // For asynch operation, this will return EWOULDBLOCK (windows) or
+    // EINPROGRESS (linux) and we just need to wait for the socket to be writable...
+    int result = ::connect(fd, (struct sockaddr *)&addresses[i]._addr, addresses[i]._length);
+    return result == 0 || nonFatalError();
+  }
+  return false;
+}
+
+
+// Set a socket back to blocking IO
+static bool
+setBlocking(int fd)
+{
+#if defined(_WIN32)
+  unsigned long flag = 0;
+  return (ioctlsocket((SOCKET)fd, FIONBIO, &flag) == 0);
+#else
+  return (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) == 0);
+#endif // _WIN32
+}
+
+
+// Start a non-blocking connection attempt. Returns the socket, or -1 if it failed.
+static int
+startConnect(ResolvedAddress const& address, XmlRpcSocketOptions const& options, bool* connected)
+{
+  int fd = (int) ::socket(address._addr.ss_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  // Buffer sizes must be set before connecting for the window scale to match
+  if ( ! XmlRpcSocket::setNonBlocking(fd) || ! XmlRpcSocket::setOptions(fd, options)) {
+    XmlRpcSocket::close(fd);
+    return -1;
+  }
+
+#if defined(TCP_FASTOPEN_CONNECT)
+  // The SYN is sent along with the first write
+  if (options.fastOpen) {
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (const char *)&flag, sizeof(flag));
+  }
+#endif
+
+  int result = ::connect(fd, (struct sockaddr *)&address._addr, address._length);
+  *connected = (result == 0);
+  if (result != 0 && ! XmlRpcSocket::nonFatalError()) {
+    XmlRpcSocket::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+// Return the outcome of a non-blocking connect, 0 if it succeeded
+static int
+connectError(int fd)
+{
+  int error = 0;
+#if defined(_WIN32)
+  int
+#else
+  socklen_t
+#endif
+    errlen = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&error, &errlen) != 0)
+    return -1;
+  return error;
+}
+
+
+// Wait for sockets to become writable, or until ms milliseconds have passed (-1 for no limit)
+static int
+pollWritable(std::vector<int> const& fds, int ms, std::vector<struct pollfd>& pfds)
+{
+  pfds.resize(fds.size());
+  for (size_t i = 0; i < fds.size(); ++i) {
+    pfds[i].fd = fds[i];
+    pfds[i].events = POLLOUT;
+    pfds[i].revents = 0;
+  }
+#if defined(_WIN32)
+  return WSAPoll(pfds.empty() ? 0 : &pfds[0], ULONG(pfds.size()), ms);
+#else
+  return poll(pfds.empty() ? 0 : &pfds[0], nfds_t(pfds.size()), ms);
+#endif
+}
+
+
+// Make an error the last error, as getError returns it
+static void
+setError(int error)
+{
+#if defined(_WIN32)
+  WSASetLastError(error);
+#else
+  errno = error;
+#endif
+}
+
+
+// Delay before the next address is tried (RFC 8305 recommends 250ms)
+static const std::chrono::milliseconds ATTEMPT_DELAY(250);
+
+// A host resolved on a worker thread. The worker signals the descriptor once
+// the addresses are known; it is closed when neither the race nor the worker
+// needs it any longer.
+struct HostLookup {
+  HostLookup() : _done(false), _readFd(-1), _writeFd(-1) {}
+  ~HostLookup()
+  {
+#if !defined(_WIN32)
+    if (_readFd >= 0)
+      ::close(_readFd);
+    if (_writeFd >= 0 && _writeFd != _readFd)
+      ::close(_writeFd);
+#endif
+  }
+
+  std::mutex _lock;
+  bool _done;
+  AddressList _list;
+  int _readFd;
+  int _writeFd;
+};
+
+
+#if !defined(_WIN32)
+// Open the descriptor a lookup signals
+static bool
+openLookup(HostLookup& lookup)
+{
+# if defined(__linux__)
+  lookup._readFd = lookup._writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return lookup._readFd >= 0;
+# else
+  int fds[2];
+  if (pipe(fds) != 0)
+    return false;
+  for (int i = 0; i < 2; ++i) {
+    fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  lookup._readFd = fds[0];
+  lookup._writeFd = fds[1];
+  return true;
+# endif
+}
+
+
+// Workers resolving hosts for the races. The pool is never destroyed, so that
+// exiting does not wait for a lookup that is still in progress.
+static XmlRpcThreadPool&
+resolverPool()
+{
+  static XmlRpcThreadPool* pool = new XmlRpcThreadPool(4);
+  return *pool;
+}
+#endif // _WIN32
+
+
+struct XmlRpcConnectRace::Addresses {
+  AddressList _list;
+  std::chrono::steady_clock::time_point _nextStart;
+  std::shared_ptr<HostLookup> _lookup;
+};
+
+
+XmlRpcConnectRace::XmlRpcConnectRace() :
+  _addresses(new Addresses), _next(0)
+{
+}
+
+
+XmlRpcConnectRace::~XmlRpcConnectRace()
+{
+  cancel();
+  delete _addresses;
+}
+
+
+bool
+XmlRpcConnectRace::start(std::string const& host, int port, XmlRpcSocketOptions const& options,
+                         bool background /*= false*/)
+{
+  cancel();
+  _addresses->_list.clear();
+  _next = 0;
+  _options = options;
+  _addresses->_nextStart = std::chrono::steady_clock::now();
+
+#if !defined(_WIN32)
+  if (background && ! resolve(host, port, _addresses->_list, true)) {
+    std::shared_ptr<HostLookup> lookup = std::make_shared<HostLookup>();
+    if (openLookup(*lookup)) {
+      _addresses->_lookup = lookup;
+      resolverPool().post([lookup, host, port]() {
+        AddressList list;
+        resolve(host, port, list);
+        std::lock_guard<std::mutex> guard(lookup->_lock);
+        lookup->_list.swap(list);
+        lookup->_done = true;
+# if defined(__linux__)
+        uint64_t one = 1;
+# else
+        char one = 1;
+# endif
+        if (::write(lookup->_writeFd, &one, sizeof(one)) < 0)
+          XmlRpcUtil::error("XmlRpcConnectRace: could not signal lookup (%d).", errno);
+      });
+      return true;
+    }
+  }
+#endif
+  return ! _addresses->_list.empty() || resolve(host, port, _addresses->_list);
+}
+
+
+int
+XmlRpcConnectRace::getResolverFd() const
+{
+  return _addresses->_lookup ? _addresses->_lookup->_readFd : -1;
+}
+
+
+int
+XmlRpcConnectRace::check()
+{
+  int winner = -1;
+
+  // Take the addresses once the worker has resolved the host
+  if (_addresses->_lookup) {
+    std::lock_guard<std::mutex> guard(_addresses->_lookup->_lock);
+    if ( ! _addresses->_lookup->_done)
+      return -1;
+    _addresses->_list.swap(_addresses->_lookup->_list);
+  }
+  _addresses->_lookup.reset();
+
+  // Collect the attempts that completed
+  std::vector<struct pollfd> pfds;
+  if ( ! _pending.empty() && pollWritable(_pending, 0, pfds) > 0) {
+    std::vector<int> pending;
+    for (size_t i = 0; i < pfds.size(); ++i) {
+      int fd = _pending[i];
+      if ( ! pfds[i].revents)
+        pending.push_back(fd);
+      else {
+        int error = connectError(fd);
+        if (winner < 0 && error == 0)
+          winner = fd;
+        else
+          XmlRpcSocket::close(fd);
+        if (error > 0)
+          setError(error);    // Reported if every attempt fails
+      }
+    }
+    _pending.swap(pending);
+  }
+
+  // Start the next attempt when the delay has passed, or when the others have failed
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  while (winner < 0 && _next < _addresses->_list.size() &&
+         (_pending.empty() || now >= _addresses->_nextStart)) {
+    bool connected = false;
+    int fd = startConnect(_addresses->_list[_next++], _options, &connected);
+    if (fd >= 0 && connected)
+      winner = fd;
+    else if (fd >= 0) {
+      _pending.push_back(fd);
+      _addresses->_nextStart = now + ATTEMPT_DELAY;
+    }
+  }
+
+  // Abandon the attempts that lost the race
+  if (winner >= 0)
+    cancel();
+  return winner;
+}
 
-  saddr.sin_family = hp->h_addrtype;
-  memcpy(&saddr.sin_addr, hp->h_addr, hp->h_length);
-  saddr.sin_port = htons((u_short) port);
 
-  // For asynch operation, this will return EWOULDBLOCK (windows) or
-  // EINPROGRESS (linux) and we just need to wait for the socket to be writable...
+bool
+XmlRpcConnectRace::isFailed() const
+{
+  return ! _addresses->_lookup && _pending.empty() && _next >= _addresses->_list.size();
+}
+
+
+double
+XmlRpcConnectRace::getDelay() const
+{
+  if (_addresses->_lookup || _next >= _addresses->_list.size())
+    return -1.0;
+  if (_pending.empty())
+    return 0.0;
+  double seconds = std::chrono::duration<double>(_addresses->_nextStart - std::chrono::steady_clock::now()).count();
+  return (seconds > 0.0) ? seconds : 0.0;
+}
+
+
+int
+XmlRpcConnectRace::wait(double timeout)
+{
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+
+  for (;;) {
+    int fd = check();
+    if (fd >= 0 || isFailed())
+      return fd;
+
+    // Wait for an attempt to complete, or until the next one is due
+    double waitTime = getDelay();
+    if (timeout > 0.0) {
+      double remaining = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count();
+      if (remaining <= 0.0) {
+        cancel();
+        return -1;
+      }
+      if (waitTime < 0.0 || remaining < waitTime)
+        waitTime = remaining;
+    }
+
+    // A host still being resolved is waited for first, it has no attempts yet
+    std::vector<struct pollfd> pfds;
+    int ms = (waitTime < 0.0) ? -1 : int(ceil(waitTime * 1000.0));
+#if !defined(_WIN32)
+    if (_addresses->_lookup) {
+      pfds.resize(1);
+      pfds[0].fd = _addresses->_lookup->_readFd;
+      pfds[0].events = POLLIN;
+      pfds[0].revents = 0;
+      if (poll(&pfds[0], 1, ms) < 0 && ! XmlRpcSocket::nonFatalError()) {
+        cancel();
+        return -1;
+      }
+    }
+    else
+#endif
+    if (pollWritable(_pending, ms, pfds) < 0 && ! XmlRpcSocket::nonFatalError()) {
+      cancel();
+      return -1;
+    }
+  }
+}
+
+
+void
+XmlRpcConnectRace::cancel()
+{
+  for (size_t i = 0; i < _pending.size(); ++i)
+    XmlRpcSocket::close(_pending[i]);
+  _pending.clear();
+  _addresses->_lookup.reset();      // The worker finishes on its own
+  _next = _addresses->_list.size();
+}
+
+
+// Create a socket and connect it, racing the host's addresses
+int
+XmlRpcSocket::connect(std::string const& host, int port, double timeout,
+                      XmlRpcSocketOptions const& options)
+{
+  XmlRpcConnectRace race;
+  if ( ! race.start(host, port, options))
+    return -1;
+
+  int fd = race.wait(timeout);
+  if (fd >= 0)
+    setBlocking(fd);
+  return fd;
+}
+
+#if !defined(_WIN32)
+
+int
+XmlRpcSocket::socketUnix()
+{
+  return ::socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+
+// Fill in the address of a Unix domain socket, false if the path is too long
+static bool
+unixAddress(const char* path, struct sockaddr_un* saddr)
+{
+  memset(saddr, 0, sizeof(*saddr));
+  saddr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(saddr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(saddr->sun_path, path);
+  return true;
+}
+
+
+// Returns true if nothing accepts connections on the socket file at a path.
+// The probe does not block, so a live server with a full backlog is not
+// mistaken for a stale file.
+static bool
+isStaleUnix(struct sockaddr_un const& saddr)
+{
+  int s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0)
+    return false;
+  fcntl(s, F_SETFL, O_NONBLOCK);
+  bool stale = ::connect(s, (struct sockaddr *)&saddr, sizeof(saddr)) != 0 && errno == ECONNREFUSED;
+  ::close(s);
+  return stale;
+}
+
+
+// Bind to a Unix domain socket path
+bool
+XmlRpcSocket::bindUnix(int fd, const char* path, unsigned long long* inode /*= 0*/)
+{
+  struct sockaddr_un saddr;
+  if ( ! unixAddress(path, &saddr))
+    return false;
+
+  // Remove a socket file left behind by an earlier server, but nothing else
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && isStaleUnix(saddr))
+    ::unlink(path);
+
+  if (::bind(fd, (struct sockaddr *)&saddr, sizeof(saddr)) != 0)
+    return false;
+
+  if (inode)
+    *inode = (lstat(path, &st) == 0) ? (unsigned long long) st.st_ino : 0;
+  return true;
+}
+
+
+// Remove the socket file at a path if it is still the one bound
+void
+XmlRpcSocket::removeUnix(const char* path, unsigned long long inode)
+{
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && (unsigned long long) st.st_ino == inode)
+    ::unlink(path);
+}
+
+
+// Connect a Unix domain socket to a server (from a client)
+bool
+XmlRpcSocket::connectUnix(int fd, std::string const& path)
+{
+  struct sockaddr_un saddr;
+  if ( ! unixAddress(path.c_str(), &saddr))
+    return false;
+
   int result = ::connect(fd, (struct sockaddr *)&saddr, sizeof(saddr));
   return result == 0 || nonFatalError();
 }
 
+#endif // _WIN32
+
 #ifdef _OPENSSL_ENABLED
-// Sets SSL on the given socket
+// Log the reason a TLS operation failed
+static void
+logSSLError(const char* where, int error)
+{
+  unsigned long code = ERR_get_error();
+  char reason[256];
+  if (code)
+    ERR_error_string_n(code, reason, sizeof(reason));
+  else
+    snprintf(reason, sizeof(reason), "%s", XmlRpcSocket::getErrorMsg().c_str());
+  XmlRpcUtil::error("%s: TLS error %d (%s).", where, error, reason);
+  ERR_clear_error();
+}
+
+
+// State kept with each TLS connection
+struct SSLConnectionInfo {
+  std::string _sessionKey;    // context and host:port of the server, for clients
+  std::chrono::steady_clock::time_point _start;
+};
+
+
+// The index of the connection state in the SSL ex data
+static int
+sslInfoIndex()
+{
+  static int index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+  return index;
+}
+
+
+// Client sessions to resume, by server. The cache holds a reference to each.
+static std::mutex sessionLock;
+static std::map<std::string, SSL_SESSION*> sessionCache;
+static const size_t MAX_SESSIONS = 256;
+
+
+// Keep a session offered by a server. With TLS 1.3 this happens after the
+// handshake, when the server's tickets are read.
+static int
+newSession(SSL* ssl, SSL_SESSION* session)
+{
+  SSLConnectionInfo* info = (SSLConnectionInfo*) SSL_get_ex_data(ssl, sslInfoIndex());
+  if ( ! info || info->_sessionKey.empty() || ! SSL_SESSION_is_resumable(session))
+    return 0;
+
+  std::lock_guard<std::mutex> lock(sessionLock);
+  std::map<std::string, SSL_SESSION*>::iterator it = sessionCache.find(info->_sessionKey);
+  if (it != sessionCache.end())
+    SSL_SESSION_free(it->second);
+  else {
+    if (sessionCache.size() >= MAX_SESSIONS) {
+      SSL_SESSION_free(sessionCache.begin()->second);
+      sessionCache.erase(sessionCache.begin());
+    }
+    it = sessionCache.insert(std::make_pair(info->_sessionKey, (SSL_SESSION*)0)).first;
+  }
+  it->second = session;
+  return 1;     // The cache keeps the reference
+}
+
+
+// Take the session to resume with a server. Each session is used once, the
+// resumed connection receives a new one.
+static SSL_SESSION*
+takeSession(std::string const& key)
+{
+  std::lock_guard<std::mutex> lock(sessionLock);
+  std::map<std::string, SSL_SESSION*>::iterator it = sessionCache.find(key);
+  if (it == sessionCache.end())
+    return NULL;
+  SSL_SESSION* session = it->second;
+  sessionCache.erase(it);
+  return session;
+}
+
+
 void
-XmlRpcSocket::enableSSL(int socket, void **sslHandle)
-{
-    /* Variables */
-    SSL_CTX *Ctx;
-    SSL *cSSL;
-
-    /* Create the context */
-    Ctx = SSL_CTX_new( SSLv23_client_method());
-    SSL_CTX_set_options(Ctx, SSL_OP_ALL | SSL_MODE_AUTO_RETRY);
-
-    /* Create the actual SSL handle */
-    cSSL = SSL_new(Ctx);
-
-    /* Bind socket */
-    SSL_set_fd(cSSL, socket);
-    SSL_set_connect_state(cSSL);
-
-    /* Establish secure link */
-    while (-1 == SSL_connect(cSSL))
-    {
-        if (SSL_get_error(cSSL, -1) != SSL_ERROR_WANT_READ
-                && SSL_get_error(cSSL, -1) != SSL_ERROR_WANT_WRITE) {
-            XmlRpcUtil::error("XmlRpcSocket::enableSSL: accepting ssl socket returned error %i (org %i, errno %s): %s.",
-                              SSL_get_error(cSSL, -1), -1, strerror(errno), ERR_error_string(ERR_get_error(), NULL));
-            break;
-        }
+XmlRpcSocket::clearSSLSessions()
+{
+  std::lock_guard<std::mutex> lock(sessionLock);
+  for (std::map<std::string, SSL_SESSION*>::iterator it = sessionCache.begin(); it != sessionCache.end(); ++it)
+    SSL_SESSION_free(it->second);
+  sessionCache.clear();
+}
+
+
+// Counters of the handshakes completed
+static std::atomic<unsigned long long> fullHandshakes(0);
+static std::atomic<unsigned long long> resumedHandshakes(0);
+static std::atomic<unsigned long long> fullMicroseconds(0);
+static std::atomic<unsigned long long> resumedMicroseconds(0);
+
+
+XmlRpcSocket::SSLStats
+XmlRpcSocket::getSSLStats()
+{
+  SSLStats stats;
+  stats.fullHandshakes = fullHandshakes;
+  stats.resumedHandshakes = resumedHandshakes;
+  stats.fullMicroseconds = fullMicroseconds;
+  stats.resumedMicroseconds = resumedMicroseconds;
+  return stats;
+}
+
+
+void
+XmlRpcSocket::resetSSLStats()
+{
+  fullHandshakes = 0;
+  resumedHandshakes = 0;
+  fullMicroseconds = 0;
+  resumedMicroseconds = 0;
+}
+
+
+// Create a context for client or server connections
+void*
+XmlRpcSocket::createSSLContext(bool server, const char* certFile, const char* keyFile)
+{
+  SSL_CTX* ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+  if ( ! ctx) {
+    logSSLError("XmlRpcSocket::createSSLContext", 0);
+    return NULL;
+  }
+
+  // Writes are retried from wherever the caller's buffer is, and may be partial
+  SSL_CTX_set_options(ctx, SSL_OP_ALL);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // A peer closing without a close notification is seen as the end of the data
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+  // Sessions are resumed from the server's cache (TLS 1.2) or from tickets
+  if (server)
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*) "XmlRpc++", 8);
+
+  if (certFile && (SSL_CTX_use_certificate_chain_file(ctx, certFile) != 1 ||
+                   SSL_CTX_use_PrivateKey_file(ctx, keyFile ? keyFile : certFile, SSL_FILETYPE_PEM) != 1 ||
+                   SSL_CTX_check_private_key(ctx) != 1)) {
+    logSSLError("XmlRpcSocket::createSSLContext: could not load the certificate", 0);
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+
+void
+XmlRpcSocket::freeSSLContext(void* context)
+{
+  SSL_CTX_free((SSL_CTX*)context);
+}
+
+
+// Clients keep their sessions by server, rather than in OpenSSL's cache
+// which clients do not search. Servers are verified against caFile, or the
+// system's certificate authorities if it is 0, unless verifyPeer is false.
+static void*
+createClientContext(const char* caFile, bool verifyPeer)
+{
+  SSL_CTX* ctx = (SSL_CTX*) XmlRpcSocket::createSSLContext(false);
+  if ( ! ctx)
+    return NULL;
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, newSession);
+
+  if (verifyPeer) {
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    int loaded = caFile ? SSL_CTX_load_verify_locations(ctx, caFile, NULL)
+                        : SSL_CTX_set_default_verify_paths(ctx);
+    if (loaded != 1) {
+      logSSLError("XmlRpcSocket::getClientSSLContext: could not load the certificate authorities", 0);
+      SSL_CTX_free(ctx);
+      return NULL;
     }
+  }
+  return ctx;
+}
+
+
+// The client contexts, by verification settings. They are never freed, so
+// the sessions kept for one are only resumed by clients with the same settings.
+static std::mutex clientContextLock;
+static std::map<std::string, void*> clientContexts;
+
+
+void*
+XmlRpcSocket::getClientSSLContext(const char* caFile /*= 0*/, bool verifyPeer /*= true*/)
+{
+  std::string key = ! verifyPeer ? std::string("none") : caFile ? std::string("file:") + caFile : std::string("default");
+
+  std::lock_guard<std::mutex> lock(clientContextLock);
+  std::map<std::string, void*>::iterator it = clientContexts.find(key);
+  if (it != clientContexts.end())
+    return it->second;
+
+  void* context = createClientContext(verifyPeer ? caFile : 0, verifyPeer);
+  if (context)
+    clientContexts[key] = context;
+  return context;
+}
 
-    /* Store */
-    *sslHandle = cSSL;
 
-    /* Set non-block */
-    setNonBlocking(socket);
+// Let the kernel encrypt and send the records (kTLS)
+void
+XmlRpcSocket::setKernelTLS(void* context, bool enable)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+  if (enable)
+    SSL_CTX_set_options((SSL_CTX*)context, SSL_OP_ENABLE_KTLS);
+  else
+    SSL_CTX_clear_options((SSL_CTX*)context, SSL_OP_ENABLE_KTLS);
+#else
+  (void) context;
+  (void) enable;
+#endif
 }
+
+
+bool
+XmlRpcSocket::isKernelTLS(void* sslHandle)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+  return BIO_get_ktls_send(SSL_get_wbio((SSL*)sslHandle));
+#else
+  (void) sslHandle;
+  return false;
 #endif
+}
+
+
+// Start TLS on a connected socket
+void*
+XmlRpcSocket::createSSL(void* context, int socket, bool server, const char* serverName, int port)
+{
+  SSL* ssl = SSL_new((SSL_CTX*)context);
+  SSLConnectionInfo* info = new SSLConnectionInfo;
+  if ( ! ssl || SSL_set_fd(ssl, socket) != 1 || ! SSL_set_ex_data(ssl, sslInfoIndex(), info)) {
+    logSSLError("XmlRpcSocket::createSSL", 0);
+    SSL_free(ssl);
+    delete info;
+    return NULL;
+  }
+  info->_start = std::chrono::steady_clock::now();
+
+  if (server)
+    SSL_set_accept_state(ssl);
+  else {
+    // Name the server, unless it is addressed by number
+    unsigned char addr[sizeof(struct in6_addr)];
+    bool numeric = serverName && (inet_pton(AF_INET, serverName, addr) == 1 ||
+                                  inet_pton(AF_INET6, serverName, addr) == 1);
+    if (serverName && *serverName && ! numeric)
+      SSL_set_tlsext_host_name(ssl, serverName);
+
+    // The server's certificate must be for the name or address connected to
+    if (SSL_get_verify_mode(ssl) & SSL_VERIFY_PEER) {
+      int named = ( ! serverName || ! *serverName) ? 0
+                : numeric ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), serverName)
+                : SSL_set1_host(ssl, serverName);
+      if (named != 1) {
+        logSSLError("XmlRpcSocket::createSSL: no server name to verify", 0);
+        SSL_free(ssl);
+        delete info;
+        return NULL;
+      }
+    }
+
+    // Resume the last session with the server made through the same context
+    if (serverName && *serverName && port > 0) {
+      char contextId[32];
+      snprintf(contextId, sizeof(contextId), "%p/", context);
+      info->_sessionKey = contextId + std::string(serverName) + ":" + std::to_string(port);
+      SSL_SESSION* session = takeSession(info->_sessionKey);
+      if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+      }
+    }
+    SSL_set_connect_state(ssl);
+  }
+  return ssl;
+}
+
+
+// Continue the handshake as far as the socket allows
+int
+XmlRpcSocket::handshakeSSL(void* sslHandle)
+{
+  SSL* ssl = (SSL*)sslHandle;
+  ERR_clear_error();
+  int n = SSL_do_handshake(ssl);
+  if (n == 1) {
+    SSLConnectionInfo* info = (SSLConnectionInfo*) SSL_get_ex_data(ssl, sslInfoIndex());
+    if (info) {
+      unsigned long long us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - info->_start).count();
+      if (SSL_session_reused(ssl)) {
+        ++resumedHandshakes;
+        resumedMicroseconds += us;
+      } else {
+        ++fullHandshakes;
+        fullMicroseconds += us;
+      }
+    }
+    return 1;
+  }
+
+  int error = SSL_get_error(ssl, n);
+  if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+    return 0;
+
+  logSSLError("XmlRpcSocket::handshakeSSL", error);
+  return -1;
+}
+
+
+// The events the last TLS operation is waiting for
+unsigned
+XmlRpcSocket::getSSLEvents(void* sslHandle)
+{
+  switch (SSL_want((SSL*)sslHandle)) {
+    case SSL_READING: return XmlRpcDispatch::ReadableEvent;
+    case SSL_WRITING: return XmlRpcDispatch::WritableEvent;
+    default:          return 0;
+  }
+}
+
+
+bool
+XmlRpcSocket::hasPendingSSL(void* sslHandle)
+{
+  return SSL_pending((SSL*)sslHandle) > 0;
+}
+
+
+// Send a close notification, if the socket has room for it
+void
+XmlRpcSocket::shutdownSSL(void* sslHandle)
+{
+  ERR_clear_error();
+  if (SSL_is_init_finished((SSL*)sslHandle))
+    SSL_shutdown((SSL*)sslHandle);
+  ERR_clear_error();
+}
+
+
+void
+XmlRpcSocket::freeSSL(void* sslHandle)
+{
+  SSL* ssl = (SSL*)sslHandle;
+  delete (SSLConnectionInfo*) SSL_get_ex_data(ssl, sslInfoIndex());
+  SSL_free(ssl);
+}
+
+
+// Interpret a TLS read or write that did not transfer data. Returns 1 if it
+// has to wait for the socket, 0 at the end of the data, -1 on error.
+static int
+checkSSLResult(SSL* ssl, int n, const char* where)
+{
+  int error = SSL_get_error(ssl, n);
+  switch (error) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      return 1;
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      if (ERR_peek_error() == 0 && n == 0)
+        return 0;     // The peer closed the connection
+      // fall through
+    default:
+      logSSLError(where, error);
+      return -1;
+  }
+}
+#endif
+
+// Counters of the reads made by nbRead
+static std::atomic<unsigned long long> readCalls(0);
+static std::atomic<unsigned long long> readBytes(0);
+static std::atomic<unsigned long long> readWouldBlock(0);
+static std::atomic<unsigned long long> readShort(0);
+static std::atomic<unsigned long long> readTargets(0);
+
+
+XmlRpcSocket::ReadStats
+XmlRpcSocket::getReadStats()
+{
+  ReadStats stats;
+  stats.reads = readCalls;
+  stats.bytes = readBytes;
+  stats.wouldBlock = readWouldBlock;
+  stats.shortReads = readShort;
+  stats.targets = readTargets;
+  return stats;
+}
+
+
+void
+XmlRpcSocket::resetReadStats()
+{
+  readCalls = 0;
+  readBytes = 0;
+  readWouldBlock = 0;
+  readShort = 0;
+  readTargets = 0;
+}
+
 
 // Read available text from the specified socket. Returns false on error.
+// The sockets are polled level triggered, so a read that returns less than
+// was asked for has emptied the socket, and trying again would only fail
+// with EWOULDBLOCK. Data left in the socket is reported again.
 bool 
 #ifdef _OPENSSL_ENABLED
-XmlRpcSocket::nbRead(int fd, std::string& s, bool *eof, void *sslHandle)
+XmlRpcSocket::nbRead(int fd, std::string& s, bool *eof, void *sslHandle, int target)
 #else
-XmlRpcSocket::nbRead(int fd, std::string& s, bool *eof)
+XmlRpcSocket::nbRead(int fd, std::string& s, bool *eof, int target)
 #endif
 {
   const int READ_SIZE = 4096;   // Number of bytes to attempt to read at a time
@@ -231,30 +1332,61 @@ XmlRpcSocket::nbRead(int fd, std::string& s, bool *eof)
   *eof = false;
 
   while ( ! wouldBlock && ! *eof) {
+      // Read no further than the target
+      int nToRead = READ_SIZE-1;
+      if (target >= 0) {
+        int remaining = target - int(s.length());
+        if (remaining <= 0) {
+          ++readTargets;
+          break;
+        }
+        if (remaining < nToRead)
+          nToRead = remaining;
+      }
+
       int n = 0;
+      bool pending = false;
+      bool sslWait = false;
 #ifdef _OPENSSL_ENABLED
       if (sslHandle == NULL) {
 #endif
 #if defined(_WIN32)
-          n = recv(fd, readBuf, READ_SIZE-1, 0);
+          n = recv(fd, readBuf, nToRead, 0);
 #else
-          n = read(fd, readBuf, READ_SIZE-1);
+          n = read(fd, readBuf, nToRead);
 #endif
 #ifdef _OPENSSL_ENABLED
       }
       else {
-          n = SSL_read((SSL*)sslHandle, readBuf, READ_SIZE-1);
+          // Data already decrypted by OpenSSL is not seen by the poll
+          ERR_clear_error();
+          n = SSL_read((SSL*)sslHandle, readBuf, nToRead);
+          pending = SSL_pending((SSL*)sslHandle) > 0;
+          if (n <= 0) {
+            int status = checkSSLResult((SSL*)sslHandle, n, "XmlRpcSocket::nbRead");
+            if (status < 0)
+              return false;
+            n = -status;
+            sslWait = (status > 0);
+          }
       }
 #endif
+    ++readCalls;
 
     XmlRpcUtil::log(5, "XmlRpcSocket::nbRead: read/recv returned %d.", n);
 
     if (n > 0) {
       readBuf[n] = 0;
       s.append(readBuf, n);
+      readBytes += n;
+      if (n < nToRead && ! pending) {
+        ++readShort;
+        break;
+      }
     } else if (n == 0) {
       *eof = true;
-    } else if (nonFatalError()) {
+    } else if (sslWait || nonFatalError()) {
+      ++readWouldBlock;
       wouldBlock = true;
     } else {
       return false;   // Error
@@ -267,15 +1399,21 @@ XmlRpcSocket::nbRead(int fd, std::string& s, bool *eof)
 // Write text to the specified socket. Returns false on error.
 bool 
 #ifdef _OPENSSL_ENABLED
-XmlRpcSocket::nbWrite(int fd, std::string& s, int *bytesSoFar, void *sslHandle)
+XmlRpcSocket::nbWrite(int fd, std::string const& s, int *bytesSoFar, void *sslHandle)
 #else
-XmlRpcSocket::nbWrite(int fd, std::string& s, int *bytesSoFar)
+XmlRpcSocket::nbWrite(int fd, std::string const& s, int *bytesSoFar)
 #endif
 {
   int nToWrite = int(s.length()) - *bytesSoFar;
   char *sp = const_cast<char*>(s.c_str()) + *bytesSoFar;
   bool wouldBlock = false;
 
+#ifdef _OPENSSL_ENABLED
+  // The kernel encrypts what is written to the socket
+  if (sslHandle != NULL && isKernelTLS(sslHandle))
+    sslHandle = NULL;
+#endif
+
   while ( nToWrite > 0 && ! wouldBlock ) {
       int n = 0;
 #ifdef _OPENSSL_ENABLED
@@ -283,13 +1421,22 @@ XmlRpcSocket::nbWrite(int fd, std::string& s, int *bytesSoFar)
 #endif
 #if defined(_WIN32)
         n = send(fd, sp, nToWrite, 0);
+#elif defined(MSG_NOSIGNAL)
+        // A peer that closed the connection is an error, not a signal
+        n = send(fd, sp, nToWrite, MSG_NOSIGNAL);
 #else
         n = write(fd, sp, nToWrite);
 #endif
 #ifdef _OPENSSL_ENABLED
       }
       else {
+        ERR_clear_error();
         n = SSL_write((SSL*)sslHandle, sp, nToWrite);
+        if (n <= 0) {
+          if (checkSSLResult((SSL*)sslHandle, n, "XmlRpcSocket::nbWrite") <= 0)
+            return false;
+          break;    // Wait for the socket
+        }
       }
 #endif
 
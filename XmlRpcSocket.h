@@ -10,10 +10,96 @@
 
 #ifndef MAKEDEPEND
 # include <string>
+# include <vector>
 #endif
 
 namespace XmlRpc {
 
+  //! Tuning options for TCP sockets. Options a platform does not support are ignored.
+  struct XmlRpcSocketOptions {
+    XmlRpcSocketOptions() : noDelay(true), cork(false), sendBuffer(0), receiveBuffer(0),
+                            fastOpen(0), deferAccept(0) {}
+
+    //! Send small messages immediately instead of waiting for outstanding
+    //! data to be acknowledged (TCP_NODELAY). Default is true.
+    bool noDelay;
+
+    //! Hold partial frames while a message is being written, so the header and
+    //! body leave in full sized segments (TCP_CORK, Linux only). Default is false.
+    bool cork;
+
+    //! Socket buffer sizes in bytes (SO_SNDBUF, SO_RCVBUF), 0 for the system default.
+    int sendBuffer;
+    int receiveBuffer;
+
+    //! TCP Fast Open. For servers, the length of the queue of pending fast open
+    //! requests; for clients, non-zero to send the request with the SYN
+    //! (TCP_FASTOPEN_CONNECT, Linux only). 0 disables fast open, which is the default.
+    int fastOpen;
+
+    //! For servers, seconds to wait for a request before a connection is
+    //! accepted (TCP_DEFER_ACCEPT, Linux only). 0 disables, which is the default.
+    int deferAccept;
+  };
+
+
+  //! Connection attempts to the addresses of a host. When the host has several
+  //! addresses, attempts are started in turn every 250ms, alternating between
+  //! IPv6 and IPv4, and the first to connect is used ("happy eyeballs", RFC 8305).
+  //! The caller waits for the pending attempts to become writable or for the
+  //! next attempt to be due, in its own event loop or with wait(), then calls check().
+  class XmlRpcConnectRace {
+  public:
+    //! Constructor
+    XmlRpcConnectRace();
+
+    //! Destructor. Closes the attempts in progress.
+    ~XmlRpcConnectRace();
+
+    //! Resolve the host, the first attempt is started by check().
+    //! Returns false if the host could not be resolved.
+    //!  @param background If true, a host that is neither cached nor an address
+    //!   is resolved on a worker thread instead (except on Windows). Until its
+    //!   addresses arrive, getResolverFd() becomes readable when they do.
+    bool start(std::string const& host, int port,
+               XmlRpcSocketOptions const& options = XmlRpcSocketOptions(),
+               bool background = false);
+
+    //! Return the descriptor that becomes readable once the host has been
+    //! resolved in the background, or -1 if it is not being resolved.
+    int getResolverFd() const;
+
+    //! Collect the attempts that completed and start the next attempt if it
+    //! is due. Returns the connected socket, in non-blocking mode and owned by
+    //! the caller, or -1 if there is none yet (@see isFailed).
+    int check();
+
+    //! Returns true if every address was tried without success.
+    bool isFailed() const;
+
+    //! Return the sockets of the attempts in progress.
+    std::vector<int> const& getPending() const { return _pending; }
+
+    //! Return the seconds until the next attempt is due, or -1 if every
+    //! address has been tried or the host is still being resolved.
+    double getDelay() const;
+
+    //! Wait for a connection, at most timeout seconds (0 for no limit).
+    //! Returns the connected socket, or -1 on failure.
+    int wait(double timeout);
+
+    //! Close the attempts in progress and give up on the other addresses.
+    void cancel();
+
+  private:
+    struct Addresses;
+    Addresses* _addresses;
+    size_t _next;
+    std::vector<int> _pending;
+    XmlRpcSocketOptions _options;
+  };
+
+
   //! A platform-independent socket API.
   class XmlRpcSocket {
   public:
@@ -21,36 +107,144 @@ namespace XmlRpc {
     //! Creates a stream (TCP) socket. Returns -1 on failure.
     static int socket();
 
+    //! Creates a stream (TCP) socket accepting both IPv6 and IPv4 connections
+    //! once bound, or an IPv4 socket if IPv6 is not available. Returns -1 on failure.
+    static int socketDualStack();
+
     //! Closes a socket.
     static void close(int socket);
 
     //! Sets a stream (TCP) socket to perform non-blocking IO. Returns false on failure.
     static bool setNonBlocking(int socket);
 
+    //! Apply the options that concern connected sockets (TCP_NODELAY and the
+    //! buffer sizes). The TCP options are skipped for other kinds of socket.
+    //! Returns false on failure.
+    static bool setOptions(int socket, XmlRpcSocketOptions const& options);
+
+    //! Apply the options that concern listening sockets (fast open and deferred
+    //! accept), before listen(). Returns false on failure.
+    static bool setListenOptions(int socket, XmlRpcSocketOptions const& options);
+
+    //! Cork or uncork a socket (@see XmlRpcSocketOptions::cork). Uncorking sends
+    //! any partial frame that was held.
+    static void setCork(int socket, bool cork);
+
 #ifdef _OPENSSL_ENABLED
-    //! Sets SSL on the given socket
-    static void enableSSL(int socket, void **sslHandle);
+    //! Create a TLS context, shared by the connections of a client or a server.
+    //! Returns NULL on failure.
+    //!  @param server True for a context accepting connections
+    //!  @param certFile The certificate chain, in a PEM file, 0 for none
+    //!  @param keyFile The private key, in a PEM file, 0 if it is in certFile
+    static void* createSSLContext(bool server, const char* certFile = 0, const char* keyFile = 0);
+
+    //! Free a TLS context. Connections still using it keep it until they are freed.
+    static void freeSSLContext(void* context);
+
+    //! Return the TLS context shared by the clients of the process with the
+    //! same verification settings, created on first use. Its connections keep
+    //! the sessions the servers offer, and resume them when they connect to
+    //! the same server again. Returns NULL if the context cannot be created.
+    //!  @param caFile The certificate authorities servers are verified
+    //!   against, in a PEM file, 0 for those of the system
+    //!  @param verifyPeer False to accept any server certificate
+    static void* getClientSSLContext(const char* caFile = 0, bool verifyPeer = true);
+
+    //! Forget the sessions kept for resumption.
+    static void clearSSLSessions();
+
+    //! Let the kernel encrypt the records sent on the connections of a context
+    //! (kTLS), where OpenSSL and the kernel support it for the cipher agreed.
+    //! The data is then written to the socket as it is without TLS. Takes
+    //! effect on the handshakes that follow.
+    static void setKernelTLS(void* context, bool enable);
+
+    //! Returns true if the kernel encrypts the records sent on a connection.
+    static bool isKernelTLS(void* sslHandle);
+
+    //! Start TLS on a connected, non-blocking socket. The handshake is
+    //! performed by handshakeSSL(). Returns NULL on failure.
+    //!  @param serverName For clients, the host name sent to the server, and
+    //!   the name or address its certificate is verified for
+    //!  @param port For clients, the server port. With serverName, it selects
+    //!   the session to resume.
+    static void* createSSL(void* context, int socket, bool server, const char* serverName = 0, int port = 0);
+
+    //! Continue the TLS handshake. Returns 1 once it is complete, 0 if it has to
+    //! wait for the socket (@see getSSLEvents), or -1 on failure.
+    static int handshakeSSL(void* sslHandle);
+
+    //! Return the events (@see XmlRpcDispatch::EventType) the last TLS operation
+    //! that would have blocked is waiting for, 0 if it is not waiting.
+    static unsigned getSSLEvents(void* sslHandle);
+
+    //! Returns true if data has been decrypted but not read yet. The socket
+    //! does not become readable for it.
+    static bool hasPendingSSL(void* sslHandle);
+
+    //! Send a close notification, if the handshake was completed. Does not wait.
+    static void shutdownSSL(void* sslHandle);
+
+    //! Free TLS on a socket.
+    static void freeSSL(void* sslHandle);
+
+    //! Counters of the TLS handshakes completed in the process, by clients
+    //! and servers, and the time from the start of TLS to their completion.
+    struct SSLStats {
+      unsigned long long fullHandshakes;      //!< handshakes that set up a new session
+      unsigned long long resumedHandshakes;   //!< handshakes that resumed a session
+      unsigned long long fullMicroseconds;    //!< total time of the full handshakes
+      unsigned long long resumedMicroseconds; //!< total time of the resumed handshakes
+    };
+
+    //! Return the handshake counters.
+    static SSLStats getSSLStats();
+
+    //! Set the handshake counters to 0.
+    static void resetSSLStats();
 
     //! Read text from the specified socket. Returns false on error.
-    static bool nbRead(int socket, std::string& s, bool *eof, void *sslHandle = NULL);
+    //! Reading stops when a read returns less than was asked for, as the rest
+    //! arrives as a new readable event, or once s holds target bytes.
+    //!  @param target The length s needs to reach, -1 if it is not known
+    static bool nbRead(int socket, std::string& s, bool *eof, void *sslHandle = NULL, int target = -1);
 
     //! Write text to the specified socket. Returns false on error.
-    static bool nbWrite(int socket, std::string& s, int *bytesSoFar, void *sslHandle = NULL);
+    static bool nbWrite(int socket, std::string const& s, int *bytesSoFar, void *sslHandle = NULL);
 #else
     //! Read text from the specified socket. Returns false on error.
-    static bool nbRead(int socket, std::string& s, bool *eof);
+    //! Reading stops when a read returns less than was asked for, as the rest
+    //! arrives as a new readable event, or once s holds target bytes.
+    //!  @param target The length s needs to reach, -1 if it is not known
+    static bool nbRead(int socket, std::string& s, bool *eof, int target = -1);
 
     //! Write text to the specified socket. Returns false on error.
-    static bool nbWrite(int socket, std::string& s, int *bytesSoFar);
+    static bool nbWrite(int socket, std::string const& s, int *bytesSoFar);
 #endif
 
+    //! Counters of the reads made by nbRead, for all sockets in the process.
+    struct ReadStats {
+      unsigned long long reads;       //!< read calls made
+      unsigned long long bytes;       //!< bytes read
+      unsigned long long wouldBlock;  //!< reads that found no data
+      unsigned long long shortReads;  //!< reads that stopped reading by returning less than asked for
+      unsigned long long targets;     //!< reads that stopped reading by reaching the target length
+    };
+
+    //! Return the read counters.
+    static ReadStats getReadStats();
+
+    //! Set the read counters to 0.
+    static void resetReadStats();
+
     // The next four methods are appropriate for servers.
 
     //! Allow the port the specified socket is bound to to be re-bound immediately so 
     //! server re-starts are not delayed. Returns false on failure.
     static bool setReuseAddr(int socket);
 
-    //! Bind to a specified port
+    //! Bind to a specified port on all interfaces. IPv6 sockets are bound
+    //! to accept IPv4 connections as well.
     static bool bind(int socket, int port);
 
     //! Set socket in listen mode
@@ -59,12 +253,55 @@ namespace XmlRpc {
     //! Accept a client connection request
     static int accept(int socket);
 
+    //! Accept a client connection request, returning a socket set to perform
+    //! non-blocking IO and closed on exec. Returns -1 when no connection is
+    //! pending (@see nonFatalError) or on failure.
+    static int acceptNonBlocking(int socket);
+
     //! Connect a socket to a server (from a client)
     static bool connect(int socket, std::string& host, int port);
 
+    //! Create a socket and connect it to a server (from a client), waiting for
+    //! the connection. The host's addresses are raced (@see XmlRpcConnectRace),
+    //! use XmlRpcConnectRace directly to connect without waiting.
+    //!  @param timeout Seconds to wait at most, 0 for no limit
+    //!  @param options Options applied to the socket before connecting
+    //!  @return The socket in blocking mode, or -1 on failure
+    static int connect(std::string const& host, int port, double timeout,
+                       XmlRpcSocketOptions const& options = XmlRpcSocketOptions());
+
+    //! Specify how many seconds resolved host addresses are cached, 0 to disable
+    //! the cache. Default is 60.
+    static void setResolverCacheTtl(double seconds);
+
+    //! Discard all cached host addresses.
+    static void clearResolverCache();
+
+#if !defined(_WIN32)
+    //! Creates a Unix domain stream socket. Returns -1 on failure.
+    static int socketUnix();
+
+    //! Bind to a Unix domain socket path. A socket file left at the path by an
+    //! earlier server is replaced once connecting to it is refused; a path
+    //! a server still listens on fails with EADDRINUSE.
+    //!  @param inode If not 0, set to the inode of the bound socket file
+    static bool bindUnix(int socket, const char* path, unsigned long long* inode = 0);
+
+    //! Remove the socket file at a path, unless it has been replaced since
+    //! it was bound with the inode given.
+    static void removeUnix(const char* path, unsigned long long inode);
+
+    //! Connect a Unix domain socket to a server (from a client)
+    static bool connectUnix(int socket, std::string const& path);
+#endif
+
     //! Returns last errno
     static int getError();
 
+    //! Returns true if the last error only means the operation would block
+    //! or was interrupted, and should be retried later.
+    static bool nonFatalError();
+
     //! Returns message corresponding to last error
     static std::string getErrorMsg();
 
@@ -0,0 +1,133 @@
+
+#include "XmlRpcThreadPool.h"
+#include "XmlRpcUtil.h"
+
+#ifndef MAKEDEPEND
+# include <atomic>
+# include <exception>
+# include <memory>
+#endif
+
+namespace XmlRpc {
+
+
+  XmlRpcThreadPool::XmlRpcThreadPool(int nThreads /*= 0*/) : _stop(false)
+  {
+    if (nThreads <= 0)
+      nThreads = int(std::thread::hardware_concurrency());
+    if (nThreads <= 0)
+      nThreads = 1;
+
+    XmlRpcUtil::log(2, "XmlRpcThreadPool: starting %d threads.", nThreads);
+    for (int i=0; i<nThreads; ++i)
+      _threads.push_back(std::thread(&XmlRpcThreadPool::run, this));
+  }
+
+
+  XmlRpcThreadPool::~XmlRpcThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      _stop = true;
+    }
+    _ready.notify_all();
+
+    for (size_t i=0; i<_threads.size(); ++i)
+      _threads[i].join();
+  }
+
+
+  // Queue a task for execution by one of the workers
+  void
+  XmlRpcThreadPool::post(std::function<void()> const& task)
+  {
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      _tasks.push_back(task);
+    }
+    _ready.notify_one();
+  }
+
+
+  // Work shared between the caller of parallelFor and the workers helping it.
+  // Helpers may still be queued when the caller returns, so the state is refcounted.
+  struct ParallelForState {
+    ParallelForState(int n, std::function<void(int)> const& fn) : _n(n), _fn(fn), _next(0), _done(0) {}
+
+    // Run calls until there are none left to claim. A call that throws still
+    // counts as done, the first exception is kept for the caller.
+    void work()
+    {
+      int i;
+      while ((i = _next++) < _n) {
+        try {
+          _fn(i);
+        } catch (...) {
+          std::lock_guard<std::mutex> guard(_lock);
+          if ( ! _error)
+            _error = std::current_exception();
+        }
+        if (++_done == _n) {
+          std::lock_guard<std::mutex> guard(_lock);
+          _finished.notify_all();
+        }
+      }
+    }
+
+    int _n;
+    std::function<void(int)> _fn;
+    std::atomic<int> _next;
+    std::atomic<int> _done;
+    std::mutex _lock;
+    std::condition_variable _finished;
+    std::exception_ptr _error;
+  };
+
+
+  // Call fn(0) .. fn(n-1) concurrently and wait for all of them
+  void
+  XmlRpcThreadPool::parallelFor(int n, std::function<void(int)> const& fn)
+  {
+    if (n <= 0)
+      return;
+
+    std::shared_ptr<ParallelForState> state(new ParallelForState(n, fn));
+
+    // The calling thread takes a share of the work too
+    int nHelpers = (n - 1 < size()) ? n - 1 : size();
+    for (int i=0; i<nHelpers; ++i)
+      post([state]() { state->work(); });
+
+    state->work();
+
+    std::unique_lock<std::mutex> guard(state->_lock);
+    while (state->_done < n)
+      state->_finished.wait(guard);
+
+    if (state->_error)
+      std::rethrow_exception(state->_error);
+  }
+
+
+  // Worker thread body: execute tasks until the pool is destroyed
+  void
+  XmlRpcThreadPool::run()
+  {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> guard(_lock);
+        while ( ! _stop && _tasks.empty())
+          _ready.wait(guard);
+
+        if (_tasks.empty())
+          return;   // Stopping and nothing left to do
+
+        task = _tasks.front();
+        _tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+} // namespace XmlRpc
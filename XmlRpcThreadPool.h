@@ -0,0 +1,56 @@
+
+#ifndef _XMLRPCTHREADPOOL_H_
+#define _XMLRPCTHREADPOOL_H_
+//
+// XmlRpc++ Copyright (c) 2002-2003 by Chris Morley
+// XmlRpc++ Copyright (c) 2016 by Philip Meulengracht
+//
+#if defined(_MSC_VER)
+# pragma warning(disable:4786)    // identifier was truncated in debug info
+#endif
+
+#ifndef MAKEDEPEND
+# include <condition_variable>
+# include <deque>
+# include <functional>
+# include <mutex>
+# include <thread>
+# include <vector>
+#endif
+
+namespace XmlRpc {
+
+  //! A fixed set of worker threads executing queued tasks.
+  class XmlRpcThreadPool {
+  public:
+    //! Constructor
+    //!  @param nThreads Number of worker threads, 0 to use one per hardware thread.
+    XmlRpcThreadPool(int nThreads = 0);
+
+    //! Destructor. Waits for the queued tasks to complete.
+    ~XmlRpcThreadPool();
+
+    //! Return the number of worker threads.
+    int size() const { return int(_threads.size()); }
+
+    //! Queue a task for execution by one of the workers.
+    void post(std::function<void()> const& task);
+
+    //! Call fn(0) .. fn(n-1) concurrently on the workers and the calling
+    //! thread, and return once every call has completed. If calls throw, the
+    //! first exception is rethrown after the others have completed.
+    void parallelFor(int n, std::function<void(int)> const& fn);
+
+  private:
+    // Worker thread body
+    void run();
+
+    std::vector<std::thread> _threads;
+    std::deque< std::function<void()> > _tasks;
+    std::mutex _lock;
+    std::condition_variable _ready;
+    bool _stop;
+  };
+} // namespace XmlRpc
+
+#endif // _XMLRPCTHREADPOOL_H_
@@ -174,6 +174,20 @@ XmlRpcUtil::getNextTag(std::string const& xml, int* offset)
 
 
 
+// 64 bit FNV-1a hash
+unsigned long long
+XmlRpcUtil::hash(const char* data, int length)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  for (int i=0; i<length; ++i) {
+    h ^= (unsigned char) data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+
 // xml encodings (xml-encoded entities are preceded with '&')
 static const char  AMP = '&';
 static const char  rawEntity[] = { '<',   '>',   '&',    '\'',    '\"',    0 };
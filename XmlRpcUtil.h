@@ -50,6 +50,10 @@ namespace XmlRpc {
     static std::string xmlDecode(const std::string& encoded);
 
 
+    //! Returns a 64 bit FNV-1a hash of the data, eg to key caches
+    static unsigned long long hash(const char* data, int length);
+
+
     //! Dump messages somewhere
     static void log(int level, const char* fmt, ...);
 